@@ -0,0 +1,82 @@
+/*
+  Host-only stand-in for the VEO API (ve_offload.h).
+
+  Only the subset of the API used by veo-udma and its test programs is
+  provided. A "proc" is the calling host process, a "thread context" is
+  a host thread executing the calls submitted with veo_call_async() in
+  order. VE memory is plain host memory, VE addresses are host addresses.
+*/
+#ifndef VEO_EMU_OFFLOAD_INCLUDE
+#define VEO_EMU_OFFLOAD_INCLUDE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VEO_REQUEST_ID_INVALID (~0UL)
+#define VEO_MAX_NUM_ARGS 32
+
+enum veo_command_state {
+	VEO_COMMAND_OK = 0,
+	VEO_COMMAND_EXCEPTION,
+	VEO_COMMAND_ERROR,
+	VEO_COMMAND_UNFINISHED,
+};
+
+enum veo_context_state {
+	VEO_STATE_UNKNOWN = 0,
+	VEO_STATE_RUNNING,
+	VEO_STATE_SYSCALL,
+	VEO_STATE_BLOCKED,
+	VEO_STATE_EXIT,
+};
+
+enum veo_args_intent {
+	VEO_INTENT_IN = 0,
+	VEO_INTENT_INOUT,
+	VEO_INTENT_OUT,
+};
+
+struct veo_proc_handle;
+struct veo_thr_ctxt;
+struct veo_args;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct veo_proc_handle *veo_proc_create(int venode);
+struct veo_proc_handle *veo_proc_create_static(int venode, char *veobin);
+int veo_proc_destroy(struct veo_proc_handle *proc);
+uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname);
+int veo_unload_library(struct veo_proc_handle *proc, const uint64_t libhdl);
+uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl, const char *symname);
+int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr, const size_t size);
+int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr);
+int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src, size_t size);
+int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src, size_t size);
+
+struct veo_thr_ctxt *veo_context_open(struct veo_proc_handle *proc);
+int veo_context_close(struct veo_thr_ctxt *ctx);
+int veo_get_context_state(struct veo_thr_ctxt *ctx);
+
+struct veo_args *veo_args_alloc(void);
+void veo_args_free(struct veo_args *ca);
+void veo_args_clear(struct veo_args *ca);
+int veo_args_set_i64(struct veo_args *ca, int argnum, int64_t val);
+int veo_args_set_u64(struct veo_args *ca, int argnum, uint64_t val);
+int veo_args_set_i32(struct veo_args *ca, int argnum, int32_t val);
+int veo_args_set_u32(struct veo_args *ca, int argnum, uint32_t val);
+int veo_args_set_stack(struct veo_args *ca, enum veo_args_intent inout,
+		       int argnum, char *buff, size_t len);
+
+uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr, struct veo_args *args);
+int veo_call_peek_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp);
+int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp);
+int veo_call_sync(struct veo_proc_handle *proc, uint64_t addr,
+		  struct veo_args *args, uint64_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VEO_EMU_OFFLOAD_INCLUDE */
@@ -0,0 +1,32 @@
+/*
+  Host-only stand-in for the libsysve user DMA API (vedma.h).
+  DMATB registration is the identity mapping, DMA transfers are memcpys
+  completing after a modeled transfer time.
+*/
+#ifndef VEO_EMU_VEDMA_INCLUDE
+#define VEO_EMU_VEDMA_INCLUDE
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct ve_dma_handle {
+	uint64_t status;	// 0: done, else modeled completion time [ns]
+	int index;
+} ve_dma_handle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ve_dma_init(void);
+int ve_dma_post(uint64_t dst, uint64_t src, int size, ve_dma_handle_t *handle);
+int ve_dma_poll(ve_dma_handle_t *handle);
+int ve_dma_post_wait(uint64_t dst, uint64_t src, int size);
+uint64_t ve_register_mem_to_dmaatb(void *vemva, size_t size);
+int ve_unregister_mem_from_dmaatb(uint64_t vehva);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VEO_EMU_VEDMA_INCLUDE */
@@ -0,0 +1,635 @@
+/*
+  Host-only emulation of the VEO call layer and of the libsysve
+  VH-SHM and user DMA functions used by veo-udma.
+
+  The VE side library (libveo_udma_ve.c) is compiled for the host and
+  loaded with dlopen(). Each thread context is a host thread executing
+  the functions submitted by veo_call_async() one after the other, like
+  a VEO context thread on the VE does.
+
+  Timing models, configured by environment variables:
+  VEO_EMU_CALL_LAT_US  latency of starting a VE call and of returning
+                       its result (default 0)
+  VEO_EMU_DMA_BW       bandwidth of one user DMA engine in MB/s
+                       (default 0: unlimited)
+  VEO_EMU_DMA_LAT_US   latency of a DMA transfer (default 0)
+  VEO_EMU_DMAATB       DMAATB entries available for registering VE
+                       memory (default and max 64), a small value
+                       makes registrations fail
+  Each context thread owns one DMA engine, its transfers are serialized
+  per direction: transfers into VE memory and out of it use separate
+  lanes, like the full duplex PCIe link.
+*/
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "ve_offload.h"
+#include "vhshm.h"
+#include "vedma.h"
+
+#define EMU_MAX_REG_ARGS 12
+#define EMU_MAX_DMAATB 64
+
+static int emu_configured = 0;
+static uint64_t emu_call_lat_ns = 0;
+static uint64_t emu_dma_lat_ns = 0;
+static double emu_dma_bw = 0.0;		// bytes per ns, 0: unlimited
+static int emu_dmaatb_max = EMU_MAX_DMAATB;
+
+/* time until the DMA engine lanes of this (context) thread are busy */
+static __thread uint64_t emu_dma_busy_until[2];
+
+/* VE memory registered to the DMAATB, tells the direction of a transfer */
+static struct {
+	uint64_t addr;
+	size_t size;
+} emu_dmaatb[EMU_MAX_DMAATB];
+static pthread_mutex_t emu_dmaatb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t emu_now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static void emu_config(void)
+{
+	char *env;
+
+	if (emu_configured)
+		return;
+	env = getenv("VEO_EMU_CALL_LAT_US");
+	if (env)
+		emu_call_lat_ns = (uint64_t)(atof(env) * 1000.0);
+	env = getenv("VEO_EMU_DMA_LAT_US");
+	if (env)
+		emu_dma_lat_ns = (uint64_t)(atof(env) * 1000.0);
+	env = getenv("VEO_EMU_DMA_BW");
+	if (env)
+		emu_dma_bw = atof(env) * 1.0e6 / 1.0e9;
+	env = getenv("VEO_EMU_DMAATB");
+	if (env && atoi(env) >= 0 && atoi(env) < EMU_MAX_DMAATB)
+		emu_dmaatb_max = atoi(env);
+	emu_configured = 1;
+}
+
+static void emu_wait_until(uint64_t t)
+{
+	while (emu_now_ns() < t)
+		sched_yield();
+}
+
+struct veo_proc_handle {
+	int venode;
+	void *lib;
+};
+
+struct emu_stack_arg {
+	int intent;
+	char *buff;
+	size_t len;
+};
+
+struct veo_args {
+	int nargs;
+	uint64_t regs[VEO_MAX_NUM_ARGS];
+	struct emu_stack_arg stack[VEO_MAX_NUM_ARGS];
+};
+
+struct emu_cmd {
+	uint64_t reqid;
+	uint64_t addr;
+	int nargs;
+	uint64_t regs[EMU_MAX_REG_ARGS];
+	struct emu_stack_arg stack[EMU_MAX_REG_ARGS];
+	char *copy[EMU_MAX_REG_ARGS];	// VE side copies of stack args
+	volatile int state;
+	uint64_t retval;
+	uint64_t t_start;	// earliest start time
+	uint64_t t_result;	// result visible from this time on
+	struct emu_cmd *next;
+};
+
+struct veo_thr_ctxt {
+	struct veo_proc_handle *proc;
+	pthread_t thr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct emu_cmd *head, *tail;	// submitted, not yet executed
+	struct emu_cmd *done;		// finished, result not yet fetched
+	uint64_t next_reqid;
+	int exit;
+};
+
+typedef uint64_t (*emu_func_t)(uint64_t, uint64_t, uint64_t, uint64_t,
+			       uint64_t, uint64_t, uint64_t, uint64_t,
+			       uint64_t, uint64_t, uint64_t, uint64_t);
+
+
+/*
+  Proc and library handling.
+*/
+struct veo_proc_handle *veo_proc_create(int venode)
+{
+	struct veo_proc_handle *p;
+
+	p = (struct veo_proc_handle *)calloc(1, sizeof(struct veo_proc_handle));
+	if (p)
+		p->venode = venode;
+	return p;
+}
+
+struct veo_proc_handle *veo_proc_create_static(int venode, char *veobin)
+{
+	return veo_proc_create(venode);
+}
+
+int veo_proc_destroy(struct veo_proc_handle *proc)
+{
+	if (proc->lib)
+		dlclose(proc->lib);
+	free(proc);
+	return 0;
+}
+
+uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname)
+{
+	void *lib = dlopen(libname, RTLD_NOW | RTLD_GLOBAL);
+
+	if (lib == NULL) {
+		fprintf(stderr, "[veo_emu] dlopen %s failed: %s\n", libname, dlerror());
+		return 0;
+	}
+	proc->lib = lib;
+	return (uint64_t)lib;
+}
+
+int veo_unload_library(struct veo_proc_handle *proc, const uint64_t libhdl)
+{
+	if (proc->lib == (void *)libhdl)
+		proc->lib = NULL;
+	return dlclose((void *)libhdl);
+}
+
+uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl, const char *symname)
+{
+	void *h = libhdl ? (void *)libhdl : RTLD_DEFAULT;
+
+	return (uint64_t)dlsym(h, symname);
+}
+
+int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr, const size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL)
+		return -1;
+	*addr = (uint64_t)p;
+	return 0;
+}
+
+int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr)
+{
+	free((void *)addr);
+	return 0;
+}
+
+int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src, size_t size)
+{
+	memcpy(dst, (void *)src, size);
+	return 0;
+}
+
+int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src, size_t size)
+{
+	memcpy((void *)dst, src, size);
+	return 0;
+}
+
+
+/*
+  Arguments. Stack arguments are copied when the call is submitted
+  and copied back (OUT, INOUT) when the call has finished.
+*/
+struct veo_args *veo_args_alloc(void)
+{
+	return (struct veo_args *)calloc(1, sizeof(struct veo_args));
+}
+
+void veo_args_clear(struct veo_args *ca)
+{
+	memset(ca, 0, sizeof(struct veo_args));
+}
+
+void veo_args_free(struct veo_args *ca)
+{
+	free(ca);
+}
+
+static int emu_args_set(struct veo_args *ca, int argnum, uint64_t val)
+{
+	if (argnum < 0 || argnum >= EMU_MAX_REG_ARGS)
+		return -1;
+	ca->regs[argnum] = val;
+	ca->stack[argnum].buff = NULL;
+	if (argnum >= ca->nargs)
+		ca->nargs = argnum + 1;
+	return 0;
+}
+
+int veo_args_set_i64(struct veo_args *ca, int argnum, int64_t val)
+{
+	return emu_args_set(ca, argnum, (uint64_t)val);
+}
+
+int veo_args_set_u64(struct veo_args *ca, int argnum, uint64_t val)
+{
+	return emu_args_set(ca, argnum, val);
+}
+
+int veo_args_set_i32(struct veo_args *ca, int argnum, int32_t val)
+{
+	return emu_args_set(ca, argnum, (uint64_t)(int64_t)val);
+}
+
+int veo_args_set_u32(struct veo_args *ca, int argnum, uint32_t val)
+{
+	return emu_args_set(ca, argnum, (uint64_t)val);
+}
+
+int veo_args_set_stack(struct veo_args *ca, enum veo_args_intent inout,
+		       int argnum, char *buff, size_t len)
+{
+	if (emu_args_set(ca, argnum, 0))
+		return -1;
+	ca->stack[argnum].intent = inout;
+	ca->stack[argnum].buff = buff;
+	ca->stack[argnum].len = len;
+	return 0;
+}
+
+
+/*
+  Thread contexts.
+*/
+static void emu_cmd_run(struct emu_cmd *c)
+{
+	int i;
+	emu_func_t f = (emu_func_t)c->addr;
+
+	for (i = 0; i < c->nargs; i++)
+		if (c->copy[i])
+			c->regs[i] = (uint64_t)c->copy[i];
+	c->retval = f(c->regs[0], c->regs[1], c->regs[2], c->regs[3],
+		      c->regs[4], c->regs[5], c->regs[6], c->regs[7],
+		      c->regs[8], c->regs[9], c->regs[10], c->regs[11]);
+	for (i = 0; i < c->nargs; i++) {
+		if (!c->copy[i])
+			continue;
+		if (c->stack[i].intent != VEO_INTENT_IN)
+			memcpy(c->stack[i].buff, c->copy[i], c->stack[i].len);
+		free(c->copy[i]);
+		c->copy[i] = NULL;
+	}
+}
+
+static void *emu_ctx_thread(void *arg)
+{
+	struct veo_thr_ctxt *ctx = (struct veo_thr_ctxt *)arg;
+	struct emu_cmd *c;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (ctx->head == NULL && !ctx->exit)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (ctx->head == NULL)
+			break;
+		c = ctx->head;
+		pthread_mutex_unlock(&ctx->lock);
+
+		emu_wait_until(c->t_start);
+		emu_cmd_run(c);
+		c->t_result = emu_now_ns() + emu_call_lat_ns;
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->head = c->next;
+		if (ctx->head == NULL)
+			ctx->tail = NULL;
+		c->next = ctx->done;
+		ctx->done = c;
+		c->state = VEO_COMMAND_OK;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+struct veo_thr_ctxt *veo_context_open(struct veo_proc_handle *proc)
+{
+	struct veo_thr_ctxt *ctx;
+
+	emu_config();
+	ctx = (struct veo_thr_ctxt *)calloc(1, sizeof(struct veo_thr_ctxt));
+	if (ctx == NULL)
+		return NULL;
+	ctx->proc = proc;
+	ctx->next_reqid = 1;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+	if (pthread_create(&ctx->thr, NULL, emu_ctx_thread, ctx) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+int veo_context_close(struct veo_thr_ctxt *ctx)
+{
+	struct emu_cmd *c;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->exit = 1;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	pthread_join(ctx->thr, NULL);
+	while ((c = ctx->done) != NULL) {
+		ctx->done = c->next;
+		free(c);
+	}
+	free(ctx);
+	return 0;
+}
+
+int veo_get_context_state(struct veo_thr_ctxt *ctx)
+{
+	return ctx->exit ? VEO_STATE_EXIT : VEO_STATE_RUNNING;
+}
+
+uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr, struct veo_args *args)
+{
+	int i;
+	struct emu_cmd *c;
+
+	if (addr == 0)
+		return VEO_REQUEST_ID_INVALID;
+	c = (struct emu_cmd *)calloc(1, sizeof(struct emu_cmd));
+	if (c == NULL)
+		return VEO_REQUEST_ID_INVALID;
+	c->addr = addr;
+	c->state = VEO_COMMAND_UNFINISHED;
+	c->t_start = emu_now_ns() + emu_call_lat_ns;
+	if (args) {
+		c->nargs = args->nargs;
+		for (i = 0; i < args->nargs; i++) {
+			c->regs[i] = args->regs[i];
+			c->stack[i] = args->stack[i];
+			if (args->stack[i].buff == NULL)
+				continue;
+			c->copy[i] = (char *)malloc(args->stack[i].len);
+			if (args->stack[i].intent != VEO_INTENT_OUT)
+				memcpy(c->copy[i], args->stack[i].buff, args->stack[i].len);
+		}
+	}
+	pthread_mutex_lock(&ctx->lock);
+	c->reqid = ctx->next_reqid++;
+	if (ctx->tail)
+		ctx->tail->next = c;
+	else
+		ctx->head = c;
+	ctx->tail = c;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return c->reqid;
+}
+
+/*
+  Look for a finished request and unlink it.
+  Returns VEO_COMMAND_UNFINISHED if it is still running.
+*/
+static int emu_fetch_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp)
+{
+	struct emu_cmd *c, **cp;
+	int rc = VEO_COMMAND_ERROR;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (cp = &ctx->done; *cp; cp = &(*cp)->next) {
+		c = *cp;
+		if (c->reqid == reqid) {
+			if (c->t_result > emu_now_ns()) {
+				rc = VEO_COMMAND_UNFINISHED;
+				goto out;
+			}
+			*cp = c->next;
+			*retp = c->retval;
+			rc = c->state;
+			free(c);
+			goto out;
+		}
+	}
+	for (c = ctx->head; c; c = c->next)
+		if (c->reqid == reqid) {
+			rc = VEO_COMMAND_UNFINISHED;
+			break;
+		}
+out:
+	pthread_mutex_unlock(&ctx->lock);
+	return rc;
+}
+
+int veo_call_peek_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp)
+{
+	int rc = emu_fetch_result(ctx, reqid, retp);
+
+	/* give the context thread a chance on small hosts */
+	if (rc == VEO_COMMAND_UNFINISHED)
+		sched_yield();
+	return rc;
+}
+
+int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid, uint64_t *retp)
+{
+	int rc;
+
+	while ((rc = emu_fetch_result(ctx, reqid, retp)) == VEO_COMMAND_UNFINISHED)
+		sched_yield();
+	return rc;
+}
+
+/*
+  Run a VE function in the calling thread. Stack arguments are copied
+  like in veo_call_async(), emu_cmd_run() copies OUT and INOUT ones back.
+*/
+int veo_call_sync(struct veo_proc_handle *proc, uint64_t addr,
+		  struct veo_args *args, uint64_t *result)
+{
+	int i;
+	struct emu_cmd c;
+
+	emu_config();
+	if (addr == 0)
+		return VEO_COMMAND_ERROR;
+	memset(&c, 0, sizeof(c));
+	c.addr = addr;
+	c.nargs = args ? args->nargs : 0;
+	for (i = 0; i < c.nargs; i++) {
+		c.regs[i] = args->regs[i];
+		c.stack[i] = args->stack[i];
+		if (args->stack[i].buff == NULL)
+			continue;
+		c.copy[i] = (char *)malloc(args->stack[i].len);
+		if (c.copy[i] == NULL) {
+			while (i >= 0)
+				free(c.copy[i--]);
+			return VEO_COMMAND_ERROR;
+		}
+		if (args->stack[i].intent != VEO_INTENT_OUT)
+			memcpy(c.copy[i], args->stack[i].buff, args->stack[i].len);
+	}
+	emu_wait_until(emu_now_ns() + emu_call_lat_ns);
+	emu_cmd_run(&c);
+	emu_wait_until(emu_now_ns() + emu_call_lat_ns);
+	*result = c.retval;
+	return VEO_COMMAND_OK;
+}
+
+
+/*
+  VE side: VH shared memory. Huge pages are not required on the host.
+*/
+int vh_shmget(key_t key, size_t size, int shmflag)
+{
+	return shmget(key, size, shmflag & ~(SHM_HUGETLB | IPC_CREAT));
+}
+
+void *vh_shmat(int shmid, const void *shmaddr, int shmflag, void **vehva)
+{
+	void *addr = shmat(shmid, shmaddr, shmflag);
+
+	if (addr == (void *)-1) {
+		*vehva = (void *)-1;
+		return NULL;
+	}
+	*vehva = addr;
+	return addr;
+}
+
+int vh_shmdt(const void *shmaddr)
+{
+	return shmdt(shmaddr);
+}
+
+
+/*
+  VE side: user DMA. The data is copied when the transfer is posted,
+  the handle completes when the modeled transfer time has passed.
+*/
+int ve_dma_init(void)
+{
+	emu_config();
+	return 0;
+}
+
+/* fails with (uint64_t)-1 like libsysve once all entries are in use */
+uint64_t ve_register_mem_to_dmaatb(void *vemva, size_t size)
+{
+	int i;
+
+	emu_config();
+	pthread_mutex_lock(&emu_dmaatb_lock);
+	for (i = 0; i < emu_dmaatb_max; i++)
+		if (emu_dmaatb[i].size == 0) {
+			emu_dmaatb[i].addr = (uint64_t)vemva;
+			emu_dmaatb[i].size = size;
+			break;
+		}
+	pthread_mutex_unlock(&emu_dmaatb_lock);
+	if (i == emu_dmaatb_max) {
+		errno = ENOMEM;
+		return (uint64_t)-1;
+	}
+	return (uint64_t)vemva;
+}
+
+int ve_unregister_mem_from_dmaatb(uint64_t vehva)
+{
+	int i;
+
+	pthread_mutex_lock(&emu_dmaatb_lock);
+	for (i = 0; i < EMU_MAX_DMAATB; i++)
+		if (emu_dmaatb[i].size && emu_dmaatb[i].addr == vehva) {
+			emu_dmaatb[i].size = 0;
+			break;
+		}
+	pthread_mutex_unlock(&emu_dmaatb_lock);
+	return 0;
+}
+
+/* 1 if addr is in registered VE memory */
+static int emu_is_ve_mem(uint64_t addr)
+{
+	int i;
+
+	for (i = 0; i < EMU_MAX_DMAATB; i++)
+		if (emu_dmaatb[i].size && addr >= emu_dmaatb[i].addr
+		    && addr < emu_dmaatb[i].addr + emu_dmaatb[i].size)
+			return 1;
+	return 0;
+}
+
+int ve_dma_post(uint64_t dst, uint64_t src, int size, ve_dma_handle_t *handle)
+{
+	uint64_t now = emu_now_ns(), t, xfer = 0;
+	uint64_t *busy = &emu_dma_busy_until[emu_is_ve_mem(dst)];
+
+	memcpy((void *)dst, (void *)src, (size_t)size);
+	__sync_synchronize();
+	/*
+	  Latencies of queued transfers overlap, the engine bandwidth
+	  is shared by all of them.
+	*/
+	if (emu_dma_bw > 0.0)
+		xfer = (uint64_t)((double)size / emu_dma_bw);
+	t = now + emu_dma_lat_ns;
+	if (t < *busy)
+		t = *busy;
+	t += xfer;
+	*busy = t;
+	handle->status = t > now ? t : 0;
+	return 0;
+}
+
+int ve_dma_poll(ve_dma_handle_t *handle)
+{
+	if (handle->status && emu_now_ns() < handle->status) {
+		sched_yield();
+		return -EAGAIN;
+	}
+	handle->status = 0;
+	return 0;
+}
+
+int ve_dma_post_wait(uint64_t dst, uint64_t src, int size)
+{
+	ve_dma_handle_t h;
+	int err = ve_dma_post(dst, src, size, &h);
+
+	if (err)
+		return err;
+	while ((err = ve_dma_poll(&h)) == -EAGAIN)
+		;
+	return err;
+}
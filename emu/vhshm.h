@@ -0,0 +1,25 @@
+/*
+  Host-only stand-in for the libsysve VH shared memory API (vhshm.h).
+  The "VEHVA" of an attached segment is its host virtual address.
+*/
+#ifndef VEO_EMU_VHSHM_INCLUDE
+#define VEO_EMU_VHSHM_INCLUDE
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int vh_shmget(key_t key, size_t size, int shmflag);
+void *vh_shmat(int shmid, const void *shmaddr, int shmflag, void **vehva);
+int vh_shmdt(const void *shmaddr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VEO_EMU_VHSHM_INCLUDE */
@@ -1,36 +1,323 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <time.h>
+#include <sched.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include <ve_offload.h>
 #include "veo_udma.h"
 
-/* variables for veo_udma_comm */
-int udma_num_procs = 0;
-int udma_num_peers = 0;
-struct vh_udma_proc *udma_procs[UDMA_MAX_PROCS];
-struct vh_udma_peer *udma_peers[UDMA_MAX_PEERS];
+/*
+  Peer registry. Peer IDs index udma_peers[], which grows on demand,
+  IDs of finished peers are reused. Thread contexts are mapped to their
+  peer by an open addressing hash table. Lookups take the read lock,
+  peer init/fini the write lock.
+*/
+static pthread_rwlock_t udma_reg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct vh_udma_proc *udma_procs = NULL;	// list of procs with peers
+static struct vh_udma_peer **udma_peers = NULL;
+static int udma_peers_len = 0;			// allocated length of udma_peers[]
+static struct vh_udma_peer **udma_ctx_hash = NULL;
+static int udma_ctx_hash_len = 0;		// 0 or power of 2, > 2 * peers
+
+/*
+  Progress engine. The request queue of a peer is protected by its
+  q_lock, udma_active_lock protects the list of peers the progress engine
+  looks at and udma_progress_lock the progress thread. Progress loops
+  hold udma_active_lock for reading almost all the time, writers (peer
+  init and fini) are preferred so they don't starve.
+*/
+static pthread_rwlock_t udma_active_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static struct vh_udma_peer *udma_active = NULL;	// peers linked by pnext
+static pthread_mutex_t udma_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t udma_progress_cond = PTHREAD_COND_INITIALIZER;
+static int udma_num_async = 0;		// async requests not completed, yet
+static int udma_progress_state = 0;	// 0: no thread, 1: running, -1: disabled
+static int udma_progress_exit = 0;
+static pthread_t udma_progress_thr;
+static volatile uint64_t udma_work = 0;	// counts staged splits and completions
+
+/*
+  Trace of the transfers, UDMA_TRACE=<file>. VH and VE events are
+  collected in udma_trace_recs with udma_trace_lock held and written
+  in Chrome trace event format when the last peer finishes.
+*/
+static pthread_mutex_t udma_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+struct udma_trace_rec {
+	uint64_t t, dur;	// VH clock [ns]
+	uint64_t len;
+	int peer, ve_node;
+	uint16_t split;
+	uint8_t ev, dir;
+	uint8_t ve;		// 0: VH event, 1: VE event
+	uint8_t op;		// request op of UDMA_TR_REQ
+};
+static char *udma_trace_file = NULL;	// NULL: no tracing
+static int udma_trace_read = 0;
+static struct udma_trace_rec *udma_trace_recs = NULL;
+static size_t udma_trace_n = 0, udma_trace_len = 0;
+static size_t udma_trace_max = UDMA_TRACE_MAX;
+static uint64_t udma_trace_dropped = 0;
+static uint64_t udma_trace_t0 = 0;
+
+static int udma_progress(struct vh_udma_peer **wpp);
+static void udma_progress_thread_stop(void);
+static void _udma_host_pool_fini(struct vh_udma_peer *up);
+static uint64_t _udma_host_vehva(struct vh_udma_peer *up, void *p, size_t len);
+static void _udma_split_env(void);
+static void _udma_split_fit(struct veo_udma_req *r, size_t space);
+static struct udma_tune *_udma_tune_load(int ve_node_id);
+static void _udma_tune_free(struct udma_tune *t);
+static int _udma_agent_halt(struct vh_udma_peer *up);
+static void _udma_wait_conf_env(struct udma_wait_conf *c);
+static void _udma_bcast_detach(struct vh_udma_peer *up);
+static void _udma_trace_env(void);
+static double _udma_usrcc_rate(struct vh_udma_peer *up);
+static void _udma_trace_sync(struct vh_udma_peer *up);
+static void _udma_trace_write(void);
+
+#ifdef VEO_EMU
+#define UDMA_SHM_HUGETLB 0	/* emulated VE, no huge pages needed */
+#else
+#define UDMA_SHM_HUGETLB SHM_HUGETLB
+#endif
+#define UDMA_HUGE_PAGE (2 * 1024 * 1024)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+static inline unsigned _udma_ctx_hash(struct veo_thr_ctxt *ctx, int len)
+{
+	uint64_t h = (uint64_t)ctx * 0x9e3779b97f4a7c15UL;
+
+	return (unsigned)(h >> 32) & (len - 1);
+}
+
+/*
+  Rebuild the ctx hash table for the current peers, it has at least
+  twice as many slots as peers. The table never shrinks, so removing
+  a peer can not fail. Must be called with the registry write lock held.
+
+  Returns 0 if successful, -ENOMEM otherwise.
+*/
+static int _udma_ctx_hash_rebuild(void)
+{
+	int i, n = 0, len;
+	unsigned h;
+	struct vh_udma_peer **ht;
+
+	for (i = 0; i < udma_peers_len; i++)
+		if (udma_peers[i])
+			n++;
+	len = udma_ctx_hash_len ? udma_ctx_hash_len : 16;
+	while (len < 2 * n)
+		len *= 2;
+	if (len == udma_ctx_hash_len) {
+		ht = udma_ctx_hash;
+		memset(ht, 0, len * sizeof(struct vh_udma_peer *));
+	} else {
+		ht = (struct vh_udma_peer **)calloc(len, sizeof(struct vh_udma_peer *));
+		if (!ht)
+			return -ENOMEM;
+		free(udma_ctx_hash);
+	}
+	for (i = 0; i < udma_peers_len; i++) {
+		if (!udma_peers[i])
+			continue;
+		for (h = _udma_ctx_hash(udma_peers[i]->ctx, len); ht[h];
+		     h = (h + 1) & (len - 1))
+			;
+		ht[h] = udma_peers[i];
+	}
+	udma_ctx_hash = ht;
+	udma_ctx_hash_len = len;
+	return 0;
+}
+
+/*
+  Put a peer into the registry, reusing a free ID or growing udma_peers[].
+  Must be called with the registry write lock held.
+
+  Returns the peer ID or a negative number in case of failure.
+*/
+static int _udma_peer_register(struct vh_udma_peer *up)
+{
+	int i, len;
+	struct vh_udma_peer **p;
+
+	for (i = 0; i < udma_peers_len; i++)
+		if (udma_peers[i] == NULL)
+			break;
+	if (i == udma_peers_len) {
+		len = udma_peers_len ? 2 * udma_peers_len : UDMA_MAX_PEERS;
+		p = (struct vh_udma_peer **)realloc(udma_peers,
+						    len * sizeof(struct vh_udma_peer *));
+		if (!p)
+			return -ENOMEM;
+		memset(p + udma_peers_len, 0,
+		       (len - udma_peers_len) * sizeof(struct vh_udma_peer *));
+		udma_peers = p;
+		udma_peers_len = len;
+	}
+	udma_peers[i] = up;
+	if (_udma_ctx_hash_rebuild()) {
+		udma_peers[i] = NULL;
+		return -ENOMEM;
+	}
+	return i;
+}
+
+/*
+  Find a peer by ID.
+
+  Returns NULL if there is no such peer.
+*/
+static struct vh_udma_peer *_udma_peer(int peer)
+{
+	struct vh_udma_peer *up = NULL;
+
+	pthread_rwlock_rdlock(&udma_reg_lock);
+	if (peer >= 0 && peer < udma_peers_len)
+		up = udma_peers[peer];
+	pthread_rwlock_unlock(&udma_reg_lock);
+	return up;
+}
+
+/*
+  Find the peer registered for a thread context.
+*/
+static struct vh_udma_peer *_udma_ctx_peer(struct veo_thr_ctxt *ctx)
+{
+	unsigned h;
+	struct vh_udma_peer *up = NULL;
+
+	pthread_rwlock_rdlock(&udma_reg_lock);
+	if (udma_ctx_hash_len) {
+		for (h = _udma_ctx_hash(ctx, udma_ctx_hash_len); udma_ctx_hash[h];
+		     h = (h + 1) & (udma_ctx_hash_len - 1)) {
+			if (udma_ctx_hash[h]->ctx == ctx) {
+				up = udma_ctx_hash[h];
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&udma_reg_lock);
+	return up;
+}
+
+/*
+  NUMA placement. The host node of a VE is the node of its PCIe root
+  port, found in sysfs. UDMA_NUMA_NODE_<ve> or UDMA_NUMA_NODE override
+  it, -1 disables the placement.
+*/
+#define UDMA_MPOL_PREFERRED 1	/* from linux/mempolicy.h */
+
+static int _udma_numa_node(int ve_node_id)
+{
+	char path[64], *env;
+	FILE *f;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "UDMA_NUMA_NODE_%d", ve_node_id);
+	env = getenv(path);
+	if (!env)
+		env = getenv("UDMA_NUMA_NODE");
+	if (env)
+		node = atoi(env);
+	else {
+		snprintf(path, sizeof(path), "/sys/class/ve/ve%d/device/numa_node",
+			 ve_node_id);
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%d", &node) != 1)
+				node = -1;
+			fclose(f);
+		}
+	}
+	if (node >= UDMA_MAX_NUMA_NODES || node < -1) {
+		eprintf("veo_udma: ignoring NUMA node %d of VE%d\n", node, ve_node_id);
+		node = -1;
+	}
+	dprintf("VE%d is attached to NUMA node %d\n", ve_node_id, node);
+	return node;
+}
+
+/*
+  Make the pages of [addr, addr + len) come from node, as far as it has
+  free (huge) pages. Must be called before the pages are touched.
+*/
+static void _udma_numa_bind(void *addr, size_t len, int node)
+{
+	unsigned long mask[UDMA_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
 
+	if (node < 0)
+		return;
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_mbind, addr, len, UDMA_MPOL_PREFERRED, mask,
+		    UDMA_MAX_NUMA_NODES, 0) != 0)
+		eprintf("veo_udma: mbind to NUMA node %d failed: %s\n", node,
+			strerror(errno));
+}
+
+/*
+  Collect the cores of a NUMA node from its sysfs cpulist.
+
+  Returns the number of cores found.
+*/
+static int _udma_numa_cpus(int node, cpu_set_t *cs)
+{
+	char path[64];
+	FILE *f;
+	int a, b, n = 0;
+
+	CPU_ZERO(cs);
+	if (node < 0)
+		return 0;
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fscanf(f, "%d", &a) == 1) {
+		b = a;
+		if (fscanf(f, "-%d", &b) < 0)
+			b = a;
+		for (; a <= b && a < CPU_SETSIZE; a++, n++)
+			CPU_SET(a, cs);
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return n;
+}
 
 /*
+  Create and attach a new shm segment. If the key is in use already,
+  the next free key is taken and returned in *key. The pages are placed
+  on NUMA node numa_node, if it is not negative.
+
   Returns: the segment ID of the shm segment.
  */
-static int vh_shm_init(int key, size_t size, void **local_addr)
+static int vh_shm_init(int *key, size_t size, void **local_addr, int numa_node)
 {
 	int err = 0;
 	struct shmid_ds ds;
-	
-	int segid = shmget(key, size, IPC_CREAT | SHM_HUGETLB | S_IRWXU); 
+	int segid;
+
+	while ((segid = shmget(*key, size, IPC_CREAT | IPC_EXCL | UDMA_SHM_HUGETLB
+			       | S_IRWXU)) == -1 && errno == EEXIST)
+		(*key)++;
 	if (segid == -1) {
 		eprintf("[vh_shm_init] shmget failed: %s\n", strerror(errno));
 		return -errno;
@@ -39,10 +326,11 @@ static int vh_shm_init(int key, size_t size, void **local_addr)
 	dprintf("local_addr: %p\n", *local_addr);
 	if (*local_addr == (void *) -1) {
 		eprintf("[vh_shm_init] shmat failed: %s\n"
-			"Releasing shm segment. key=%d\n", strerror(errno), key);
+			"Releasing shm segment. key=%d\n", strerror(errno), *key);
 		shmctl(segid, IPC_RMID, NULL);
 		segid = -errno;
-	}
+	} else
+		_udma_numa_bind(*local_addr, size, numa_node);
 	return segid;
 }
 
@@ -74,11 +362,444 @@ static void vh_shm_destroy(int segid)
 		eprintf("[vh_shm_destroy] Failed to mark SHM seg ID %d destroyed\n", segid);
 }
 
+/*
+  Copy pool: worker threads sharing the VH side staging memcpy of large
+  splits with the thread driving the transfer. One core can't saturate
+  the host memory bandwidth. Enabled per peer, by UDMA_COPY_THREADS or
+  veo_udma_peer_set_copy_threads(), workers are pinned to the cores
+  listed in UDMA_COPY_CPUS (comma separated), if given. Waiting follows
+  the peer's wait policy: idle workers poll spin times, yield a while
+  unless the policy is SLEEP and then block until the next copy. The
+  caller waiting for the workers yields after spin polls unless the
+  policy is SPIN.
+*/
+#define UDMA_COPY_MIN (512 * 1024)	// smaller copies are done by the caller
+
+static inline void udma_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void _udma_copy_pieces(struct udma_copy_pool *cp)
+{
+	int i;
+	size_t offs, len;
+
+	while ((i = __sync_fetch_and_add(&cp->next, 1)) < cp->npieces) {
+		offs = (size_t)i * cp->piece;
+		len = MIN(cp->piece, cp->len - offs);
+		memcpy(cp->dst + offs, cp->src + offs, len);
+		__sync_fetch_and_sub(&cp->pending, 1);
+	}
+}
+
+static void *udma_copy_worker(void *arg)
+{
+	struct udma_copy_pool *cp = (struct udma_copy_pool *)arg;
+	unsigned long gen = 0;
+	int idle, yields;
+
+	for (;;) {
+		yields = cp->policy == UDMA_WAIT_SLEEP ? 0 : UDMA_WAIT_YIELDS;
+		for (idle = 0; idle < cp->spin && cp->gen == gen && !cp->exit; idle++)
+			udma_cpu_relax();
+		for (idle = 0; idle < yields && cp->gen == gen && !cp->exit; idle++)
+			sched_yield();
+		if (cp->gen == gen) {
+			pthread_mutex_lock(&cp->lock);
+			while (cp->gen == gen && !cp->exit)
+				pthread_cond_wait(&cp->cond, &cp->lock);
+			pthread_mutex_unlock(&cp->lock);
+		}
+		if (cp->exit)
+			break;
+		gen = cp->gen;
+		_udma_copy_pieces(cp);
+	}
+	return NULL;
+}
+
+static void _udma_copy_pool_fini(struct udma_copy_pool *cp)
+{
+	int i;
+
+	if (!cp)
+		return;
+	pthread_mutex_lock(&cp->lock);
+	cp->exit = 1;
+	pthread_cond_broadcast(&cp->cond);
+	pthread_mutex_unlock(&cp->lock);
+	for (i = 0; i < cp->nthreads; i++)
+		pthread_join(cp->thr[i], NULL);
+	free(cp->thr);
+	free(cp);
+}
+
+/*
+  Apply the wait policy of a peer to its copy pool.
+*/
+static void _udma_copy_pool_wait(struct udma_copy_pool *cp, const struct udma_wait_conf *c)
+{
+	if (!cp)
+		return;
+	cp->policy = c->policy;
+	cp->spin = c->spin;
+}
+
+/*
+  Start nthreads copy workers, pinned round-robin to cpus[0..ncpus-1]
+  if ncpus > 0. Otherwise they are bound to the cores of numa_node,
+  unless UDMA_NUMA_PIN=0. They wait as told by c.
+*/
+static struct udma_copy_pool *_udma_copy_pool_init(int nthreads, const int *cpus, int ncpus,
+						   int numa_node, const struct udma_wait_conf *c)
+{
+	int i, pin_node = 0;
+	cpu_set_t cs, node_cs;
+	char *env;
+	struct udma_copy_pool *cp;
+
+	if (nthreads <= 0)
+		return NULL;
+	cp = (struct udma_copy_pool *)calloc(1, sizeof(struct udma_copy_pool));
+	if (!cp)
+		return NULL;
+	cp->thr = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	if (!cp->thr) {
+		free(cp);
+		return NULL;
+	}
+	pthread_mutex_init(&cp->lock, NULL);
+	pthread_cond_init(&cp->cond, NULL);
+	_udma_copy_pool_wait(cp, c);
+	env = getenv("UDMA_NUMA_PIN");
+	if (ncpus <= 0 && (!env || atoi(env) != 0))
+		pin_node = _udma_numa_cpus(numa_node, &node_cs) > 0;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&cp->thr[i], NULL, udma_copy_worker, cp) != 0) {
+			eprintf("veo_udma: failed to start copy thread %d\n", i);
+			break;
+		}
+		cp->nthreads++;
+		if (ncpus > 0) {
+			CPU_ZERO(&cs);
+			CPU_SET(cpus[i % ncpus], &cs);
+			if (pthread_setaffinity_np(cp->thr[i], sizeof(cs), &cs) != 0)
+				eprintf("veo_udma: pinning copy thread %d to cpu %d failed\n",
+					i, cpus[i % ncpus]);
+		} else if (pin_node) {
+			if (pthread_setaffinity_np(cp->thr[i], sizeof(node_cs), &node_cs) != 0)
+				eprintf("veo_udma: binding copy thread %d to NUMA node %d failed\n",
+					i, numa_node);
+		}
+	}
+	if (cp->nthreads == 0) {
+		_udma_copy_pool_fini(cp);
+		return NULL;
+	}
+	return cp;
+}
+
+/*
+  Copy pool configuration from UDMA_COPY_THREADS and UDMA_COPY_CPUS.
+*/
+static struct udma_copy_pool *_udma_copy_pool_env(int numa_node, const struct udma_wait_conf *c)
+{
+	int n = 0, ncpus = 0, cpus[UDMA_MAX_COPY_THREADS];
+	char *env, *p;
+
+	env = getenv("UDMA_COPY_THREADS");
+	if (env)
+		n = atoi(env);
+	if (n <= 0)
+		return NULL;
+	if (n > UDMA_MAX_COPY_THREADS)
+		n = UDMA_MAX_COPY_THREADS;
+	env = getenv("UDMA_COPY_CPUS");
+	for (p = env; p && *p && ncpus < UDMA_MAX_COPY_THREADS; ) {
+		cpus[ncpus++] = (int)strtol(p, &p, 10);
+		if (*p == ',')
+			p++;
+		else
+			break;
+	}
+	return _udma_copy_pool_init(n, cpus, ncpus, numa_node, c);
+}
+
+/*
+  Staging memcpy, split among the caller and the peer's copy workers.
+*/
+static void _udma_memcpy(struct udma_copy_pool *cp, void *dst, const void *src, size_t len)
+{
+	int idle = 0;
+
+	if (!cp || len < UDMA_COPY_MIN) {
+		memcpy(dst, src, len);
+		return;
+	}
+	cp->dst = (char *)dst;
+	cp->src = (const char *)src;
+	cp->len = len;
+	cp->npieces = cp->nthreads + 1;
+	cp->piece = ALIGN64B((len + cp->npieces - 1) / cp->npieces);
+	cp->pending = cp->npieces;
+	__sync_synchronize();
+	cp->next = 0;
+	__sync_synchronize();
+	pthread_mutex_lock(&cp->lock);
+	cp->gen++;
+	pthread_cond_broadcast(&cp->cond);
+	pthread_mutex_unlock(&cp->lock);
+	_udma_copy_pieces(cp);
+	/* the workers hold the last pieces, no sleep: they are done soon */
+	while (cp->pending > 0) {
+		if (cp->policy != UDMA_WAIT_SPIN && idle >= cp->spin)
+			sched_yield();
+		else {
+			udma_cpu_relax();
+			idle++;
+		}
+	}
+	__sync_synchronize();
+}
+
+/*
+  Switch the VE agent of a peer on or off, see _udma_agent_run(). The
+  agent is started with the next transfer. Switching it off waits for
+  the queued requests and stops it, the context is free for other VE
+  calls afterwards.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_peer_set_agent(int peer, int on)
+{
+	int rc = 0;
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_peer_set_agent: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&up->q_lock);
+	up->agent = on ? 1 : 0;
+	if (!on) {
+		while (up->q_head) {
+			pthread_mutex_unlock(&up->q_lock);
+			udma_progress(NULL);
+			pthread_mutex_lock(&up->q_lock);
+		}
+		rc = _udma_agent_halt(up);
+	}
+	pthread_mutex_unlock(&up->q_lock);
+	return rc;
+}
+
+/*
+  Set how host threads wait for transfers of a peer, see
+  _udma_wait_idle(). Negative spin, sleep_us or peek_every keep the
+  current value.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_peer_set_wait(int peer, int policy, int spin, long sleep_us, int peek_every)
+{
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_peer_set_wait: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	if (policy < UDMA_WAIT_SPIN || policy > UDMA_WAIT_SLEEP || sleep_us == 0 ||
+	    peek_every == 0) {
+		eprintf("veo_udma_peer_set_wait: invalid argument\n");
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&up->q_lock);
+	up->wait.policy = policy;
+	if (spin >= 0)
+		up->wait.spin = spin;
+	if (sleep_us > 0)
+		up->wait.sleep_max_ns = sleep_us * 1000L;
+	if (peek_every > 0)
+		up->wait.peek_every = peek_every;
+	_udma_copy_pool_wait(up->copy_pool, &up->wait);
+	pthread_mutex_unlock(&up->q_lock);
+	return 0;
+}
+
+/*
+  Fix split count and split size of the sends and receives of a peer,
+  overriding tables, UDMA_SPLIT_* and adaptation. A split of 0 goes back
+  to the tables, a negative one keeps the current setting. Pool peers
+  still shrink the splits to the space they get.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_peer_set_split(int peer, int split_send, size_t size_send, int split_recv,
+			    size_t size_recv)
+{
+	int i, split[2] = {split_send, split_recv};
+	size_t size[2] = {size_send, size_recv};
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_peer_set_split: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	for (i = 0; i < 2; i++)
+		if (split[i] > 0 && (split[i] > UDMA_MAX_SPLIT || size[i] < 8 || (size[i] & 7)
+				     || split[i] * size[i] > up->split_space)) {
+			eprintf("veo_udma_peer_set_split: invalid split %d x %lu\n",
+				split[i], size[i]);
+			return -EINVAL;
+		}
+	pthread_mutex_lock(&up->q_lock);
+	for (i = 0; i < 2; i++)
+		if (split[i] >= 0) {
+			up->set_split[i] = split[i];
+			up->set_split_size[i] = size[i];
+		}
+	pthread_mutex_unlock(&up->q_lock);
+	return 0;
+}
+
+/*
+  Copy the wait time accounting of a peer to st.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_peer_get_wait_stats(int peer, struct veo_udma_wait_stats *st)
+{
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL || st == NULL) {
+		eprintf("veo_udma_peer_get_wait_stats: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&up->q_lock);
+	*st = up->stats.wait;
+	pthread_mutex_unlock(&up->q_lock);
+	return 0;
+}
+
+/*
+  Copy the counters of a peer to st, the VE side ones are read from
+  the peer's struct ve_udma_peer. They are updated while transfers run,
+  a snapshot taken during a transfer is not exact.
+*/
+static int _udma_stats_get(struct vh_udma_peer *up, struct veo_udma_stats *st)
+{
+	struct udma_ve_stats vs;
+	double mhz;
+	int rc;
+
+	pthread_mutex_lock(&up->q_lock);
+	*st = up->stats;
+	pthread_mutex_unlock(&up->q_lock);
+	rc = veo_read_mem(up->pp->proc, &vs,
+			  up->ve_peer + offsetof(struct ve_udma_peer, stats), sizeof(vs));
+	if (rc) {
+		eprintf("veo_udma: reading the VE counters failed, rc=%d\n", rc);
+		return -EIO;
+	}
+	mhz = _udma_usrcc_rate(up);
+	st->ve_dma_posts = vs.dma_posts;
+	st->ve_memcpy_ns = (uint64_t)(vs.memcpy_cc * 1e3 / mhz);
+	st->ve_dma_poll_ns = (uint64_t)(vs.dma_poll_cc * 1e3 / mhz);
+	return 0;
+}
+
+/*
+  Copy the counters of a peer to st.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_get_stats(int peer, struct veo_udma_stats *st)
+{
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL || st == NULL) {
+		eprintf("veo_udma_get_stats: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	return _udma_stats_get(up, st);
+}
+
+/*
+  Print the counters of a peer, at peer fini with UDMA_STATS=1.
+*/
+static void _udma_stats_print(int peer, struct vh_udma_peer *up)
+{
+	struct veo_udma_stats st;
+
+	if (_udma_stats_get(up, &st))
+		return;
+	eprintf("veo_udma peer %d (VE%d) stats:\n"
+		"  send %lu bytes in %lu calls, recv %lu bytes in %lu calls\n"
+		"  pack commits %lu, pack fill %.1f%%\n"
+		"  split adaptation: %lu trials, %lu switches\n"
+		"  VH: memcpy %.3f ms, slot wait %.3f ms, peek %.3f ms (%lu peeks, %lu skipped)\n"
+		"  VH wait: spin %.3f ms, yield %.3f ms, sleep %.3f ms\n"
+		"  VE: memcpy %.3f ms, dma poll %.3f ms, %lu dma posts\n",
+		peer, up->pp->ve_node_id, st.send_bytes, st.send_calls,
+		st.recv_bytes, st.recv_calls, st.pack_commits,
+		st.pack_space ? 100.0 * st.pack_fill / st.pack_space : 0.0,
+		st.adapt_trials, st.adapt_switches,
+		st.memcpy_ns / 1e6, st.slot_wait_ns / 1e6, st.peek_ns / 1e6,
+		st.wait.peeks, st.wait.peeks_skipped,
+		st.wait.spin_ns / 1e6, st.wait.yield_ns / 1e6, st.wait.sleep_ns / 1e6,
+		st.ve_memcpy_ns / 1e6, st.ve_dma_poll_ns / 1e6, st.ve_dma_posts);
+}
+
+/*
+  (Re)configure the copy workers of a peer, nthreads = 0 disables them.
+  cpus may be NULL or contain ncpus core numbers to pin the workers to.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+int veo_udma_peer_set_copy_threads(int peer, int nthreads, const int *cpus, int ncpus)
+{
+	struct udma_copy_pool *cp = NULL;
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_peer_set_copy_threads: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	if (nthreads > UDMA_MAX_COPY_THREADS)
+		nthreads = UDMA_MAX_COPY_THREADS;
+	if (nthreads > 0) {
+		cp = _udma_copy_pool_init(nthreads, cpus, cpus ? ncpus : 0, up->numa_node,
+					  &up->wait);
+		if (!cp)
+			return -ENOMEM;
+	}
+	/* no staging copy must be running while the pool is swapped */
+	pthread_mutex_lock(&up->q_lock);
+	while (up->q_head) {
+		pthread_mutex_unlock(&up->q_lock);
+		udma_progress(NULL);
+		pthread_mutex_lock(&up->q_lock);
+	}
+	_udma_copy_pool_fini(up->copy_pool);
+	up->copy_pool = cp;
+	_udma_copy_pool_wait(cp, &up->wait);
+	pthread_mutex_unlock(&up->q_lock);
+	return 0;
+}
+
 static void vh_udma_proc_setup(struct vh_udma_proc *pp, int ve_node_id,
 			       struct veo_proc_handle *proc, uint64_t lib_handle)
 {
 	pp->ve_node_id = ve_node_id;
 	pp->count = 0;
+	pp->next = NULL;
+	pp->tune = NULL;
+	pp->usrcc_mhz = 0.0;
 	pp->proc = proc;
 	pp->lib_handle = lib_handle;
 	// find function addresses
@@ -86,471 +807,3552 @@ static void vh_udma_proc_setup(struct vh_udma_proc *pp, int ve_node_id,
 	pp->ve_udma_fini = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_fini");
 	pp->ve_udma_send = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_send");
 	pp->ve_udma_recv = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recv");
-	pp->ve_udma_send_packed = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_send_packed");
+	pp->ve_udma_send_strided = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_send_strided");
+	pp->ve_udma_recv_strided = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recv_strided");
+	pp->ve_udma_sendv = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_sendv");
+	pp->ve_udma_recvv = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recvv");
+	pp->ve_udma_recv_pack = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recv_pack");
+	pp->ve_udma_exchange = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_exchange");
+	pp->ve_udma_recv_bcast = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recv_bcast");
+	pp->ve_udma_agent = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_agent");
+	pp->ve_udma_send_eager = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_send_eager");
+	pp->ve_udma_recv_eager = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_recv_eager");
+	pp->ve_udma_shm_attach = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_shm_attach");
+	pp->ve_udma_shm_detach = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_shm_detach");
+	pp->ve_udma_pool_init = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_pool_init");
+	pp->ve_udma_pool_fini = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_pool_fini");
+	pp->ve_udma_usrcc = veo_get_sym(pp->proc, pp->lib_handle, "ve_udma_usrcc");
+	pp->pool = NULL;
+	pp->bcast_vehva = 0;
+	pp->bcast_ve_addr = 0;
+}
+
+/*
+  Find the proc entry of a VEO proc or create it and take a reference.
+  Must be called with the registry write lock held.
+*/
+static struct vh_udma_proc *_udma_proc_get(int ve_node_id, struct veo_proc_handle *proc,
+					   uint64_t lib_handle)
+{
+	struct vh_udma_proc *pp;
+
+	for (pp = udma_procs; pp; pp = pp->next)
+		if (pp->proc == proc)
+			break;
+	if (!pp) {
+		pp = (struct vh_udma_proc *)malloc(sizeof(struct vh_udma_proc));
+		if (!pp)
+			return NULL;
+		vh_udma_proc_setup(pp, ve_node_id, proc, lib_handle);
+		_udma_split_env();
+		pp->tune = _udma_tune_load(ve_node_id);
+		if (!pp->tune) {
+			free(pp);
+			return NULL;
+		}
+		pp->next = udma_procs;
+		udma_procs = pp;
+	}
+	pp->count++;
+	return pp;
+}
+
+/*
+  Drop a reference to a proc entry, free it when unused.
+  Must be called with the registry write lock held.
+*/
+static void _udma_proc_put(struct vh_udma_proc *pp)
+{
+	struct vh_udma_proc **pq;
+
+	if (--pp->count > 0)
+		return;
+	for (pq = &udma_procs; *pq; pq = &(*pq)->next)
+		if (*pq == pp) {
+			*pq = pp->next;
+			break;
+		}
+	_udma_tune_free(pp->tune);
+	free(pp);
+}
+	
+static int ve_udma_setup(struct vh_udma_peer *up)
+{
+	uint64_t req;
+	int64_t res;
+	int err;
+
+	// call VE side init function
+	struct veo_args *argp = veo_args_alloc();
+	veo_args_set_stack(argp, VEO_INTENT_IN, 0, (char *)up, sizeof(struct vh_udma_peer));
+	veo_args_set_stack(argp, VEO_INTENT_OUT, 1, (char *)&up->ve_peer, sizeof(uint64_t));
+	req = veo_call_async(up->ctx, up->pp->ve_udma_init, argp);
+	err = veo_call_wait_result(up->ctx, req, (uint64_t *)&res);
+	if (err)
+		eprintf("veo-udma setup on VE has failed.\n"
+			"ve_udma_setup veo_call_wait_result err=%d\n", err);
+	veo_args_free(argp);
+	return err != 0 ? err : (int)res;
+}
+
+static int ve_udma_close(struct vh_udma_peer *up)
+{
+	uint64_t req;
+	int64_t res;
+	int err;
+
+	// call VE side init function
+	struct veo_args *argp = veo_args_alloc();
+	veo_args_set_u64(argp, 0, up->ve_peer);
+	req = veo_call_async(up->ctx, up->pp->ve_udma_fini, argp);
+	err = veo_call_wait_result(up->ctx, req, (uint64_t *)&res);
+	if (err)
+		eprintf("veo-udma finish failed on VE side.\n"
+			"veo_call_wait_result err=%d\n", err);
+	veo_args_free(argp);
+	return err != 0 ? err : (int)res;
+}
+
+/*
+  Control areas of a peer: descriptors, agent command ring, eager area
+  and mailbox of the send half at send_ctl, VE trace events, eager area
+  and mailbox of the recv half at recv_ctl.
+*/
+static void _udma_ctl_layout(struct vh_udma_peer *up, char *send_ctl, char *recv_ctl)
+{
+	/* segment descriptors and agent commands are fetched by the VE with one DMA */
+	up->desc = (struct udma_seg *)send_ctl;
+	up->cmd = (struct udma_cmd_ring *)(send_ctl + UDMA_DESC_SPACE);
+	up->send.eager = send_ctl + UDMA_DESC_SPACE + UDMA_CMD_SPACE;
+	up->send.len = (size_t *)((char *)up->send.eager + UDMA_EAGER_SPACE);
+	up->trace = NULL;
+	if (udma_trace_file) {
+		up->trace = (struct udma_trace_buf *)recv_ctl;
+		memset(up->trace, 0, sizeof(struct udma_trace_buf));
+	}
+	up->recv.eager = recv_ctl + UDMA_TRACE_SPACE;
+	up->recv.len = (size_t *)(recv_ctl + UDMA_TRACE_SPACE + UDMA_EAGER_SPACE);
+}
+
+/*
+  Private shm segment of a peer: two halves of buff_len bytes, the
+  splits at the start, the control areas at the end of each half.
+*/
+static int _udma_peer_shm(struct vh_udma_peer *up, size_t buff_len)
+{
+	char *env;
+
+	if (buff_len == 0) {
+		buff_len = UDMA_BUFF_LEN;
+		env = getenv("UDMA_BUFF_LEN");
+		if (env)
+			buff_len = (size_t)atol(env);
+	}
+	if (buff_len < UDMA_BUFF_MIN) {
+		eprintf("veo_udma: buffer length %lu too small, using %d\n",
+			buff_len, UDMA_BUFF_MIN);
+		buff_len = UDMA_BUFF_MIN;
+	}
+	up->buff_len = ALIGN_UP(buff_len, UDMA_HUGE_PAGE);
+
+	/* the key is bumped until a free one is found */
+	up->shm_key = getpid() * UDMA_MAX_PEERS;
+	up->shm_size = 2 * up->buff_len;
+        /*
+         * Allocate shared memory segment
+         */
+	up->shm_segid = vh_shm_init(&up->shm_key, up->shm_size, &up->shm_addr,
+				    up->numa_node);
+	if (up->shm_segid < 0)
+		return -ENOMEM;
+
+	up->send.shm = up->shm_addr;
+	up->recv.shm = (void *)((char *)up->shm_addr + up->buff_len);
+	_udma_ctl_layout(up, (char *)up->send.shm + up->buff_len - UDMA_CTL_SEND,
+			 (char *)up->recv.shm + up->buff_len - UDMA_CTL_RECV);
+	up->send.buff_len = up->buff_len - UDMA_CTL_SEND;
+	up->recv.buff_len = up->buff_len - UDMA_CTL_RECV;
+	up->split_space = up->send.buff_len;
+	return 0;
+}
+
+/*
+  Shared split pools. All pool peers of a proc use one shm segment and
+  one VE mirror buffer, see struct udma_pool. The pool is created by
+  its first peer and freed with its last one, udma_pool_lock protects
+  the control slots and the chunks.
+*/
+static pthread_mutex_t udma_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define UDMA_POOL_CTL_LEN ALIGN_UP(UDMA_CTL_SEND + UDMA_CTL_RECV, 64 * 1024)
+
+static int _udma_pool_ve_call(struct vh_udma_peer *up, uint64_t addr, struct veo_args *argp)
+{
+	uint64_t req;
+	int64_t res;
+	int err;
+
+	req = veo_call_async(up->ctx, addr, argp);
+	err = veo_call_wait_result(up->ctx, req, (uint64_t *)&res);
+	veo_args_free(argp);
+	return err != 0 ? -EIO : (int)res;
+}
+
+static struct udma_pool *_udma_pool_create(struct vh_udma_peer *up)
+{
+	int rc, nctl = UDMA_POOL_PEERS;
+	size_t size = UDMA_POOL_LEN, ctl;
+	char *env;
+	struct veo_args *argp;
+	struct udma_pool *pool;
+
+	env = getenv("UDMA_SHARED_PEERS");
+	if (env && atoi(env) > 0)
+		nctl = MIN(atoi(env), UDMA_POOL_MAX_PEERS);
+	env = getenv("UDMA_SHARED_LEN");
+	if (env && atol(env) > 0)
+		size = (size_t)atol(env);
+	ctl = ALIGN_UP(nctl * UDMA_POOL_CTL_LEN, UDMA_POOL_CHUNK);
+	if (size < ctl + UDMA_BUFF_MIN)
+		size = ctl + UDMA_BUFF_MIN;
+	size = ALIGN_UP(size, UDMA_HUGE_PAGE);
+
+	pool = (struct udma_pool *)calloc(1, sizeof(struct udma_pool));
+	if (!pool)
+		return NULL;
+	pool->nctl = nctl;
+	pool->ctl_len = UDMA_POOL_CTL_LEN;
+	pool->data_offs = ctl;
+	pool->nchunks = (size - ctl) / UDMA_POOL_CHUNK;
+	pool->chunk = (unsigned char *)calloc(pool->nchunks, 1);
+	if (!pool->chunk) {
+		free(pool);
+		return NULL;
+	}
+	pool->size = size;
+	pool->key = getpid() * UDMA_MAX_PEERS;
+	pool->segid = vh_shm_init(&pool->key, size, &pool->addr, up->numa_node);
+	if (pool->segid < 0)
+		goto err;
+
+	argp = veo_args_alloc();
+	veo_args_set_i32(argp, 0, pool->key);
+	veo_args_set_u64(argp, 1, (uint64_t)size);
+	veo_args_set_stack(argp, VEO_INTENT_OUT, 2, (char *)&pool->ve_pool, sizeof(uint64_t));
+	rc = _udma_pool_ve_call(up, up->pp->ve_udma_pool_init, argp);
+	vh_shm_destroy(pool->segid);
+	if (rc) {
+		eprintf("veo_udma: attaching the split pool on VE failed, rc=%d\n", rc);
+		vh_shm_fini(pool->segid, pool->addr);
+		goto err;
+	}
+	dprintf("veo_udma: split pool of %lu bytes, %d peers, %d chunks\n",
+		size, nctl, pool->nchunks);
+	return pool;
+err:
+	free(pool->chunk);
+	free(pool);
+	return NULL;
+}
+
+/*
+  Give a peer a control slot in the pool of its proc, the pool is
+  created if needed.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+static int _udma_pool_attach(struct vh_udma_peer *up)
+{
+	int i;
+	char *ctl;
+	struct udma_pool *pool;
+
+	pthread_mutex_lock(&udma_pool_lock);
+	if (!up->pp->pool)
+		up->pp->pool = _udma_pool_create(up);
+	pool = up->pp->pool;
+	if (!pool) {
+		pthread_mutex_unlock(&udma_pool_lock);
+		return -ENOMEM;
+	}
+	for (i = 0; i < pool->nctl && (pool->ctl_used & (1UL << i)); i++)
+		;
+	if (i == pool->nctl) {
+		pthread_mutex_unlock(&udma_pool_lock);
+		return -ENOSPC;
+	}
+	pool->ctl_used |= 1UL << i;
+	pool->count++;
+	pthread_mutex_unlock(&udma_pool_lock);
+
+	up->pool = pool;
+	up->ctl_slot = i;
+	up->ve_pool = pool->ve_pool;
+	up->shm_key = pool->key;
+	up->shm_segid = -1;
+	up->shm_size = pool->size;
+	up->shm_addr = pool->addr;
+	up->buff_len = 0;
+	/* a previous peer may have left mailbox and command ring state */
+	ctl = (char *)pool->addr + i * pool->ctl_len;
+	memset(ctl, 0, pool->ctl_len);
+	_udma_ctl_layout(up, ctl, ctl + UDMA_CTL_SEND);
+	up->send.shm = up->recv.shm = (char *)pool->addr + pool->data_offs;
+	up->send.buff_len = up->recv.buff_len = (size_t)pool->nchunks * UDMA_POOL_CHUNK;
+	up->split_space = up->send.buff_len;
+	return 0;
+}
+
+/*
+  Release the control slot of a peer, the last peer frees the pool.
+  The peer's VE side must be closed already.
+*/
+static void _udma_pool_detach(struct vh_udma_peer *up)
+{
+	int rc;
+	struct veo_args *argp;
+	struct udma_pool *pool = up->pool;
+
+	pthread_mutex_lock(&udma_pool_lock);
+	pool->ctl_used &= ~(1UL << up->ctl_slot);
+	if (--pool->count == 0) {
+		up->pp->pool = NULL;
+		argp = veo_args_alloc();
+		veo_args_set_u64(argp, 0, pool->ve_pool);
+		rc = _udma_pool_ve_call(up, up->pp->ve_udma_pool_fini, argp);
+		if (rc)
+			eprintf("veo_udma: releasing the split pool on VE failed, rc=%d\n", rc);
+		vh_shm_fini(pool->segid, pool->addr);
+		free(pool->chunk);
+		free(pool);
+	}
+	pthread_mutex_unlock(&udma_pool_lock);
+	up->pool = NULL;
+}
+
+/*
+  VH side UDMA communication init. Each thread context of a proc can be
+  a peer, the VE side state is kept per peer, so the user DMA engines
+  of several VE cores can be used at the same time.
+
+  Returns: peer_id (can be 0) or a negative number, in case of an error.
+*/
+int veo_udma_peer_init(int ve_node_id, struct veo_proc_handle *proc,
+		       struct veo_thr_ctxt *ctx, uint64_t lib_handle)
+{
+	return veo_udma_peer_init_buff(ve_node_id, proc, ctx, lib_handle, 0, -1);
+}
+
+/*
+  Like veo_udma_peer_init() with the buffer space chosen by the caller:
+  buff_len is the length of each half of the peer's private shm segment
+  and of its VE mirror (0: UDMA_BUFF_LEN or the default). With shared
+  set the peer takes the splits of its transfers from the split pool of
+  its proc instead (-1: UDMA_SHARED decides). If the pool has no free
+  control slot, the peer gets a private segment.
+
+  Returns: peer_id (can be 0) or a negative number, in case of an error.
+*/
+int veo_udma_peer_init_buff(int ve_node_id, struct veo_proc_handle *proc,
+			    struct veo_thr_ctxt *ctx, uint64_t lib_handle,
+			    size_t buff_len, int shared)
+{
+	int rc, peer_id;
+	char *env;
+	struct vh_udma_peer *up;
+
+	up = (struct vh_udma_peer *)malloc(sizeof(struct vh_udma_peer));
+	if (!up) {
+		eprintf("veo_udma_peer_init: malloc peer struct failed.\n");
+		return -ENOMEM;
+	}
+	up->ctx = ctx;
+	up->q_head = up->q_tail = NULL;
+	up->host_segs = NULL;
+	up->bw_send = up->bw_recv = 0.0;
+	memset(up->adapt, 0, sizeof(up->adapt));
+	up->trace_t0 = 0;
+	up->trace_cc0 = 0;
+	up->trace_mhz = UDMA_USRCC_MHZ;
+	up->set_split[0] = up->set_split[1] = 0;
+
+	/* do you have a peer for this proc already? */
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	_udma_trace_env();
+	up->pp = _udma_proc_get(ve_node_id, proc, lib_handle);
+	pthread_rwlock_unlock(&udma_reg_lock);
+	if (!up->pp) {
+		eprintf("veo_udma_peer_init malloc failed.\n");
+		free(up);
+		return -ENOMEM;
+	}
+
+	up->numa_node = _udma_numa_node(ve_node_id);
+	up->pool = NULL;
+	up->ve_pool = 0;
+	up->ctl_slot = -1;
+	if (shared < 0) {
+		env = getenv("UDMA_SHARED");
+		shared = env ? atoi(env) > 0 : 0;
+	}
+	if (shared && (rc = _udma_pool_attach(up)) != 0) {
+		eprintf("veo_udma_peer_init: no split pool slot (rc=%d), "
+			"using a private segment\n", rc);
+		shared = 0;
+	}
+	if (!shared && (rc = _udma_peer_shm(up, buff_len)) != 0)
+		goto err_proc;
+
+	up->cmd_seq = 0;
+	up->agent_req = 0;
+	up->agent_argp = NULL;
+	env = getenv("UDMA_AGENT");
+	up->agent = env ? atoi(env) > 0 : 0;
+
+	up->eager_len = UDMA_EAGER_MAX;
+	env = getenv("UDMA_EAGER_LEN");
+	if (env) {
+		long v = atol(env);
+		if (v < 0 || v > UDMA_EAGER_SPACE) {
+			eprintf("Wrong value for UDMA_EAGER_LEN: %ld, "
+				"using default value %d\n", v, UDMA_EAGER_MAX);
+		} else
+			up->eager_len = v;
+	}
+	_udma_wait_conf_env(&up->wait);
+	memset(&up->stats, 0, sizeof(up->stats));
+
+	/* send packs go straight into the send splits */
+	up->send_pack.open = 0;
+	up->send_pack.hold = 0;
+	pthread_mutex_init(&up->send_pack.lock, NULL);
+	up->max_segs = UDMA_MAX_IOV;
+	env = getenv("UDMA_MAX_SEGS");
+	if (env) {
+		int v = atoi(env);
+		if (v <= 0 || v > (int)(UDMA_DESC_SPACE / sizeof(struct udma_seg))) {
+			eprintf("Wrong value for UDMA_MAX_SEGS: %d, "
+				"using default value %d\n", v, UDMA_MAX_IOV);
+		} else
+			up->max_segs = v;
+	}
+	up->recv_pack.data_len = 0;
+	up->recv_pack.num_entries = 0;
+	up->recv_pack.max_entries = up->max_segs;
+	up->recv_pack.vseg = (struct udma_seg *)malloc(2 * up->max_segs * sizeof(struct udma_seg));
+	if (up->recv_pack.vseg == NULL) {
+		eprintf("veo_udma_peer_init: malloc recv pack entries failed.\n");
+		if (!up->pool)
+			vh_shm_destroy(up->shm_segid);
+		rc = -ENOMEM;
+		goto err_shm;
+	}
+	up->recv_pack.hseg = up->recv_pack.vseg + up->max_segs;
+
+        pthread_mutex_init(&up->lock, NULL);
+	pthread_mutex_init(&up->q_lock, NULL);
+	up->max_pack_send = MIN(UDMA_PACK_MAX_SEND, up->split_space / 2);
+	env = getenv("UDMA_MAX_PACK_SEND");
+	if (env) {
+		long v = strtol(env, NULL, 0);
+		if (v < 0 || (size_t)v > up->split_space) {
+			eprintf("Wrong value for UDMA_MAX_PACK_SEND: %ld, "
+				"using default value %lu\n", v, up->max_pack_send);
+		} else
+			up->max_pack_send = (size_t)v;
+	}
+	up->max_pack_recv = MIN(UDMA_PACK_MAX_RECV, up->split_space / 16);
+	env = getenv("UDMA_MAX_PACK_RECV");
+	if (env) {
+		long v = strtol(env, NULL, 0);
+		if (v < 0 || (size_t)v > up->split_space) {
+			eprintf("Wrong value for UDMA_MAX_PACK_RECV: %ld, "
+				"using default value %lu\n", v, up->max_pack_recv);
+		} else
+			up->max_pack_recv = (size_t)v;
+	}
+	up->copy_pool = _udma_copy_pool_env(up->numa_node, &up->wait);
+	rc = ve_udma_setup(up);
+	/* the VE has attached (or failed), remove a private segment on last detach */
+	if (!up->pool)
+		vh_shm_destroy(up->shm_segid);
+	if (rc)
+		goto err_pack;
+
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	peer_id = _udma_peer_register(up);
+	pthread_rwlock_unlock(&udma_reg_lock);
+	if (peer_id < 0) {
+		eprintf("veo_udma_peer_init: registering peer failed.\n");
+		ve_udma_close(up);
+		rc = peer_id;
+		goto err_pack;
+	}
+	up->id = peer_id;
+	pthread_rwlock_wrlock(&udma_active_lock);
+	up->pnext = udma_active;
+	udma_active = up;
+	pthread_rwlock_unlock(&udma_active_lock);
+	if (up->trace)
+		_udma_trace_sync(up);
+
+	/* calibrate the split tables if there is no cache file, yet */
+	env = getenv("UDMA_CALIBRATE");
+	if (env && atol(env) > 0) {
+		int calib = 0;
+
+		pthread_rwlock_wrlock(&udma_reg_lock);
+		if (up->pp->tune->source == UDMA_TUNE_DEFAULT) {
+			up->pp->tune->source = UDMA_TUNE_CALIBRATED;
+			calib = 1;
+		}
+		pthread_rwlock_unlock(&udma_reg_lock);
+		if (calib)
+			veo_udma_calibrate(peer_id, atol(env) > 1 ? (size_t)atol(env)
+					   : UDMA_CALIB_MAX_LEN, 1);
+	}
+	return peer_id;
+
+err_pack:
+	_udma_copy_pool_fini(up->copy_pool);
+	free(up->recv_pack.vseg);
+err_shm:
+	if (up->pool)
+		_udma_pool_detach(up);
+	else
+		vh_shm_fini(up->shm_segid, up->shm_addr);
+err_proc:
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	_udma_proc_put(up->pp);
+	pthread_rwlock_unlock(&udma_reg_lock);
+	free(up);
+	return rc;
+}
+
+/*
+  Unregister a peer and release its resources. The peer is gone even if
+  finishing it on the VE side fails.
+
+  Returns 0 if successful, the first error otherwise.
+*/
+int veo_udma_peer_fini(int peer_id)
+{
+	int rc, err, last;
+	char *env;
+	struct vh_udma_peer *up, **pup;
+
+	if ((up = _udma_peer(peer_id)) == NULL) {
+		eprintf("veo_udma_peer_fini: illegal peer id: %d\n", peer_id);
+		return -EINVAL;
+	}
+
+	/* flush an open send pack and drain the request queue of the peer */
+	rc = veo_udma_send_pack_commit(peer_id);
+	if (rc)
+		eprintf("veo_udma_peer_fini: send pack commit failed, rc=%d\n", rc);
+	pthread_mutex_lock(&up->q_lock);
+	while (up->q_head) {
+		pthread_mutex_unlock(&up->q_lock);
+		udma_progress(NULL);
+		pthread_mutex_lock(&up->q_lock);
+	}
+	up->agent = 0;
+	rc = _udma_agent_halt(up);
+	pthread_mutex_unlock(&up->q_lock);
+	if (rc)
+		eprintf("veo_udma_peer_fini: stopping the VE agent failed, rc=%d\n", rc);
+
+	env = getenv("UDMA_STATS");
+	if (env && atoi(env) > 0)
+		_udma_stats_print(peer_id, up);
+	_udma_host_pool_fini(up);
+	_udma_bcast_detach(up);
+	/* the host state is gone, a failing VE finishes the peer anyway */
+	rc = ve_udma_close(up);
+	if (rc)
+		eprintf("ve_udma_close failed for peer %d, rc=%d\n", peer_id, rc);
+	if (up->pool)
+		_udma_pool_detach(up);
+	else if ((err = vh_shm_fini(up->shm_segid, up->shm_addr)) != 0) {
+		eprintf("vh_shm_fini failed for peer %d, rc=%d\n", peer_id, err);
+		if (!rc)
+			rc = err;
+	}
+
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	udma_peers[peer_id] = NULL;
+	_udma_ctx_hash_rebuild();
+	_udma_proc_put(up->pp);
+	pthread_rwlock_unlock(&udma_reg_lock);
+
+	pthread_rwlock_wrlock(&udma_active_lock);
+	for (pup = &udma_active; *pup; pup = &(*pup)->pnext)
+		if (*pup == up) {
+			*pup = up->pnext;
+			break;
+		}
+	last = udma_active == NULL;
+	pthread_rwlock_unlock(&udma_active_lock);
+
+	_udma_copy_pool_fini(up->copy_pool);
+	pthread_mutex_destroy(&up->send_pack.lock);
+	pthread_mutex_destroy(&up->q_lock);
+	free(up->recv_pack.vseg);
+	free(up);
+	if (last) {
+		udma_progress_thread_stop();
+		_udma_trace_write();
+	}
+	return rc;
+}
+
+/*
+  Tune splitting of buffers and overlap of transfers and memcopy.
+  The default values in the tables were measured on one machine
+  (RESULTS.splits). veo_udma_calibrate() measures them for the VE and
+  host in use and stores them in a cache file, which is loaded when a
+  proc gets its first peer.
+*/
+static const struct udma_tune udma_tune_default = {
+	UDMA_TUNE_DEFAULT,
+	5, 6,
+	{
+		{  524288,  524288,  1},
+		{ 1048576,  524288,  2},
+		{16777216, 1048576,  4},
+		{33554432, 2097152,  4},
+		{67108864, 4194304,  8}
+	},
+	{
+		{   4194304,  262144,  8},
+		{   8388608,  262144, 16},
+		{  16777216, 1048576,  4},
+		{  33554432, 1048576,  2},
+		{  67108864,   65536, 32},
+		{ 134217728,   65536, 16}
+	},
+	NULL
+};
+
+/* max split * split_size of a default peer, see _udma_split_fit() for others */
+#define UDMA_SPLIT_SPACE (UDMA_BUFF_LEN - UDMA_CTL_SEND)
+
+/* split overrides from UDMA_SPLIT_[SIZE_]{SEND,RECV}, read once */
+static int udma_env_read = 0;
+static int udma_env_split_send = 0, udma_env_split_recv = 0;
+static size_t udma_env_size_send = 0, udma_env_size_recv = 0;
+
+/* online adaptation of the splits, UDMA_ADAPTIVE=1 */
+static int udma_adaptive = 0;
+static int udma_adapt_explore = UDMA_ADAPT_EXPLORE;	// transfers between trials
+
+static void _udma_split_env_dir(const char *ename, const char *sname, int *split,
+				size_t *size)
+{
+	char *env;
+	int sp = 0;
+	size_t sz = 0;
+
+	env = getenv(ename);
+	if (env)
+		sp = atoi(env);
+	env = getenv(sname);
+	if (env)
+		sz = atol(env);
+	if (sp <= 0)
+		return;
+	if (sp > UDMA_MAX_SPLIT || sz == 0 || sp * sz > UDMA_SPLIT_SPACE) {
+		eprintf("ERROR: %s=%d %s=%lu ignored, need 0 < split <= %d and "
+			"0 < split * split_size <= %lu\n", ename, sp, sname, sz,
+			UDMA_MAX_SPLIT, UDMA_SPLIT_SPACE);
+		return;
+	}
+	*split = sp;
+	*size = sz;
+}
+
+/*
+  Must be called with the registry write lock held.
+*/
+static void _udma_split_env(void)
+{
+	char *env;
+
+	if (udma_env_read)
+		return;
+	_udma_split_env_dir("UDMA_SPLIT_SEND", "UDMA_SPLIT_SIZE_SEND",
+			    &udma_env_split_send, &udma_env_size_send);
+	_udma_split_env_dir("UDMA_SPLIT_RECV", "UDMA_SPLIT_SIZE_RECV",
+			    &udma_env_split_recv, &udma_env_size_recv);
+	env = getenv("UDMA_ADAPTIVE");
+	if (env)
+		udma_adaptive = atoi(env) > 0;
+	env = getenv("UDMA_ADAPT_EXPLORE");
+	if (env && atoi(env) > 0)
+		udma_adapt_explore = atoi(env);
+	udma_env_read = 1;
+}
+
+/*
+  Cache file name of the tuning tables for a VE node, the key is made
+  of host name, VE node and VE model. The directory is UDMA_TUNE_DIR,
+  $HOME/.veo_udma by default.
+*/
+static void _udma_tune_path(int ve_node_id, char *path, size_t len, char *dir, size_t dlen)
+{
+	char host[64], model[64] = "unknown", fn[64];
+	char *env;
+	FILE *f;
+
+	if (gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = 0;
+	snprintf(fn, sizeof(fn), "/sys/class/ve/ve%d/model", ve_node_id);
+	f = fopen(fn, "r");
+	if (f) {
+		if (fscanf(f, "%63s", model) != 1)
+			strcpy(model, "unknown");
+		fclose(f);
+	}
+	env = getenv("UDMA_TUNE_DIR");
+	if (env)
+		snprintf(dir, dlen, "%s", env);
+	else
+		snprintf(dir, dlen, "%s/.veo_udma", getenv("HOME") ? getenv("HOME") : "/tmp");
+	snprintf(path, len, "%s/tune-%s-ve%d-%s", dir, host, ve_node_id, model);
+}
+
+static int _udma_tune_check(struct tune_split *e)
+{
+	return e->split > 0 && e->split <= UDMA_MAX_SPLIT && e->size > 0
+		&& e->split * e->size <= UDMA_SPLIT_SPACE;
+}
+
+/*
+  Load the tuning tables of a VE node from its cache file, if there is
+  one. Lines look like "send|recv <transfer> <split_size> <split>",
+  entries must be ordered by transfer length.
+
+  Returns the tables, NULL if malloc failed.
+*/
+static struct udma_tune *_udma_tune_load(int ve_node_id)
+{
+	char path[PATH_MAX], dir[PATH_MAX], line[256], d[8];
+	struct udma_tune *t, *n;
+	struct tune_split e;
+	FILE *f;
+
+	t = (struct udma_tune *)malloc(sizeof(struct udma_tune));
+	if (!t)
+		return NULL;
+	*t = udma_tune_default;
+	_udma_tune_path(ve_node_id, path, sizeof(path), dir, sizeof(dir));
+	f = fopen(path, "r");
+	if (!f)
+		return t;
+	n = (struct udma_tune *)calloc(1, sizeof(struct udma_tune));
+	if (!n) {
+		fclose(f);
+		return t;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%7s %lu %lu %d", d, &e.transfer, &e.size, &e.split) != 4)
+			continue;
+		if (!_udma_tune_check(&e)) {
+			eprintf("veo_udma: bad entry in %s: %s", path, line);
+			continue;
+		}
+		if (strcmp(d, "send") == 0 && n->num_send < UDMA_MAX_TUNE)
+			n->send[n->num_send++] = e;
+		else if (strcmp(d, "recv") == 0 && n->num_recv < UDMA_MAX_TUNE)
+			n->recv[n->num_recv++] = e;
+	}
+	fclose(f);
+	if (n->num_send > 0 && n->num_recv > 0) {
+		dprintf("veo_udma: loaded split tables from %s\n", path);
+		*t = *n;
+		t->source = UDMA_TUNE_CACHED;
+		t->prev = NULL;
+	} else
+		eprintf("veo_udma: no valid entries in %s, using defaults\n", path);
+	free(n);
+	return t;
+}
+
+static int _udma_tune_save(int ve_node_id, struct udma_tune *t)
+{
+	char path[PATH_MAX], dir[PATH_MAX], host[64];
+	FILE *f;
+	int i;
+
+	_udma_tune_path(ve_node_id, path, sizeof(path), dir, sizeof(dir));
+	mkdir(dir, S_IRWXU);
+	f = fopen(path, "w");
+	if (!f) {
+		eprintf("veo_udma: can not write split tables to %s\n", path);
+		return -errno;
+	}
+	if (gethostname(host, sizeof(host)) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = 0;
+	fprintf(f, "# veo-udma split tables for %s VE%d\n", host, ve_node_id);
+	fprintf(f, "# dir transfer split_size split\n");
+	for (i = 0; i < t->num_send; i++)
+		fprintf(f, "send %lu %lu %d\n", t->send[i].transfer,
+			t->send[i].size, t->send[i].split);
+	for (i = 0; i < t->num_recv; i++)
+		fprintf(f, "recv %lu %lu %d\n", t->recv[i].transfer,
+			t->recv[i].size, t->recv[i].split);
+	fclose(f);
+	eprintf("veo_udma: split tables stored in %s\n", path);
+	return 0;
+}
+
+static void _udma_tune_free(struct udma_tune *t)
+{
+	struct udma_tune *p;
+
+	while (t) {
+		p = t->prev;
+		free(t);
+		t = p;
+	}
+}
+
+static int calc_split(const struct tune_split *tune, int num_tune, size_t len,
+		      size_t *split_size)
+{
+	int i, itune = 0;
+
+	for (i = 0; i < num_tune - 1; i++) {
+		if (len >= tune[i].transfer)
+			itune = i + 1;
+		else
+			break;
+	}
+	*split_size = tune[itune].size;
+	return tune[itune].split;
+}
+
+static int calc_split_send(struct udma_tune *tune, size_t len, size_t *split_size)
+{
+	if (udma_env_split_send) {
+		*split_size = udma_env_size_send;
+		return udma_env_split_send;
+	}
+	return calc_split(tune->send, tune->num_send, len, split_size);
+}
+
+static int calc_split_recv(struct udma_tune *tune, size_t len, size_t *split_size)
+{
+	if (udma_env_split_recv) {
+		*split_size = udma_env_size_recv;
+		return udma_env_split_recv;
+	}
+	return calc_split(tune->recv, tune->num_recv, len, split_size);
+}
+
+/*
+  Online adaptation of split count and split size. Each peer keeps per
+  direction and power of 2 size bucket the configuration in use and an
+  EWMA of its throughput. Every udma_adapt_explore-th transfer of a
+  bucket tries a neighbouring configuration (split or split size halved
+  or doubled), it replaces the current one if it was clearly faster than
+  the current estimate. As the estimate follows the load on the PCIe bus,
+  the choice follows, too. All adaptation state is protected by the
+  peer's q_lock.
+*/
+static struct udma_adapt *_udma_adapt_bucket(struct vh_udma_peer *up, int op, size_t len)
+{
+	int b = 0;
+
+	if (!udma_adaptive || len < UDMA_ADAPT_MIN_LEN)
+		return NULL;
+	if ((op == UDMA_OP_SEND && udma_env_split_send) ||
+	    (op == UDMA_OP_RECV && udma_env_split_recv))
+		return NULL;
+	for (len /= UDMA_ADAPT_MIN_LEN; len > 1 && b < UDMA_ADAPT_BUCKETS - 1; len /= 2)
+		b++;
+	return &up->adapt[op == UDMA_OP_SEND ? 0 : 1][b];
+}
+
+static int _udma_adapt_valid(int split, size_t size, size_t len, size_t space)
+{
+	return split > 0 && split <= UDMA_MAX_SPLIT && size >= UDMA_CALIB_MIN_SPLIT
+		&& split * size <= space && (split - 1) * size < len;
+}
+
+/*
+  Choose the configuration of a request that is about to start, within
+  space, the split space available to it.
+  Must be called with the peer's q_lock held.
+*/
+static void _udma_adapt_pick(struct veo_udma_req *r, size_t space)
+{
+	struct udma_adapt *a = r->adapt;
+	int i, split;
+	size_t size;
+
+	if (a->split == 0) {
+		/* first transfer of the bucket starts from the fitted tables */
+		_udma_split_fit(r, space);
+		a->split = r->split;
+		a->size = r->split_size;
+		return;
+	}
+	r->split = a->split;
+	r->split_size = a->size;
+	if (a->trial || a->bw == 0.0 || ++a->count < udma_adapt_explore)
+		return;
+	a->count = 0;
+	for (i = 0; i < 4; i++) {
+		split = a->split;
+		size = a->size;
+		switch (a->next++ & 3) {
+		case 0: split *= 2; break;
+		case 1: split /= 2; break;
+		case 2: size *= 2; break;
+		case 3: size /= 2; break;
+		}
+		if (_udma_adapt_valid(split, size, r->len, space)) {
+			r->split = split;
+			r->split_size = size;
+			r->adapt_trial = 1;
+			a->trial = 1;
+			r->up->stats.adapt_trials++;
+			return;
+		}
+	}
+}
+
+/*
+  Account the throughput of a finished request.
+  Must be called with the peer's q_lock held.
+*/
+static void _udma_adapt_update(struct veo_udma_req *r, double bw)
+{
+	struct udma_adapt *a = r->adapt;
+
+	if (!r->adapt_trial) {
+		if (r->split == a->split && r->split_size == a->size)
+			a->bw = a->bw > 0.0 ? (1.0 - UDMA_ADAPT_WEIGHT) * a->bw
+				+ UDMA_ADAPT_WEIGHT * bw : bw;
+		return;
+	}
+	a->trial = 0;
+	/* switch only for a clear gain, measurements are noisy */
+	if (bw > a->bw * UDMA_ADAPT_MARGIN) {
+		dprintf("veo_udma adapt: len=%lu split %d/%lu -> %d/%lu, %.0f -> %.0f MB/s\n",
+			r->len, a->split, a->size, r->split, r->split_size,
+			a->bw * 1e3, bw * 1e3);
+		a->split = r->split;
+		a->size = r->split_size;
+		a->bw = bw;
+		r->up->stats.adapt_switches++;
+	}
+}
+
+#define SPLITBUFF(base, idx, size) (void *)((char *)base + idx * size)
+
+static inline uint64_t udma_now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static inline int64_t _udma_usrcc_ns(struct vh_udma_peer *up, int64_t cc)
+{
+	return (int64_t)((double)cc * 1e3 / up->trace_mhz);
+}
+
+/*
+  Read UDMA_TRACE and UDMA_TRACE_MAX once.
+  Must be called with the registry write lock held.
+*/
+static void _udma_trace_env(void)
+{
+	char *env;
+
+	if (udma_trace_read)
+		return;
+	udma_trace_read = 1;
+	env = getenv("UDMA_TRACE");
+	if (env && *env) {
+		udma_trace_file = strdup(env);
+		udma_trace_t0 = udma_now_ns();
+	}
+	env = getenv("UDMA_TRACE_MAX");
+	if (env && atol(env) > 0)
+		udma_trace_max = (size_t)atol(env);
+}
+
+/*
+  Add a trace record, records beyond udma_trace_max are dropped.
+  Must be called with udma_trace_lock held.
+
+  Returns the record or NULL.
+*/
+static struct udma_trace_rec *_udma_trace_add(struct vh_udma_peer *up, int ve, int ev,
+					      int dir, int split, uint64_t len,
+					      uint64_t t, uint64_t dur)
+{
+	struct udma_trace_rec *tr;
+	size_t n;
+
+	if (udma_trace_n == udma_trace_len) {
+		n = udma_trace_len ? 2 * udma_trace_len : 65536;
+		if (n > udma_trace_max)
+			n = udma_trace_max;
+		tr = n > udma_trace_len ? (struct udma_trace_rec *)
+			realloc(udma_trace_recs, n * sizeof(struct udma_trace_rec)) : NULL;
+		if (tr == NULL) {
+			udma_trace_dropped++;
+			return NULL;
+		}
+		udma_trace_recs = tr;
+		udma_trace_len = n;
+	}
+	tr = &udma_trace_recs[udma_trace_n++];
+	tr->t = t;
+	tr->dur = dur;
+	tr->len = len;
+	tr->peer = up->id;
+	tr->ve_node = up->pp->ve_node_id;
+	tr->split = split;
+	tr->ev = ev;
+	tr->dir = dir;
+	tr->ve = ve;
+	tr->op = 0;
+	return tr;
+}
+
+static void _udma_trace_rec(struct vh_udma_peer *up, int ve, int ev, int dir, int split,
+			    uint64_t len, uint64_t t, uint64_t dur)
+{
+	pthread_mutex_lock(&udma_trace_lock);
+	_udma_trace_add(up, ve, ev, dir, split, len, t, dur);
+	pthread_mutex_unlock(&udma_trace_lock);
+}
+
+/*
+  Pick up the VE trace events of the last VE call of a peer, converting
+  usrcc to the VH clock.
+  Must be called with the peer's q_lock held.
+*/
+static void _udma_trace_drain(struct vh_udma_peer *up)
+{
+	struct udma_trace_buf *tb = up->trace;
+	struct udma_trace_ev *e;
+	uint64_t i, n = tb->n;
+
+	if (n > UDMA_TRACE_EVENTS)
+		n = UDMA_TRACE_EVENTS;
+	pthread_mutex_lock(&udma_trace_lock);
+	for (i = 0; i < n; i++) {
+		e = &tb->ev[i];
+		_udma_trace_add(up, 1, e->ev, e->dir, e->split, e->len,
+				up->trace_t0 + _udma_usrcc_ns(up, (int64_t)(e->t - up->trace_cc0)),
+				_udma_usrcc_ns(up, e->dur));
+	}
+	udma_trace_dropped += tb->dropped;
+	pthread_mutex_unlock(&udma_trace_lock);
+	tb->n = 0;
+	tb->dropped = 0;
+}
+
+/*
+  Write the trace records in Chrome trace event format, one process per
+  peer with a VH and a VE thread. Timestamps are relative to the first
+  peer init, in us.
+*/
+static void _udma_trace_write(void)
+{
+	static const char *ev_name[] = {"request", "wait", "copy", "dma", "ack"};
+	static const char *op_name[] = {"send", "recv", "send_pack", "call", "stop",
+					"exchange", "bcast"};
+	static const char *dir_name[] = {"vh_to_ve", "ve_to_vh"};
+	struct udma_trace_rec *tr;
+	char *seen;
+	FILE *f;
+	size_t i;
+	int maxp = 0, sep = 0;
+
+	pthread_mutex_lock(&udma_trace_lock);
+	if (udma_trace_file == NULL || udma_trace_n == 0)
+		goto out;
+	for (i = 0; i < udma_trace_n; i++)
+		if (udma_trace_recs[i].peer > maxp)
+			maxp = udma_trace_recs[i].peer;
+	seen = (char *)calloc(maxp + 1, 1);
+	f = fopen(udma_trace_file, "w");
+	if (f == NULL || seen == NULL) {
+		eprintf("veo_udma: writing trace %s failed\n", udma_trace_file);
+		if (f)
+			fclose(f);
+		free(seen);
+		goto out;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < udma_trace_n; i++) {
+		tr = &udma_trace_recs[i];
+		if (seen[tr->peer])
+			continue;
+		seen[tr->peer] = 1;
+		fprintf(f, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":\"peer %d (VE%d)\"}},\n"
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+			"\"args\":{\"name\":\"VH\"}},\n"
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+			"\"args\":{\"name\":\"VE\"}}",
+			sep ? ",\n" : "", tr->peer, tr->peer, tr->ve_node, tr->peer, tr->peer);
+		sep = 1;
+	}
+	for (i = 0; i < udma_trace_n; i++) {
+		tr = &udma_trace_recs[i];
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,"
+			"\"ts\":%.3f,",
+			tr->ev == UDMA_TR_REQ ? op_name[tr->op] : ev_name[tr->ev],
+			dir_name[tr->dir], tr->peer, tr->ve,
+			(double)(int64_t)(tr->t - udma_trace_t0) / 1e3);
+		if (tr->ev == UDMA_TR_ACK)
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",");
+		else
+			fprintf(f, "\"ph\":\"X\",\"dur\":%.3f,", tr->dur / 1e3);
+		if (tr->ev == UDMA_TR_REQ)
+			fprintf(f, "\"args\":{\"len\":%lu}}", tr->len);
+		else
+			fprintf(f, "\"args\":{\"split\":%u,\"len\":%lu}}",
+				(unsigned)tr->split, tr->len);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	free(seen);
+	if (udma_trace_dropped)
+		eprintf("veo_udma: %lu trace events dropped, raise UDMA_TRACE_MAX\n",
+			udma_trace_dropped);
+out:
+	pthread_mutex_unlock(&udma_trace_lock);
+}
+
+/*
+  Wait policies. A waiting loop calls _udma_wait_idle() after each round
+  of progress, with no lock held. As long as udma_work moves it returns
+  immediately. After spin idle loops the YIELD policy
+  calls sched_yield(), SLEEP yields UDMA_WAIT_YIELDS times and then
+  sleeps, doubling the sleep up to sleep_max_ns. The time is accounted
+  to the peer whose policy is applied.
+*/
+struct udma_waiter {
+	struct vh_udma_peer *up;
+	uint64_t work;		// udma_work seen last
+	uint64_t t;		// end of the last idle loop, 0: busy
+	int idle;		// idle loops
+	long sleep_ns;
+};
+
+static void _udma_wait_conf_env(struct udma_wait_conf *c)
+{
+	char *env;
+
+	c->policy = UDMA_WAIT_SPIN;
+	c->spin = UDMA_WAIT_SPIN_LOOPS;
+	c->sleep_max_ns = UDMA_WAIT_SLEEP_US * 1000L;
+	c->peek_every = 1;
+	env = getenv("UDMA_WAIT");
+	if (env) {
+		if (strcmp(env, "yield") == 0)
+			c->policy = UDMA_WAIT_YIELD;
+		else if (strcmp(env, "sleep") == 0)
+			c->policy = UDMA_WAIT_SLEEP;
+		else if (strcmp(env, "spin") != 0)
+			eprintf("Wrong value for UDMA_WAIT: %s, using spin\n", env);
+	}
+	env = getenv("UDMA_WAIT_SPIN");
+	if (env && atoi(env) >= 0)
+		c->spin = atoi(env);
+	env = getenv("UDMA_WAIT_SLEEP_US");
+	if (env && atol(env) > 0)
+		c->sleep_max_ns = atol(env) * 1000L;
+	env = getenv("UDMA_PEEK_EVERY");
+	if (env && atoi(env) > 0)
+		c->peek_every = atoi(env);
+}
+
+static void _udma_wait_init(struct udma_waiter *w, struct vh_udma_peer *up)
+{
+	w->up = up;
+	w->work = udma_work;
+	w->t = 0;
+	w->idle = 0;
+	w->sleep_ns = UDMA_WAIT_MIN_SLEEP_NS;
+}
+
+static void _udma_wait_idle(struct udma_waiter *w)
+{
+	struct udma_wait_conf *c;
+	struct veo_udma_wait_stats *st;
+	struct timespec ts;
+	uint64_t now, t;
+
+	if (udma_work != w->work || !w->up) {
+		w->work = udma_work;
+		w->t = 0;
+		w->idle = 0;
+		w->sleep_ns = UDMA_WAIT_MIN_SLEEP_NS;
+		return;
+	}
+	c = &w->up->wait;
+	st = &w->up->stats.wait;
+	now = udma_now_ns();
+	if (w->t)
+		__sync_fetch_and_add(&st->spin_ns, now - w->t);
+	w->t = now;
+	if (c->policy == UDMA_WAIT_SPIN || w->idle++ < c->spin)
+		return;
+	if (c->policy == UDMA_WAIT_YIELD || w->idle < c->spin + UDMA_WAIT_YIELDS) {
+		sched_yield();
+		w->t = udma_now_ns();
+		__sync_fetch_and_add(&st->yield_ns, w->t - now);
+		return;
+	}
+	ts.tv_sec = w->sleep_ns / 1000000000L;
+	ts.tv_nsec = w->sleep_ns % 1000000000L;
+	nanosleep(&ts, NULL);
+	t = udma_now_ns();
+	__sync_fetch_and_add(&st->sleep_ns, t - now);
+	w->t = t;
+	w->sleep_ns = MIN(2 * w->sleep_ns, c->sleep_max_ns);
+}
+
+/*
+  Progress engine.
+
+  Each peer owns one pair of shm staging buffers, so its transfer
+  requests are queued and handled one after the other. Requests of
+  different peers are in flight at the same time. Progress is made by
+  threads waiting for a request and, for asynchronous requests, by a
+  progress thread started with the first async request. The queue and
+  request states of a peer are protected by its q_lock, which is held
+  while making progress on the peer. So the staging copies and VE
+  peeks of different peers run at the same time.
+*/
+
+/*
+  Zero the length mailboxes of one direction after the VE side bailed out.
+*/
+static void _udma_comm_reset(struct vh_udma_comm *c)
+{
+	int i;
+
+	for (i = 0; i < UDMA_MAX_SPLIT; i++)
+		*(c->len + i) = 0;
+}
+
+static void _udma_req_init(struct veo_udma_req *r, int op, struct vh_udma_peer *up,
+			   void *hp, uint64_t vp, size_t len)
+{
+	memset(r, 0, sizeof(struct veo_udma_req));
+	r->op = op;
+	r->up = up;
+	r->hp = (char *)hp;
+	r->vp = vp;
+	r->len = len;
+	r->lenp = len;
+	r->state = UDMA_REQ_QUEUED;
+	if (op == UDMA_OP_SEND || op == UDMA_OP_RECV) {
+		/* buffers in the host pool need no staging */
+		r->zc = _udma_host_vehva(up, hp, len);
+		if (r->zc)
+			r->lenp = 0;
+	}
+	if (op == UDMA_OP_SEND)
+		r->split = calc_split_send(up->pp->tune, len, &r->split_size);
+	else if (op == UDMA_OP_RECV)
+		r->split = calc_split_recv(up->pp->tune, len, &r->split_size);
+	if ((op == UDMA_OP_SEND || op == UDMA_OP_RECV) && up->set_split[op]) {
+		r->split = up->set_split[op];
+		r->split_size = up->set_split_size[op];
+	} else if ((op == UDMA_OP_SEND || op == UDMA_OP_RECV) && !r->zc)
+		r->adapt = _udma_adapt_bucket(up, op, len);
+	else if (op == UDMA_OP_SEND_PACKED) {
+		/* pack entries are 8 byte aligned within the splits */
+		r->split = calc_split_send(up->pp->tune, up->split_space, &r->split_size);
+		r->split_size &= ~7UL;
+	}
+}
+
+/*
+  Give the pool chunks of a request back.
+*/
+static void _udma_req_chunks_free(struct veo_udma_req *r)
+{
+	if (r->nchunk) {
+		pthread_mutex_lock(&udma_pool_lock);
+		memset(r->up->pool->chunk + r->chunk, 0, r->nchunk);
+		pthread_mutex_unlock(&udma_pool_lock);
+		r->nchunk = 0;
+	}
+}
+
+/*
+  Unlink a finished request from its peer queue and store its result.
+  Must be called with the peer's q_lock held.
+*/
+static void _udma_req_done(struct veo_udma_req *r, size_t result, int err)
+{
+	struct vh_udma_peer *up = r->up;
+	double bw, *bwp = NULL;
+	uint64_t dt;
+
+	/* throughput estimate of the peer, used for balancing stripes */
+	if (r->op == UDMA_OP_SEND)
+		bwp = &up->bw_send;
+	else if (r->op == UDMA_OP_RECV)
+		bwp = &up->bw_recv;
+	if (bwp && !err && r->t_start) {
+		dt = udma_now_ns() - r->t_start;
+		bw = dt > 0 ? (double)result / (double)dt : 0.0;
+		if (result >= UDMA_BW_MIN_LEN)
+			*bwp = *bwp > 0.0 ? (7.0 * *bwp + bw) / 8.0 : bw;
+		if (r->adapt)
+			_udma_adapt_update(r, bw);
+	} else if (r->adapt && r->adapt_trial)
+		r->adapt->trial = 0;
+	if (up->trace) {
+		struct udma_trace_rec *tr;
+
+		_udma_trace_drain(up);
+		if (r->op != UDMA_OP_CALL && r->t_start) {
+			pthread_mutex_lock(&udma_trace_lock);
+			tr = _udma_trace_add(up, 0, UDMA_TR_REQ, r->op == UDMA_OP_RECV, 0,
+					     result, r->t_start, udma_now_ns() - r->t_start);
+			if (tr)
+				tr->op = r->op;
+			pthread_mutex_unlock(&udma_trace_lock);
+		}
+	}
+	switch (r->op) {
+	case UDMA_OP_SEND:
+	case UDMA_OP_SEND_PACKED:
+	case UDMA_OP_BCAST:
+		up->stats.send_bytes += result;
+		up->stats.send_calls++;
+		break;
+	case UDMA_OP_RECV:
+		up->stats.recv_bytes += result;
+		up->stats.recv_calls++;
+		break;
+	case UDMA_OP_EXCHANGE:
+		if (!err) {
+			up->stats.send_bytes += r->len;
+			up->stats.recv_bytes += r->pair->len;
+		}
+		up->stats.send_calls++;
+		up->stats.recv_calls++;
+		break;
+	}
+	if (r->argp) {
+		veo_args_free(r->argp);
+		r->argp = NULL;
+	}
+	_udma_req_chunks_free(r);
+	if (r->pair)
+		_udma_req_chunks_free(r->pair);
+	up->q_head = r->next;
+	if (up->q_head == NULL)
+		up->q_tail = NULL;
+	r->next = NULL;
+	r->result = result;
+	r->err = err;
+	if (r->async)
+		__sync_fetch_and_sub(&udma_num_async, 1);
+	__sync_fetch_and_add(&udma_work, 1);
+	__sync_synchronize();
+	r->state = UDMA_REQ_DONE;
+}
+
+/*
+  VE agent: a long running VE function on the peer's context polls the
+  command ring in shm. Transfers are started by writing a command and
+  ringing the doorbell instead of a VEO call. A plain VE call on the
+  context stops the agent, it is started again with the next transfer.
+  Must be called with the peer's q_lock held.
+*/
+static int _udma_agent_run(struct vh_udma_peer *up)
+{
+	struct veo_args *argp;
+
+	argp = veo_args_alloc();
+	if (argp == NULL) {
+		eprintf("veo_udma: veo_args_alloc failed\n");
+		return -ENOMEM;
+	}
+	veo_args_set_u64(argp, 0, up->ve_peer);
+	veo_args_set_u64(argp, 1, up->cmd_seq);
+	up->agent_req = veo_call_async(up->ctx, up->pp->ve_udma_agent, argp);
+	if (up->agent_req == VEO_REQUEST_ID_INVALID) {
+		eprintf("veo_udma: starting the VE agent failed\n");
+		up->agent_req = 0;
+		veo_args_free(argp);
+		return -EIO;
+	}
+	up->agent_argp = argp;
+	return 0;
+}
+
+/*
+  Write a command into the ring and ring the doorbell.
+*/
+static uint64_t _udma_agent_cmd(struct vh_udma_peer *up, int op, struct veo_udma_req *r)
+{
+	uint64_t seq = ++up->cmd_seq;
+	struct udma_cmd *c = &up->cmd->cmd[seq % UDMA_CMD_RING];
+
+	c->op = op;
+	if (r) {
+		c->split = r->split;
+		c->vp = r->vp;
+		c->len = r->len;
+		c->split_size = r->split_size;
+		c->zc = r->zc;
+		c->nseg = r->vseg ? r->nvseg : 0;
+		c->strided = r->vs != NULL;
+		c->eager = r->eager;
+		if (r->pair) {
+			c->split2 = r->pair->split;
+			c->vp2 = r->pair->vp;
+			c->len2 = r->pair->len;
+			c->split_size2 = r->pair->split_size;
+			c->zc2 = r->pair->zc;
+		}
+	}
+	c->seq = seq;
+	__sync_synchronize();
+	up->cmd->head = seq;
+	return seq;
+}
+
+/*
+  Stop the agent, if it runs. All its commands must be completed.
+*/
+static int _udma_agent_halt(struct vh_udma_peer *up)
+{
+	uint64_t retval = 0;
+	int rc;
+
+	if (!up->agent_req)
+		return 0;
+	_udma_agent_cmd(up, UDMA_OP_STOP, NULL);
+	rc = veo_call_wait_result(up->ctx, up->agent_req, &retval);
+	veo_args_free(up->agent_argp);
+	up->agent_argp = NULL;
+	up->agent_req = 0;
+	if (rc != VEO_COMMAND_OK) {
+		eprintf("veo_udma: VE agent failed, rc=%d\n", rc);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int _udma_agent_post(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	int rc;
+
+	if (!up->agent_req && (rc = _udma_agent_run(up)) != 0)
+		return rc;
+	/* the previous requests of the peer are done */
+	if (r->vseg)
+		memcpy(up->desc, r->vseg, r->nvseg * sizeof(struct udma_seg));
+	else if (r->vs)
+		memcpy(up->desc, r->vs, sizeof(struct udma_strided));
+	r->cmd = _udma_agent_cmd(up, r->op, r);
+	r->t_start = udma_now_ns();
+	r->state = UDMA_REQ_ACTIVE;
+	return 0;
+}
+
+/*
+  Check for the completion of an agent command, like _udma_req_peek().
+*/
+static int _udma_agent_peek(struct veo_udma_req *r, uint64_t *retval)
+{
+	struct vh_udma_peer *up = r->up;
+	struct udma_cmd *c = &up->cmd->cmd[r->cmd % UDMA_CMD_RING];
+	uint64_t v, t;
+	int rc;
+
+	if (c->done == r->cmd) {
+		__sync_synchronize();
+		*retval = c->result;
+		return 1;
+	}
+	/* did the agent die? */
+	if (++r->npeek % up->wait.peek_every) {
+		up->stats.wait.peeks_skipped++;
+		return 0;
+	}
+	up->stats.wait.peeks++;
+	t = udma_now_ns();
+	rc = veo_call_peek_result(up->ctx, up->agent_req, &v);
+	up->stats.peek_ns += udma_now_ns() - t;
+	if (rc == VEO_COMMAND_UNFINISHED)
+		return 0;
+	eprintf("veo_udma: VE agent ended unexpectedly, rc=%d\n", rc);
+	veo_args_free(up->agent_argp);
+	up->agent_argp = NULL;
+	up->agent_req = 0;
+	return -EIO;
+}
+
+/*
+  Shrink the splits of a request to space, usually the split space of
+  its peer. The split tables are made for peers of the default size.
+*/
+static void _udma_split_fit(struct veo_udma_req *r, size_t space)
+{
+
+	if ((size_t)r->split * r->split_size <= space)
+		return;
+	if (space / r->split < UDMA_CALIB_MIN_SPLIT)
+		r->split = space > UDMA_CALIB_MIN_SPLIT ? space / UDMA_CALIB_MIN_SPLIT : 1;
+	r->split_size = (space / r->split) & ~4095UL;
+}
+
+/*
+  Place the splits of a request. Pool peers take free chunks of the
+  pool and pass their offset to the VE in the mailbox.
+  Must be called with the peer's q_lock held.
+
+  Returns 0 if successful, -EAGAIN if the pool is too full right now.
+*/
+static int _udma_req_splits(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	struct udma_pool *pool = up->pool;
+	volatile size_t *mb = r->op == UDMA_OP_RECV ? up->recv.len : up->send.len;
+	int i, n, nfree = 0;
+
+	r->sbuf = r->op == UDMA_OP_RECV ? up->recv.shm : up->send.shm;
+	if (!pool)
+		return 0;
+	n = (int)((r->split * r->split_size + UDMA_POOL_CHUNK - 1) / UDMA_POOL_CHUNK);
+	pthread_mutex_lock(&udma_pool_lock);
+	for (i = 0; i < pool->nchunks; i++) {
+		nfree = pool->chunk[i] ? 0 : nfree + 1;
+		if (nfree == n)
+			break;
+	}
+	if (nfree < n) {
+		pthread_mutex_unlock(&udma_pool_lock);
+		return -EAGAIN;
+	}
+	i -= n - 1;
+	memset(pool->chunk + i, 1, n);
+	pthread_mutex_unlock(&udma_pool_lock);
+	r->chunk = i;
+	r->nchunk = n;
+	r->sbuf = (char *)pool->addr + pool->data_offs + (size_t)i * UDMA_POOL_CHUNK;
+	mb[UDMA_MBOX_DATA] = r->sbuf - (char *)pool->addr;
+	__sync_synchronize();
+	return 0;
+}
+
+/*
+  Call the VE side function of a request with its arguments in r->argp.
+
+  Returns 0 if successful, -EIO otherwise.
+*/
+static int _udma_req_call(struct veo_udma_req *r, uint64_t addr)
+{
+	r->req = veo_call_async(r->up->ctx, addr, r->argp);
+	if (r->req == VEO_REQUEST_ID_INVALID) {
+		eprintf("veo_udma: veo_call_async failed, op=%d\n", r->op);
+		return -EIO;
+	}
+	r->t_start = udma_now_ns();
+	r->state = UDMA_REQ_ACTIVE;
+	return 0;
+}
+
+/*
+  Start the VE side function handling the request.
+
+  Returns 0 if started, -EAGAIN if it must wait for pool space, another
+  negative number if it failed.
+*/
+static int _udma_req_start(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	struct vh_udma_proc *pp = up->pp;
+	uint64_t addr = 0;
+	size_t space = up->split_space;
+	struct veo_args *argp;
+
+	/* calls need the context, an agent occupying it leaves first */
+	if ((r->op == UDMA_OP_CALL || !up->agent) && up->agent_req) {
+		int rc = _udma_agent_halt(up);
+		if (rc)
+			return rc;
+	}
+	if (r->op == UDMA_OP_CALL) {
+		addr = r->vp;
+		goto call;
+	}
+	/* tiny contiguous transfers skip the splits */
+	if ((r->op == UDMA_OP_SEND || r->op == UDMA_OP_RECV) && r->len <= up->eager_len
+	    && !r->zc && !r->hs && !r->hc && !r->vs && !r->vseg) {
+		r->eager = 1;
+		r->lenp = 0;
+		r->adapt = NULL;
+		if (r->op == UDMA_OP_SEND)
+			memcpy(up->send.eager, r->hp, r->len);
+	}
+	/* both parts of an exchange on a pool peer get half of the pool */
+	if (r->pair && up->pool)
+		space = (space / 2) & ~((size_t)UDMA_POOL_CHUNK - 1);
+	if (r->adapt)
+		_udma_adapt_pick(r, space);
+	if (!r->eager) {
+		_udma_split_fit(r, space);
+		if (_udma_req_splits(r)) {
+			/* retried later, try the neighbour then */
+			if (r->adapt_trial) {
+				r->adapt->trial = 0;
+				r->adapt_trial = 0;
+			}
+			return -EAGAIN;
+		}
+	}
+	if (r->pair) {
+		_udma_split_fit(r->pair, space);
+		if (_udma_req_splits(r->pair)) {
+			_udma_req_chunks_free(r);
+			return -EAGAIN;
+		}
+	}
+	if (up->agent)
+		return _udma_agent_post(r);
+	argp = veo_args_alloc();
+	if (argp == NULL) {
+		eprintf("veo_udma: veo_args_alloc failed\n");
+		return -ENOMEM;
+	}
+	switch (r->op) {
+	case UDMA_OP_SEND:
+		if (r->eager) {
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_u64(argp, 1, r->vp);
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			addr = pp->ve_udma_recv_eager;
+			break;
+		}
+		if (r->vseg) {
+			/* the previous requests of the peer are done */
+			memcpy(up->desc, r->vseg, r->nvseg * sizeof(struct udma_seg));
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_i32(argp, 1, r->nvseg);
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			veo_args_set_i32(argp, 3, r->split);
+			veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+			addr = pp->ve_udma_recvv;
+			break;
+		}
+		if (r->vs) {
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_stack(argp, VEO_INTENT_IN, 1, (char *)r->vs,
+					   sizeof(struct udma_strided));
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			veo_args_set_i32(argp, 3, r->split);
+			veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+			addr = pp->ve_udma_recv_strided;
+			break;
+		}
+		veo_args_set_u64(argp, 0, up->ve_peer);
+		veo_args_set_u64(argp, 1, r->vp);
+		veo_args_set_u64(argp, 2, (uint64_t)r->len);
+		veo_args_set_i32(argp, 3, r->split);
+		veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+		veo_args_set_u64(argp, 5, r->zc);
+		addr = pp->ve_udma_recv;
+		break;
+	case UDMA_OP_SEND_PACKED:
+		veo_args_set_u64(argp, 0, up->ve_peer);
+		veo_args_set_i32(argp, 1, r->split);
+		veo_args_set_u64(argp, 2, (uint64_t)r->split_size);
+		addr = pp->ve_udma_recv_pack;
+		break;
+	case UDMA_OP_RECV:
+		if (r->eager) {
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_u64(argp, 1, r->vp);
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			addr = pp->ve_udma_send_eager;
+			break;
+		}
+		if (r->vseg) {
+			/* the previous requests of the peer are done */
+			memcpy(up->desc, r->vseg, r->nvseg * sizeof(struct udma_seg));
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_i32(argp, 1, r->nvseg);
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			veo_args_set_i32(argp, 3, r->split);
+			veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+			addr = pp->ve_udma_sendv;
+			break;
+		}
+		if (r->vs) {
+			veo_args_set_u64(argp, 0, up->ve_peer);
+			veo_args_set_stack(argp, VEO_INTENT_IN, 1, (char *)r->vs,
+					   sizeof(struct udma_strided));
+			veo_args_set_u64(argp, 2, (uint64_t)r->len);
+			veo_args_set_i32(argp, 3, r->split);
+			veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+			addr = pp->ve_udma_send_strided;
+			break;
+		}
+		veo_args_set_u64(argp, 0, up->ve_peer);
+		veo_args_set_u64(argp, 1, r->vp);
+		veo_args_set_u64(argp, 2, (uint64_t)r->len);
+		veo_args_set_i32(argp, 3, r->split);
+		veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+		veo_args_set_u64(argp, 5, r->zc);
+		addr = pp->ve_udma_send;
+		break;
+	case UDMA_OP_EXCHANGE:
+		veo_args_set_u64(argp, 0, up->ve_peer);
+		veo_args_set_u64(argp, 1, r->vp);
+		veo_args_set_u64(argp, 2, (uint64_t)r->len);
+		veo_args_set_i32(argp, 3, r->split);
+		veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+		veo_args_set_u64(argp, 5, r->zc);
+		veo_args_set_u64(argp, 6, r->pair->vp);
+		veo_args_set_u64(argp, 7, (uint64_t)r->pair->len);
+		veo_args_set_i32(argp, 8, r->pair->split);
+		veo_args_set_u64(argp, 9, (uint64_t)r->pair->split_size);
+		veo_args_set_u64(argp, 10, r->pair->zc);
+		addr = pp->ve_udma_exchange;
+		break;
+	case UDMA_OP_BCAST:
+		veo_args_set_u64(argp, 0, up->ve_peer);
+		veo_args_set_u64(argp, 1, r->vp);
+		veo_args_set_u64(argp, 2, (uint64_t)r->len);
+		veo_args_set_i32(argp, 3, r->split);
+		veo_args_set_u64(argp, 4, (uint64_t)r->split_size);
+		veo_args_set_u64(argp, 5, r->zc);
+		addr = pp->ve_udma_recv_bcast;
+		break;
+	}
+	r->argp = argp;
+	/* a send pack owns its splits now, the VE is called by the step */
+	if (r->op == UDMA_OP_SEND_PACKED && up->send_pack.hold) {
+		r->req = VEO_REQUEST_ID_INVALID;
+		r->t_start = udma_now_ns();
+		r->state = UDMA_REQ_ACTIVE;
+		return 0;
+	}
+call:
+	return _udma_req_call(r, addr);
+}
+
+/*
+  Peek at the VE side call of an active request.
+
+  Returns 1 if the call has finished, 0 if it is still running,
+  a negative number if the call failed.
+*/
+static int _udma_req_peek(struct veo_udma_req *r, uint64_t *retval)
+{
+	uint64_t t;
+	int rc;
+
+	if (r->cmd)
+		return _udma_agent_peek(r, retval);
+	if (++r->npeek % r->up->wait.peek_every) {
+		r->up->stats.wait.peeks_skipped++;
+		return 0;
+	}
+	r->up->stats.wait.peeks++;
+	t = udma_now_ns();
+	rc = veo_call_peek_result(r->up->ctx, r->req, retval);
+	r->up->stats.peek_ns += udma_now_ns() - t;
+
+	if (rc == VEO_COMMAND_UNFINISHED)
+		return 0;
+	if (rc != VEO_COMMAND_OK) {
+		if (rc == VEO_COMMAND_EXCEPTION)
+			eprintf("veo_udma: op %d failed with exception on VE. %p\n",
+				r->op, (void *)*retval);
+		else
+			eprintf("veo_udma: op %d failed with error on VH.\n", r->op);
+		return -EIO;
+	}
+	return 1;
+}
+
+/*
+  Copy the next split of a send request into its free slot and hand it
+  to the VE.
+*/
+static void _udma_stage_split(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	size_t tlen = MIN(r->split_size, r->lenp);
+	uint64_t t = udma_now_ns(), t1;
+
+	if (r->t_slot) {
+		up->stats.slot_wait_ns += t - r->t_slot;
+		if (up->trace)
+			_udma_trace_rec(up, 0, UDMA_TR_WAIT, 0, r->slot, tlen, r->t_slot,
+					t - r->t_slot);
+		r->t_slot = 0;
+	}
+	if (r->hs)
+		_strided_copy(r->hs, r->len - r->lenp,
+			      SPLITBUFF(r->sbuf, r->slot, r->split_size), tlen, 0);
+	else if (r->hc)
+		_seg_copy(r->hc, SPLITBUFF(r->sbuf, r->slot, r->split_size), tlen, 0);
+	else
+		_udma_memcpy(up->copy_pool, SPLITBUFF(r->sbuf, r->slot, r->split_size),
+			     (void *)r->hp, tlen);
+	t1 = udma_now_ns();
+	up->stats.memcpy_ns += t1 - t;
+	*(volatile size_t *)(up->send.len + r->slot) = tlen;
+	__sync_fetch_and_add(&udma_work, 1);
+	if (up->trace) {
+		_udma_trace_rec(up, 0, UDMA_TR_COPY, 0, r->slot, tlen, t, t1 - t);
+		_udma_trace_rec(up, 0, UDMA_TR_ACK, 0, r->slot, tlen, udma_now_ns(), 0);
+	}
+	r->hp += tlen;
+	r->lenp -= tlen;
+	r->slot = (r->slot + 1) % r->split;
+}
+
+/*
+  Copy out the received split of tlen bytes of a recv request and hand
+  its slot back to the VE.
+*/
+static void _udma_unstage_split(struct veo_udma_req *r, size_t tlen)
+{
+	struct vh_udma_peer *up = r->up;
+	uint64_t t = udma_now_ns(), t1;
+
+	if (r->t_slot) {
+		up->stats.slot_wait_ns += t - r->t_slot;
+		if (up->trace)
+			_udma_trace_rec(up, 0, UDMA_TR_WAIT, 1, r->slot, tlen, r->t_slot,
+					t - r->t_slot);
+		r->t_slot = 0;
+	}
+	if (r->hs)
+		_strided_copy(r->hs, r->len - r->lenp,
+			      SPLITBUFF(r->sbuf, r->slot, r->split_size), tlen, 1);
+	else if (r->hc)
+		_seg_copy(r->hc, SPLITBUFF(r->sbuf, r->slot, r->split_size), tlen, 1);
+	else
+		_udma_memcpy(up->copy_pool, (void *)r->hp,
+			     SPLITBUFF(r->sbuf, r->slot, r->split_size), tlen);
+	t1 = udma_now_ns();
+	up->stats.memcpy_ns += t1 - t;
+	*(volatile size_t *)(up->recv.len + r->slot) = 0;
+	__sync_fetch_and_add(&udma_work, 1);
+	if (up->trace) {
+		_udma_trace_rec(up, 0, UDMA_TR_COPY, 1, r->slot, tlen, t, t1 - t);
+		_udma_trace_rec(up, 0, UDMA_TR_ACK, 1, r->slot, tlen, udma_now_ns(), 0);
+	}
+	r->hp += tlen;
+	r->lenp -= tlen;
+	r->slot = (r->slot + 1) % r->split;
+}
+
+/*
+  Stage as many splits of a send request as there are free slots.
+*/
+static int _udma_send_step(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	uint64_t retval = 0;
+	int rc;
+
+	while (r->lenp > 0) {
+		// poll until len field is set to 0
+		if (*(up->send.len + r->slot) > 0) {
+			if (!r->t_slot)
+				r->t_slot = udma_now_ns();
+			// peek at request, did it bail out?
+			rc = _udma_req_peek(r, &retval);
+			if (rc == 0)
+				return 0;
+			_udma_comm_reset(&up->send);
+			_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : -EPIPE);
+			return 1;
+		}
+		_udma_stage_split(r);
+	}
+	rc = _udma_req_peek(r, &retval);
+	if (rc == 0)
+		return 0;
+	_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : 0);
+	return 1;
+}
+
+/*
+  Copy out as many received splits as have arrived.
+*/
+static int _udma_recv_step(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	uint64_t retval = 0;
+	size_t tlen;
+	int rc;
+
+	while (r->lenp > 0) {
+		if ((tlen = *(up->recv.len + r->slot)) == 0) {
+			if (!r->t_slot)
+				r->t_slot = udma_now_ns();
+			rc = _udma_req_peek(r, &retval);
+			if (rc == 0)
+				return 0;
+			_udma_comm_reset(&up->recv);
+			_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : -EPIPE);
+			return 1;
+		}
+		_udma_unstage_split(r, tlen);
+	}
+	rc = _udma_req_peek(r, &retval);
+	if (rc == 0)
+		return 0;
+	if (r->eager && rc > 0 && retval == r->len)
+		memcpy(r->hp, up->recv.eager, r->len);
+	_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : 0);
+	return 1;
+}
+
+/*
+  Move both directions of an exchange: stage send splits while their
+  slots are free and copy out the received splits which have arrived.
+  The VE side runs both directions at once, so neither may wait for the
+  other.
+*/
+static int _udma_exchange_step(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	struct veo_udma_req *p = r->pair;
+	uint64_t retval = 0;
+	size_t tlen;
+	int rc, moved, finished = 0;
+
+	for (;;) {
+		do {
+			moved = 0;
+			if (r->lenp > 0 && *(up->send.len + r->slot) == 0) {
+				_udma_stage_split(r);
+				moved = 1;
+			}
+			if (p->lenp > 0 && (tlen = *(up->recv.len + p->slot)) > 0) {
+				_udma_unstage_split(p, tlen);
+				moved = 1;
+			}
+		} while (moved);
+		if (finished)
+			break;
+		if (!r->t_slot && r->lenp > 0)
+			r->t_slot = udma_now_ns();
+		if (!p->t_slot && p->lenp > 0)
+			p->t_slot = udma_now_ns();
+		rc = _udma_req_peek(r, &retval);
+		if (rc == 0)
+			return 0;
+		if (rc < 0) {
+			retval = 0;
+			break;
+		}
+		/* the last received splits may have arrived before the return */
+		finished = 1;
+	}
+	if (rc < 0 || r->lenp > 0 || p->lenp > 0) {
+		_udma_comm_reset(&up->send);
+		_udma_comm_reset(&up->recv);
+		_udma_req_done(r, retval, rc < 0 ? rc : -EPIPE);
+		return 1;
+	}
+	_udma_req_done(r, retval, 0);
+	return 1;
+}
+
+/*
+  Stage the next splits of a broadcast while their slot is free on all
+  VEs. Each VE gets the length in its own mailbox and frees the slot
+  after its DMA, members which finished early (failed) are skipped.
+  Must be called with bc->lock held.
+*/
+static void _udma_bcast_stage(struct udma_bcast *bc)
+{
+	int i, live;
+	size_t tlen;
+	uint64_t t;
+	struct veo_udma_req *r;
+
+	while (bc->lenp > 0) {
+		for (i = 0, live = 0; i < bc->n; i++) {
+			r = &bc->reqs[i];
+			if (r->state == UDMA_REQ_DONE)
+				continue;
+			if (r->state != UDMA_REQ_ACTIVE || *(r->up->send.len + bc->slot) > 0)
+				return;
+			live++;
+		}
+		if (!live) {
+			bc->lenp = 0;
+			return;
+		}
+		tlen = MIN(bc->split_size, bc->lenp);
+		t = udma_now_ns();
+		_udma_memcpy(bc->reqs[0].up->copy_pool,
+			     SPLITBUFF(bc->addr, bc->slot, bc->split_size), bc->hp, tlen);
+		if (bc->reqs[0].up->trace)
+			_udma_trace_rec(bc->reqs[0].up, 0, UDMA_TR_COPY, 0, bc->slot, tlen, t,
+					udma_now_ns() - t);
+		for (i = 0; i < bc->n; i++) {
+			r = &bc->reqs[i];
+			if (r->state == UDMA_REQ_DONE)
+				continue;
+			*(volatile size_t *)(r->up->send.len + bc->slot) = tlen;
+			if (r->up->trace)
+				_udma_trace_rec(r->up, 0, UDMA_TR_ACK, 0, bc->slot, tlen,
+						udma_now_ns(), 0);
+		}
+		__sync_fetch_and_add(&udma_work, 1);
+		bc->hp += tlen;
+		bc->lenp -= tlen;
+		bc->slot = (bc->slot + 1) % bc->split;
+	}
+}
+
+/*
+  One VE of a broadcast: staging is shared by all members, the request
+  is done when its VE side returns. The member steps run under their
+  own peer's q_lock, bc->lock keeps staging and a failing member's
+  mailbox reset apart.
+*/
+static int _udma_bcast_step(struct veo_udma_req *r)
+{
+	struct udma_bcast *bc = r->bc;
+	uint64_t retval = 0;
+	int rc;
+
+	pthread_mutex_lock(&bc->lock);
+	_udma_bcast_stage(bc);
+	pthread_mutex_unlock(&bc->lock);
+	rc = _udma_req_peek(r, &retval);
+	if (rc == 0)
+		return 0;
+	pthread_mutex_lock(&bc->lock);
+	if (rc < 0 || retval != r->len) {
+		_udma_comm_reset(&r->up->send);
+		_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : -EPIPE);
+	} else
+		_udma_req_done(r, retval, 0);
+	pthread_mutex_unlock(&bc->lock);
+	return 1;
+}
+
+/*
+  The send pack stream is filled by the packing thread, only watch the
+  VE side: finishing before the stream was closed means it bailed out.
+  The VE side is called once the first split is handed over.
+*/
+static int _udma_send_pack_step(struct veo_udma_req *r)
+{
+	uint64_t retval = 0;
+	int rc;
+
+	if (r->req == VEO_REQUEST_ID_INVALID && !r->cmd) {
+		if (r->up->send_pack.hold)
+			return 0;
+		if ((rc = _udma_req_call(r, r->up->pp->ve_udma_recv_pack)) != 0) {
+			_udma_req_done(r, 0, rc);
+			return 1;
+		}
+	}
+	rc = _udma_req_peek(r, &retval);
+	if (rc == 0)
+		return 0;
+	if (rc > 0 && r->lenp == 0) {
+		_udma_req_done(r, retval, 0);
+		return 1;
+	}
+	_udma_comm_reset(&r->up->send);
+	_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : -EPIPE);
+	return 1;
+}
+
+/*
+  Plain VE function call queued behind the transfers of the peer.
+*/
+static int _udma_call_step(struct veo_udma_req *r)
+{
+	uint64_t retval = 0;
+	int rc;
+
+	rc = _udma_req_peek(r, &retval);
+	if (rc == 0)
+		return 0;
+	_udma_req_done(r, rc < 0 ? 0 : retval, rc < 0 ? rc : 0);
+	return 1;
+}
+
+/*
+  Make progress on the requests at the head of the queue of a peer.
+  Must be called with the peer's q_lock held.
+
+  Returns the number of completed requests.
+*/
+static int _udma_peer_progress(struct vh_udma_peer *up)
+{
+	int rc, n = 0;
+	struct veo_udma_req *r;
+
+	while ((r = up->q_head) != NULL) {
+		if (r->state == UDMA_REQ_QUEUED) {
+			rc = _udma_req_start(r);
+			if (rc == -EAGAIN)
+				break;
+			if (rc) {
+				_udma_req_done(r, 0, rc);
+				n++;
+				continue;
+			}
+		}
+		switch (r->op) {
+		case UDMA_OP_SEND:
+			rc = _udma_send_step(r);
+			break;
+		case UDMA_OP_SEND_PACKED:
+			rc = _udma_send_pack_step(r);
+			break;
+		case UDMA_OP_RECV:
+			rc = _udma_recv_step(r);
+			break;
+		case UDMA_OP_EXCHANGE:
+			rc = _udma_exchange_step(r);
+			break;
+		case UDMA_OP_BCAST:
+			rc = _udma_bcast_step(r);
+			break;
+		case UDMA_OP_CALL:
+			rc = _udma_call_step(r);
+			break;
+		default:
+			eprintf("udma_progress: unknown request op %d\n", r->op);
+			_udma_req_done(r, 0, -EINVAL);
+			rc = 1;
+			break;
+		}
+		if (!rc)
+			break;
+		n++;
+	}
+	return n;
+}
+
+/*
+  Make progress on all peers with pending requests. A peer whose q_lock
+  is taken is skipped, the holder makes progress on it. Must be called
+  without any q_lock held.
+
+  Returns the number of completed requests, *wpp (if not NULL) the peer
+  with the most eager wait policy among those with pending requests.
+*/
+static int udma_progress(struct vh_udma_peer **wpp)
+{
+	int n = 0;
+	struct vh_udma_peer *up, *wp = NULL;
+
+	pthread_rwlock_rdlock(&udma_active_lock);
+	for (up = udma_active; up; up = up->pnext) {
+		if (!up->q_head)
+			continue;
+		if (!wp || up->wait.policy < wp->wait.policy)
+			wp = up;
+		if (pthread_mutex_trylock(&up->q_lock) != 0)
+			continue;
+		n += _udma_peer_progress(up);
+		pthread_mutex_unlock(&up->q_lock);
+	}
+	pthread_rwlock_unlock(&udma_active_lock);
+	if (wpp)
+		*wpp = wp;
+	return n;
+}
+
+static void *udma_progress_thread(void *arg)
+{
+	struct udma_waiter w;
+
+	_udma_wait_init(&w, NULL);
+	pthread_mutex_lock(&udma_progress_lock);
+	for (;;) {
+		while (udma_num_async == 0 && !udma_progress_exit)
+			pthread_cond_wait(&udma_progress_cond, &udma_progress_lock);
+		if (udma_progress_exit)
+			break;
+		pthread_mutex_unlock(&udma_progress_lock);
+		/* back off like the most eager peer with pending requests */
+		udma_progress(&w.up);
+		_udma_wait_idle(&w);
+		pthread_mutex_lock(&udma_progress_lock);
+	}
+	pthread_mutex_unlock(&udma_progress_lock);
+	return NULL;
+}
+
+/*
+  Start the progress thread unless disabled by UDMA_PROGRESS_THREAD=0.
+  Must be called with udma_progress_lock held.
+*/
+static void udma_progress_thread_start(void)
+{
+	char *env;
+
+	if (udma_progress_state != 0)
+		return;
+	env = getenv("UDMA_PROGRESS_THREAD");
+	if (env && atoi(env) == 0) {
+		udma_progress_state = -1;
+		return;
+	}
+	udma_progress_exit = 0;
+	if (pthread_create(&udma_progress_thr, NULL, udma_progress_thread, NULL) != 0) {
+		eprintf("veo_udma: failed to start progress thread, "
+			"progress is only made in test/wait.\n");
+		udma_progress_state = -1;
+		return;
+	}
+	udma_progress_state = 1;
+}
+
+static void udma_progress_thread_stop(void)
+{
+	pthread_mutex_lock(&udma_progress_lock);
+	if (udma_progress_state != 1) {
+		pthread_mutex_unlock(&udma_progress_lock);
+		return;
+	}
+	udma_progress_exit = 1;
+	pthread_cond_signal(&udma_progress_cond);
+	pthread_mutex_unlock(&udma_progress_lock);
+	pthread_join(udma_progress_thr, NULL);
+	udma_progress_state = 0;
+}
+
+static int _udma_send_pack_close(struct vh_udma_peer *up);
+
+/*
+  Queue a request at its peer. Empty transfers complete immediately.
+  An open send pack stream occupies the VE context and the send splits,
+  it is closed first.
+*/
+static void _udma_req_submit(struct veo_udma_req *r)
+{
+	struct vh_udma_peer *up = r->up;
+	int rc;
+
+	if (r->len == 0) {
+		r->state = UDMA_REQ_DONE;
+		return;
+	}
+	if (r != &up->send_pack.req && up->send_pack.open) {
+		pthread_mutex_lock(&up->send_pack.lock);
+		rc = _udma_send_pack_close(up);
+		pthread_mutex_unlock(&up->send_pack.lock);
+		if (rc)
+			eprintf("veo_udma: closing send pack failed, rc=%d\n", rc);
+	}
+	/* counted before it is queued, it may complete right away */
+	if (r->async) {
+		pthread_mutex_lock(&udma_progress_lock);
+		udma_num_async++;
+		udma_progress_thread_start();
+		pthread_cond_signal(&udma_progress_cond);
+		pthread_mutex_unlock(&udma_progress_lock);
+	}
+	pthread_mutex_lock(&up->q_lock);
+	if (up->q_tail)
+		up->q_tail->next = r;
+	else
+		up->q_head = r;
+	up->q_tail = r;
+	pthread_mutex_unlock(&up->q_lock);
+}
+
+/*
+  Drive progress until the request has completed.
+*/
+static void _udma_req_wait(struct veo_udma_req *r)
+{
+	struct udma_waiter w;
+
+	_udma_wait_init(&w, r->up);
+	while (r->state != UDMA_REQ_DONE) {
+		udma_progress(NULL);
+		if (r->state == UDMA_REQ_DONE)
+			break;
+		_udma_wait_idle(&w);
+	}
+	__sync_synchronize();
+}
+
+/*
+  Send pack stream: the first packed entry claims the send splits, the
+  VE side unpacking function is started when the first split is handed
+  over, at the first full split or at the commit. A pack fitting into
+  one split so leaves the context free until the commit. Entries are
+  packed directly into the current split in shm, full splits are handed
+  to the VE while packing continues in the next one. The last split
+  carries UDMA_LEN_LAST. All functions must be called with
+  up->send_pack.lock held.
+*/
+static int _udma_send_pack_open(struct vh_udma_peer *up)
+{
+	struct udma_send_pack *sp = &up->send_pack;
+	struct veo_udma_req *r = &sp->req;
+	struct udma_waiter w;
+
+	_udma_req_init(r, UDMA_OP_SEND_PACKED, up, NULL, 0, 1);
+	sp->fill = 0;
+	sp->len = 0;
+	sp->open = 1;
+	sp->hold = 1;
+	_udma_req_submit(r);
+
+	/* wait for preceeding requests to release the send splits */
+	_udma_wait_init(&w, up);
+	while (r->state == UDMA_REQ_QUEUED) {
+		udma_progress(NULL);
+		_udma_wait_idle(&w);
+	}
+	__sync_synchronize();
+	if (r->state == UDMA_REQ_DONE) {
+		sp->open = 0;
+		return r->err ? r->err : -EPIPE;
+	}
+	return 0;
+}
+
+/*
+  Hand the current split to the VE and wait until the next one is free.
+  With last set the stream is closed, the VE finishes after this split.
+*/
+static int _udma_send_pack_flush(struct vh_udma_peer *up, int last)
+{
+	struct udma_send_pack *sp = &up->send_pack;
+	struct veo_udma_req *r = &sp->req;
+	struct udma_waiter w;
+
+	if (r->state == UDMA_REQ_DONE) {
+		sp->open = 0;
+		return r->err ? r->err : -EPIPE;
+	}
+	if (last) {
+		r->lenp = 0;
+		__sync_synchronize();
+	}
+	*(volatile size_t *)(up->send.len + r->slot) = sp->fill | (last ? UDMA_LEN_LAST : 0);
+	sp->hold = 0;
+	pthread_mutex_lock(&up->q_lock);
+	up->stats.pack_fill += sp->fill;
+	up->stats.pack_space += r->split_size;
+	pthread_mutex_unlock(&up->q_lock);
+	sp->len += sp->fill;
+	sp->fill = 0;
+	r->slot = (r->slot + 1) % r->split;
+	if (last)
+		return 0;
+	_udma_wait_init(&w, up);
+	while (*(up->send.len + r->slot) > 0) {
+		if (r->state == UDMA_REQ_DONE) {
+			sp->open = 0;
+			return r->err ? r->err : -EPIPE;
+		}
+		udma_progress(NULL);
+		_udma_wait_idle(&w);
+	}
+	return 0;
+}
+
+/*
+  Close the stream and wait for the VE to unpack it.
+
+  Returns 0 if all packed bytes arrived, the number of missing bytes
+  or a negative error otherwise.
+*/
+static int _udma_send_pack_close(struct vh_udma_peer *up)
+{
+	struct udma_send_pack *sp = &up->send_pack;
+	struct veo_udma_req *r = &sp->req;
+	int rc;
+
+	if (!sp->open)
+		return 0;
+	pthread_mutex_lock(&up->q_lock);
+	up->stats.pack_commits++;
+	pthread_mutex_unlock(&up->q_lock);
+	rc = _udma_send_pack_flush(up, 1);
+	sp->open = 0;
+	if (rc)
+		return rc;
+	_udma_req_wait(r);
+	if (r->err)
+		return r->err;
+	return (int)(sp->len - r->result);
+}
+
+/*
+  Call a VE function of the peer, ordered with its transfers.
+  The arguments are consumed.
+
+  Returns 0 and the function's return value in *retval, or a negative error.
+*/
+static int _udma_ve_call(struct vh_udma_peer *up, uint64_t addr, struct veo_args *argp,
+			 uint64_t *retval)
+{
+	struct veo_udma_req r;
+
+	_udma_req_init(&r, UDMA_OP_CALL, up, NULL, addr, 1);
+	r.argp = argp;
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	*retval = r.result;
+	return r.err;
+}
+
+/*
+  Read the usrcc of the VE of a peer, the shortest of a few round trips
+  is taken. *t is the VH time in the middle of it, *rtt its length.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+static int _udma_usrcc_read(struct vh_udma_peer *up, uint64_t *t, uint64_t *cc,
+			    uint64_t *rtt)
+{
+	struct veo_args *argp;
+	uint64_t t0, t1, c;
+	int i, rc;
+
+	*rtt = UINT64_MAX;
+	for (i = 0; i < 4; i++) {
+		if ((argp = veo_args_alloc()) == NULL)
+			return -ENOMEM;
+		t0 = udma_now_ns();
+		if ((rc = _udma_ve_call(up, up->pp->ve_udma_usrcc, argp, &c)) != 0)
+			return rc;
+		t1 = udma_now_ns();
+		if (t1 - t0 < *rtt) {
+			*rtt = t1 - t0;
+			*t = t0 + *rtt / 2;
+			*cc = c;
+		}
+	}
+	return 0;
+}
+
+/*
+  Fit the usrcc frequency of the VE of a peer from two reads
+  UDMA_USRCC_FIT_NS apart, it differs between VE models. *t and *cc
+  return the second read.
+
+  Returns 0 if successful, negative number in case of failure.
+*/
+#define UDMA_USRCC_FIT_NS 20000000L
+
+static int _udma_usrcc_fit(struct vh_udma_peer *up, uint64_t *t, uint64_t *cc, double *mhz)
+{
+	struct timespec ts = {0, UDMA_USRCC_FIT_NS};
+	uint64_t t0, cc0, rtt;
+	int rc;
+
+	if ((rc = _udma_usrcc_read(up, &t0, &cc0, &rtt)) != 0)
+		return rc;
+	nanosleep(&ts, NULL);
+	if ((rc = _udma_usrcc_read(up, t, cc, &rtt)) != 0)
+		return rc;
+	if (*t <= t0 || *cc <= cc0)
+		return -EIO;
+	*mhz = (double)(*cc - cc0) * 1e3 / (double)(*t - t0);
+	dprintf("veo_udma: VE%d usrcc runs with %.1f MHz, rtt %lu ns\n", up->pp->ve_node_id,
+		*mhz, rtt);
+	return 0;
+}
+
+/*
+  Cache the usrcc frequency of a proc's VE, the first of its peers to
+  need it pays for the measurement.
+*/
+static void _udma_usrcc_set(struct vh_udma_peer *up, double mhz)
+{
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	if (up->pp->usrcc_mhz == 0.0)
+		up->pp->usrcc_mhz = mhz;
+	pthread_rwlock_unlock(&udma_reg_lock);
+}
+
+/*
+  Returns the usrcc frequency of the VE of a peer in MHz, measured on
+  first use.
+*/
+static double _udma_usrcc_rate(struct vh_udma_peer *up)
+{
+	uint64_t t, cc;
+	double mhz;
+
+	pthread_rwlock_rdlock(&udma_reg_lock);
+	mhz = up->pp->usrcc_mhz;
+	pthread_rwlock_unlock(&udma_reg_lock);
+	if (mhz > 0.0)
+		return mhz;
+	if (_udma_usrcc_fit(up, &t, &cc, &mhz)) {
+		eprintf("veo_udma: measuring the VE usrcc rate failed, assuming %d MHz\n",
+			UDMA_USRCC_MHZ);
+		mhz = UDMA_USRCC_MHZ;
+	}
+	_udma_usrcc_set(up, mhz);
+	return mhz;
+}
+
+/*
+  Map VE usrcc of a traced peer to the VH clock. Rate and a pair of
+  matching times come from two round trips some time apart, so VE
+  events don't drift against VH ones whatever the VE clock.
+*/
+static void _udma_trace_sync(struct vh_udma_peer *up)
+{
+	if (_udma_usrcc_fit(up, &up->trace_t0, &up->trace_cc0, &up->trace_mhz)) {
+		eprintf("veo_udma: reading VE usrcc failed, VE trace times are off\n");
+		up->trace_mhz = UDMA_USRCC_MHZ;
+		return;
+	}
+	_udma_usrcc_set(up, up->trace_mhz);
+	dprintf("veo_udma: peer %d usrcc %lu at %lu ns, %.3f MHz\n", up->id,
+		up->trace_cc0, up->trace_t0, up->trace_mhz);
+}
+
+/*
+  Sent buffer from VH to VE, function exposed to users.
+*/
+size_t veo_udma_send(struct veo_thr_ctxt *ctx, void *src, uint64_t dst, size_t len)
+{
+	struct veo_udma_req r;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_send ctx not found!\n");
+		return 0;
+	}
+	_udma_req_init(&r, UDMA_OP_SEND, up, src, dst, len);
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	return r.result;
+}
+
+/*
+  Recv buffer from VE to VH
+*/
+size_t veo_udma_recv(struct veo_thr_ctxt *ctx, uint64_t src, void *dst, size_t len)
+{
+	struct veo_udma_req r;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_recv ctx not found!\n");
+		return 0;
+	}
+	_udma_req_init(&r, UDMA_OP_RECV, up, dst, src, len);
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	return r.result;
+}
+
+/*
+  Send send_len bytes from send_src to send_dst on the VE and receive
+  recv_len bytes from recv_src on the VE into recv_dst at the same time.
+  Both directions use their own half of the peer's staging buffers and
+  their DMAs overlap on the VE.
+
+  Returns the total number of bytes moved, send_len + recv_len if
+  successful.
+*/
+size_t veo_udma_exchange(struct veo_thr_ctxt *ctx, void *send_src, uint64_t send_dst,
+			 size_t send_len, uint64_t recv_src, void *recv_dst, size_t recv_len)
+{
+	struct veo_udma_req r, p;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_exchange ctx not found!\n");
+		return 0;
+	}
+	if (send_len == 0)
+		return veo_udma_recv(ctx, recv_src, recv_dst, recv_len);
+	if (recv_len == 0)
+		return veo_udma_send(ctx, send_src, send_dst, send_len);
+	/* the send part carries the request, no eager path and no adaption */
+	_udma_req_init(&r, UDMA_OP_SEND, up, send_src, send_dst, send_len);
+	_udma_req_init(&p, UDMA_OP_RECV, up, recv_dst, recv_src, recv_len);
+	r.op = UDMA_OP_EXCHANGE;
+	r.adapt = NULL;
+	p.adapt = NULL;
+	r.pair = &p;
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	return r.result;
+}
+
+/*
+  Fill a strided layout, dense if strides is NULL, and its number of
+  bytes in *len. An empty layout is valid, its strides don't matter.
+
+  Returns 0 if successful, -EINVAL if dimensions overlap.
+*/
+static int _udma_strided_init(struct udma_strided *s, uint64_t base, const size_t *strides,
+			      size_t elem, int ndims, const size_t *counts, size_t *len)
+{
+	int d;
+	size_t ext = elem;	// bytes spanned by the dimensions below d
+
+	if (ndims < 1 || ndims > UDMA_MAX_DIMS)
+		return -EINVAL;
+	s->base = base;
+	s->elem = elem;
+	s->ndims = ndims;
+	*len = elem;
+	for (d = 0; d < ndims; d++) {
+		s->count[d] = counts[d];
+		s->stride[d] = strides ? strides[d] : *len;
+		*len *= counts[d];
+	}
+	if (*len == 0)
+		return 0;
+	for (d = 0; d < ndims; d++) {
+		if (s->count[d] > 1 && s->stride[d] < ext)
+			return -EINVAL;
+		ext += s->stride[d] * (s->count[d] - 1);
+	}
+	return 0;
+}
+
+static int _udma_strided_dense(struct udma_strided *s)
+{
+	int d;
+	size_t len = s->elem;
+
+	for (d = 0; d < s->ndims; d++) {
+		if (s->stride[d] != len)
+			return 0;
+		len *= s->count[d];
+	}
+	return 1;
+}
+
+/*
+  Strided transfer: the VH side gathers (scatters) during the staging
+  copy, the VE side scatters (gathers) while copying from (into) the
+  mirror buffer. Dense sides are handled like plain transfers.
+*/
+static size_t _veo_udma_strided(struct veo_thr_ctxt *ctx, int op, char *hp,
+				const size_t *hstrides, uint64_t vp, const size_t *vstrides,
+				size_t elem, int ndims, const size_t *counts)
+{
+	struct veo_udma_req r;
+	struct udma_strided hs, vs;
+	size_t len, vlen;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_strided ctx not found!\n");
+		return 0;
+	}
+	if (_udma_strided_init(&hs, (uint64_t)hp, hstrides, elem, ndims, counts, &len)
+	    || _udma_strided_init(&vs, vp, vstrides, elem, ndims, counts, &vlen)) {
+		eprintf("veo_udma_strided: invalid layout, elem=%lu ndims=%d\n", elem, ndims);
+		return 0;
+	}
+	if (len == 0)
+		return 0;
+	_udma_req_init(&r, op, up, hp, vp, len);
+	if (!_udma_strided_dense(&hs))
+		r.hs = &hs;
+	if (!_udma_strided_dense(&vs))
+		r.vs = &vs;
+	if (r.hs || r.vs) {
+		r.zc = 0;
+		r.lenp = len;
+		r.adapt = NULL;
+	}
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	return r.result;
+}
+
+/*
+  Send a strided sub-array (ndims <= 3) from VH to VE. Elements of elem
+  bytes, counts[d] of them in dimension d, dimension 0 is the innermost.
+  Strides are in bytes per dimension, NULL means densely packed. A
+  stride must not be smaller than the extent of the dimensions below it.
+  An empty sub-array transfers nothing.
+
+  Returns the number of transfered bytes.
+*/
+size_t veo_udma_send_strided(struct veo_thr_ctxt *ctx, void *src, const size_t *src_strides,
+			     uint64_t dst, const size_t *dst_strides,
+			     size_t elem, int ndims, const size_t *counts)
+{
+	return _veo_udma_strided(ctx, UDMA_OP_SEND, (char *)src, src_strides, dst,
+				 dst_strides, elem, ndims, counts);
+}
+
+/*
+  Receive a strided sub-array from VE to VH, see veo_udma_send_strided().
+*/
+size_t veo_udma_recv_strided(struct veo_thr_ctxt *ctx, uint64_t src, const size_t *src_strides,
+			     void *dst, const size_t *dst_strides,
+			     size_t elem, int ndims, const size_t *counts)
+{
+	return _veo_udma_strided(ctx, UDMA_OP_RECV, (char *)dst, dst_strides, src,
+				 src_strides, elem, ndims, counts);
+}
+
+/*
+  Vectored transfer of up to max_segs segments in one VE call. The
+  segments are streamed back to back through the split pipeline, the
+  staging copies on VH and the mirror buffer copies on VE walk the
+  segment lists.
+*/
+static size_t _veo_udma_vec(struct vh_udma_peer *up, int op, struct udma_seg *hseg,
+			    struct udma_seg *vseg, int nseg, size_t len)
+{
+	struct veo_udma_req r;
+	struct udma_seg_cursor hc = {hseg, nseg, 0, 0};
+
+	_udma_req_init(&r, op, up, NULL, 0, len);
+	r.hc = &hc;
+	r.vseg = vseg;
+	r.nvseg = nseg;
+	r.adapt = NULL;
+	_udma_req_submit(&r);
+	_udma_req_wait(&r);
+	return r.result;
+}
+
+static size_t _veo_udma_iov(struct veo_thr_ctxt *ctx, int op, const struct veo_udma_iov *iov,
+			    int iovcnt)
+{
+	int i, k, n, nmax;
+	size_t res = 0, len, tlen;
+	struct udma_seg *seg;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_%s ctx not found!\n", op == UDMA_OP_SEND ? "sendv" : "recvv");
+		return 0;
+	}
+	if (iovcnt <= 0)
+		return 0;
+	nmax = MIN(iovcnt, up->max_segs);
+	seg = (struct udma_seg *)malloc(2 * nmax * sizeof(struct udma_seg));
+	if (!seg) {
+		eprintf("veo_udma_iov: malloc failed.\n");
+		return 0;
+	}
+	for (i = 0; i < iovcnt; i += n) {
+		n = MIN(iovcnt - i, nmax);
+		for (len = 0, k = 0; k < n; k++) {
+			seg[k].addr = (uint64_t)iov[i + k].hp;
+			seg[k].len = iov[i + k].len;
+			seg[nmax + k].addr = iov[i + k].vp;
+			seg[nmax + k].len = iov[i + k].len;
+			len += iov[i + k].len;
+		}
+		tlen = _veo_udma_vec(up, op, seg, seg + nmax, n, len);
+		res += tlen;
+		if (tlen != len)
+			break;
+	}
+	free(seg);
+	return res;
+}
+
+/*
+  Send iovcnt buffers (VH buffer, VE buffer, length) from VH to VE.
+
+  Returns the number of transfered bytes.
+*/
+size_t veo_udma_sendv(struct veo_thr_ctxt *ctx, const struct veo_udma_iov *iov, int iovcnt)
+{
+	return _veo_udma_iov(ctx, UDMA_OP_SEND, iov, iovcnt);
+}
+
+/*
+  Receive iovcnt buffers (VH buffer, VE buffer, length) from VE to VH.
+*/
+size_t veo_udma_recvv(struct veo_thr_ctxt *ctx, const struct veo_udma_iov *iov, int iovcnt)
+{
+	return _veo_udma_iov(ctx, UDMA_OP_RECV, iov, iovcnt);
+}
+
+/*
+  Asynchronous send and recv. The returned request handle must be
+  completed with veo_udma_test(), veo_udma_wait() or veo_udma_waitall().
+
+  Returns NULL if the request could not be created.
+*/
+struct veo_udma_req *veo_udma_send_async(struct veo_thr_ctxt *ctx, void *src,
+					 uint64_t dst, size_t len)
+{
+	struct veo_udma_req *r;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_send_async ctx not found!\n");
+		return NULL;
+	}
+	r = (struct veo_udma_req *)malloc(sizeof(struct veo_udma_req));
+	if (!r) {
+		eprintf("veo_udma_send_async: malloc failed.\n");
+		return NULL;
+	}
+	_udma_req_init(r, UDMA_OP_SEND, up, src, dst, len);
+	r->async = 1;
+	_udma_req_submit(r);
+	return r;
+}
+
+struct veo_udma_req *veo_udma_recv_async(struct veo_thr_ctxt *ctx, uint64_t src,
+					 void *dst, size_t len)
+{
+	struct veo_udma_req *r;
+	struct vh_udma_peer *up = _udma_ctx_peer(ctx);
+
+	if (!up) {
+		eprintf("veo_udma_recv_async ctx not found!\n");
+		return NULL;
+	}
+	r = (struct veo_udma_req *)malloc(sizeof(struct veo_udma_req));
+	if (!r) {
+		eprintf("veo_udma_recv_async: malloc failed.\n");
+		return NULL;
+	}
+	_udma_req_init(r, UDMA_OP_RECV, up, dst, src, len);
+	r->async = 1;
+	_udma_req_submit(r);
+	return r;
+}
+
+/*
+  Check whether an async request has completed, make some progress if
+  nobody else does. Never blocks.
+
+  Returns 1 if completed (the request is freed and the number of
+  transfered bytes stored in *len), 0 if still in flight.
+*/
+int veo_udma_test(struct veo_udma_req *req, size_t *len)
+{
+	if (req->state != UDMA_REQ_DONE)
+		udma_progress(NULL);
+	if (req->state != UDMA_REQ_DONE)
+		return 0;
+	__sync_synchronize();
+	if (len)
+		*len = req->result;
+	free(req);
+	return 1;
+}
+
+/*
+  Wait for an async request to complete and free it.
+
+  Returns the number of transfered bytes.
+*/
+size_t veo_udma_wait(struct veo_udma_req *req)
+{
+	size_t res;
+
+	_udma_req_wait(req);
+	res = req->result;
+	free(req);
+	return res;
+}
+
+/*
+  Wait for n async requests and free them. The transfered lengths are
+  stored in lens[], if lens is not NULL.
+
+  Returns 0 if all requests succeeded, -EIO if any of them failed.
+*/
+int veo_udma_waitall(int n, struct veo_udma_req **reqs, size_t *lens)
+{
+	int i, rc = 0;
+
+	for (i = 0; i < n; i++) {
+		_udma_req_wait(reqs[i]);
+		if (reqs[i]->err || reqs[i]->result != reqs[i]->len)
+			rc = -EIO;
+		if (lens)
+			lens[i] = reqs[i]->result;
+		free(reqs[i]);
+		reqs[i] = NULL;
+	}
+	return rc;
+}
+
+/*
+  Striped transfers: one buffer is split into stripes, each transfered
+  by another peer, usually thread contexts on different cores of the
+  same VE, so their DMA engines work in parallel. Stripe sizes are
+  proportional to the throughput measured for each peer, equal until
+  all peers have an estimate.
+*/
+static size_t _veo_udma_striped(int op, int npeers, const int *peers,
+				char *hp, uint64_t vp, size_t len)
+{
+	int i, n = 0;
+	double w, wsum = 0.0;
+	size_t offs = 0, slen, res = 0;
+	struct vh_udma_peer *up;
+	struct veo_udma_req *reqs;
+
+	if (npeers <= 0 || len == 0)
+		return 0;
+	reqs = (struct veo_udma_req *)malloc(npeers * sizeof(struct veo_udma_req));
+	if (!reqs) {
+		eprintf("veo_udma_striped: malloc failed.\n");
+		return 0;
+	}
+	for (i = 0; i < npeers; i++) {
+		if ((up = _udma_peer(peers[i])) == NULL) {
+			eprintf("veo_udma_striped: illegal peer id: %d\n", peers[i]);
+			free(reqs);
+			return 0;
+		}
+		w = op == UDMA_OP_SEND ? up->bw_send : up->bw_recv;
+		if (w <= 0.0) {
+			wsum = 0.0;
+			break;
+		}
+		wsum += w;
+	}
+	for (i = 0; i < npeers && offs < len; i++) {
+		up = _udma_peer(peers[i]);
+		if (i == npeers - 1)
+			slen = len - offs;
+		else if (wsum > 0.0) {
+			w = op == UDMA_OP_SEND ? up->bw_send : up->bw_recv;
+			slen = ALIGN64B((size_t)((double)len * w / wsum));
+		} else
+			slen = ALIGN64B(len / npeers);
+		slen = MIN(slen, len - offs);
+		_udma_req_init(&reqs[n], op, up, hp + offs, vp + offs, slen);
+		_udma_req_submit(&reqs[n]);
+		offs += slen;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		_udma_req_wait(&reqs[i]);
+		res += reqs[i].result;
+	}
+	free(reqs);
+	return res;
 }
-	
-static int ve_udma_setup(struct vh_udma_peer *up)
-{
-	uint64_t req;
-	int64_t res;
-	int err;
 
-	// call VE side init function
-	struct veo_args *argp = veo_args_alloc();
-	veo_args_set_stack(argp, VEO_INTENT_IN, 0, (char *)up, sizeof(struct vh_udma_peer));
-	req = veo_call_async(up->ctx, udma_procs[up->proc_id]->ve_udma_init, argp);
-	err = veo_call_wait_result(up->ctx, req, (uint64_t *)&res);
-	if (err)
-		eprintf("veo-udma setup on VE has failed.\n"
-			"ve_udma_setup veo_call_wait_result err=%d\n", err);
-	veo_args_free(argp);
-	return err != 0 ? err : (int)res;
-}
+/*
+  Send a buffer from VH to VE, striped across npeers peers.
 
-static int ve_udma_close(struct vh_udma_peer *up)
+  Returns the number of transfered bytes.
+*/
+size_t veo_udma_send_striped(int npeers, const int *peers, void *src, uint64_t dst, size_t len)
 {
-	uint64_t req;
-	int64_t res;
-	int err;
+	return _veo_udma_striped(UDMA_OP_SEND, npeers, peers, (char *)src, dst, len);
+}
 
-	// call VE side init function
-	struct veo_args *argp = veo_args_alloc();
-	req = veo_call_async(up->ctx, udma_procs[up->proc_id]->ve_udma_fini, argp);
-	err = veo_call_wait_result(up->ctx, req, (uint64_t *)&res);
-	if (err)
-		eprintf("veo-udma finish failed on VE side.\n"
-			"veo_call_wait_result err=%d\n", err);
-	veo_args_free(argp);
-	return err != 0 ? err : (int)res;
+/*
+  Receive a buffer from VE to VH, striped across npeers peers.
+
+  Returns the number of transfered bytes.
+*/
+size_t veo_udma_recv_striped(int npeers, const int *peers, uint64_t src, void *dst, size_t len)
+{
+	return _veo_udma_striped(UDMA_OP_RECV, npeers, peers, (char *)dst, src, len);
 }
 
 /*
-  VH side UDMA communication init.
-  NOTE: Only one thread context is supported per proc due to a limitation
-  in the linking of the static veorun.
-  
-  Returns: peer_id (can be 0) or a negative number, in case of an error.
+  Gather: the slices of lens[i] bytes at srcs[i] on the VE of peers[i]
+  are received back to back into dst. All receives are queued at once,
+  the progress engine copies the splits of each peer to their place as
+  they arrive, so the slices of different VEs are in flight together.
+
+  Returns the number of gathered bytes, the sum of lens if successful.
 */
-int veo_udma_peer_init(int ve_node_id, struct veo_proc_handle *proc,
-		       struct veo_thr_ctxt *ctx, uint64_t lib_handle)
+size_t veo_udma_gather(int npeers, const int *peers, const uint64_t *srcs,
+		       const size_t *lens, void *dst)
 {
-	int rc, i, peer_id;
-	char *env, *mb_offs = NULL;
+	int i;
+	size_t offs = 0, res = 0;
 	struct vh_udma_peer *up;
-	int proc_id = -1;
+	struct veo_udma_req *reqs;
 
-	/* do you have a peer for this proc already? */
-	for (i = 0; i < udma_num_procs; i++) {
-		if (udma_procs[i]->proc == proc) {
-			proc_id = i;
-			break;
-		}
+	if (npeers <= 0)
+		return 0;
+	reqs = (struct veo_udma_req *)malloc(npeers * sizeof(struct veo_udma_req));
+	if (!reqs) {
+		eprintf("veo_udma_gather: malloc failed.\n");
+		return 0;
 	}
-	if (proc_id < 0) {
-		proc_id = udma_num_procs++;
-		struct vh_udma_proc *pp = \
-			(struct vh_udma_proc *)malloc(sizeof(struct vh_udma_proc));
-		if (!pp) {
-			eprintf("veo_udma_peer_init malloc failed.\n");
-			return -ENOMEM;
+	for (i = 0; i < npeers; i++)
+		if (_udma_peer(peers[i]) == NULL) {
+			eprintf("veo_udma_gather: illegal peer id: %d\n", peers[i]);
+			free(reqs);
+			return 0;
 		}
-		vh_udma_proc_setup(pp, ve_node_id, proc, lib_handle);
-		udma_procs[proc_id] = pp;
+	for (i = 0; i < npeers; i++) {
+		up = _udma_peer(peers[i]);
+		_udma_req_init(&reqs[i], UDMA_OP_RECV, up, (char *)dst + offs, srcs[i], lens[i]);
+		_udma_req_submit(&reqs[i]);
+		offs += lens[i];
 	}
-	udma_procs[proc_id]->count++;
-
-	up = (struct vh_udma_peer *)malloc(sizeof(struct vh_udma_peer));
-	if (!up) {
-		eprintf("veo_udma_peer_init: malloc peer struct failed.\n");
-		return -ENOMEM;
+	for (i = 0; i < npeers; i++) {
+		_udma_req_wait(&reqs[i]);
+		if (reqs[i].err)
+			eprintf("veo_udma_gather: peer %d failed, err=%d\n", peers[i],
+				reqs[i].err);
+		res += reqs[i].result;
 	}
-	peer_id = udma_num_peers++;
-	udma_peers[peer_id] = up;
+	free(reqs);
+	return res;
+}
 
-	up->proc_id = proc_id;
-	up->ctx = ctx;
-	
-	/* TODO: make key VE and core specific to avoid duplicate use of UDMA */
-	up->shm_key = getpid() * UDMA_MAX_PEERS + udma_num_peers;
-	up->shm_size = 2 * UDMA_BUFF_LEN;
-        /*
-         * Allocate shared memory segment
-         */
-	up->shm_segid = vh_shm_init(up->shm_key, up->shm_size, &up->shm_addr);
-	if (up->shm_segid == -1) {
-		rc = vh_shm_fini(up->shm_segid, up->shm_addr);
-		return rc ? rc : -ENOMEM;
+/*
+  Broadcast: one buffer is sent to peers on several VEs. It is copied
+  once into the broadcast segment, which every VE proc attaches at its
+  first broadcast, and pulled from there by the DMA engines of all VEs
+  at the same time. Broadcasts are serialized by udma_bcast_lock, which
+  also protects the segment and the attach state of the procs.
+*/
+static pthread_mutex_t udma_bcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct udma_bcast udma_bcast = {.segid = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int _udma_bcast_seg_create(struct udma_bcast *bc)
+{
+	size_t size = UDMA_BCAST_LEN;
+	char *env;
+
+	env = getenv("UDMA_BCAST_LEN");
+	if (env && atol(env) > 0)
+		size = (size_t)atol(env);
+	if (size < UDMA_BUFF_MIN)
+		size = UDMA_BUFF_MIN;
+	size = ALIGN_UP(size, UDMA_HUGE_PAGE);
+	bc->key = getpid() * UDMA_MAX_PEERS + UDMA_MAX_PEERS / 2;
+	/* VEs on any NUMA node read it */
+	bc->segid = vh_shm_init(&bc->key, size, &bc->addr, -1);
+	if (bc->segid < 0)
+		return bc->segid;
+	bc->size = size;
+	bc->nattach = 0;
+	dprintf("veo_udma: broadcast segment of %lu bytes\n", size);
+	return 0;
+}
+
+/*
+  Attach the broadcast segment on the VE proc of a peer.
+  Must be called with udma_bcast_lock held.
+*/
+static int _udma_bcast_attach(struct vh_udma_peer *up)
+{
+	int rc;
+	uint64_t retval, out[2];
+	struct veo_args *argp;
+	struct udma_bcast *bc = &udma_bcast;
+
+	if (up->pp->bcast_vehva)
+		return 0;
+	if (bc->segid < 0 && (rc = _udma_bcast_seg_create(bc)) != 0)
+		return rc;
+	argp = veo_args_alloc();
+	veo_args_set_i32(argp, 0, bc->key);
+	veo_args_set_u64(argp, 1, (uint64_t)bc->size);
+	veo_args_set_stack(argp, VEO_INTENT_OUT, 2, (char *)out, sizeof(out));
+	rc = _udma_ve_call(up, up->pp->ve_udma_shm_attach, argp, &retval);
+	if (rc || (int)retval != 0) {
+		eprintf("veo_udma_bcast: attaching segment on VE%d failed, "
+			"rc=%d retval=%d\n", up->pp->ve_node_id, rc, (int)retval);
+		return rc ? rc : -EIO;
 	}
+	up->pp->bcast_vehva = out[0];
+	up->pp->bcast_ve_addr = out[1];
+	bc->nattach++;
+	return 0;
+}
 
-	up->send.shm = up->shm_addr;
-	mb_offs = (char *)up->send.shm + UDMA_BUFF_LEN \
-		- (UDMA_MAX_SPLIT * sizeof(size_t) + 2 * sizeof(uint64_t));
-	up->send.buff_len = mb_offs - (char *)up->send.shm;
-	up->send.len = (size_t *)mb_offs;
-
-	up->recv.shm = (void *)((char *)up->shm_addr + UDMA_BUFF_LEN);
-	mb_offs = (char *)up->recv.shm + UDMA_BUFF_LEN \
-		- (UDMA_MAX_SPLIT * sizeof(size_t) + 2 * sizeof(uint64_t));
-	up->recv.buff_len = mb_offs - (char *)up->recv.shm;
-	up->recv.len = (size_t *)mb_offs;
-
-	/* send pack buffer */
-	if ((up->send_pack.buff = malloc(up->send.buff_len)) == NULL) {
-		eprintf("veo_udma_peer_init: malloc send pack buff failed.\n");
-		rc = vh_shm_fini(up->shm_segid, up->shm_addr);
-		return rc ? rc : -ENOMEM;
-	}
-	up->send_pack.buff_len = up->send.buff_len;
-	up->send_pack.len = 0;
-	up->recv_pack.buff_len = up->send.buff_len;
-	up->recv_pack.data_len = 0;
-	up->recv_pack.num_entries = 0;
+/*
+  Detach the broadcast segment from the VE proc of a peer if it is the
+  proc's last peer. The last proc releases the segment.
+*/
+static void _udma_bcast_detach(struct vh_udma_peer *up)
+{
+	int last;
+	uint64_t retval;
+	struct veo_args *argp;
+	struct udma_bcast *bc = &udma_bcast;
 
-        pthread_mutex_init(&up->lock, NULL);
-	up->max_pack_send = UDMA_PACK_MAX_SEND;
-	env = getenv("UDMA_MAX_PACK_SEND");
-	if (env) {
-		size_t v = (size_t)atol(env);
-		if (v < 0 || v > UDMA_BUFF_LEN * 2 / 3) {
-			eprintf("Wrong value for UDMA_MAX_PACK_SEND: %ul, "
-				"using default value %ul\n", UDMA_PACK_MAX_SEND);
-		} else
-			up->max_pack_send = v;
+	pthread_mutex_lock(&udma_bcast_lock);
+	pthread_rwlock_rdlock(&udma_reg_lock);
+	last = up->pp->count == 1;
+	pthread_rwlock_unlock(&udma_reg_lock);
+	if (!last || !up->pp->bcast_vehva) {
+		pthread_mutex_unlock(&udma_bcast_lock);
+		return;
 	}
-	up->max_pack_recv = UDMA_PACK_MAX_RECV;
-	env = getenv("UDMA_MAX_PACK_RECV");
-	if (env) {
-		size_t v = (size_t)atol(env);
-		if (v < 0 || v > UDMA_BUFF_LEN * 2 / 3) {
-			eprintf("Wrong value for UDMA_MAX_PACK_RECV: %ul, "
-				"using default value %ul\n", UDMA_PACK_MAX_RECV);
-		} else
-			up->max_pack_recv = v;
+	argp = veo_args_alloc();
+	veo_args_set_u64(argp, 0, up->pp->bcast_ve_addr);
+	if (_udma_ve_call(up, up->pp->ve_udma_shm_detach, argp, &retval) || (int)retval != 0)
+		eprintf("veo_udma: detaching the broadcast segment on VE failed\n");
+	up->pp->bcast_vehva = 0;
+	up->pp->bcast_ve_addr = 0;
+	if (--bc->nattach == 0) {
+		vh_shm_fini(bc->segid, bc->addr);
+		vh_shm_destroy(bc->segid);
+		bc->segid = -1;
 	}
-	rc = ve_udma_setup(up);
-	vh_shm_destroy(up->shm_segid);
-	return rc ? rc : peer_id;
+	pthread_mutex_unlock(&udma_bcast_lock);
 }
 
-int veo_udma_peer_fini(int peer_id)
+/*
+  Send len bytes from src to dsts[i] on the VE of peers[i], for all
+  npeers peers. The peers must have different contexts, usually they
+  are on different VEs.
+
+  Returns len if all peers received the whole buffer, 0 otherwise.
+*/
+size_t veo_udma_bcast(int npeers, const int *peers, void *src, const uint64_t *dsts, size_t len)
 {
-	int rc;
+	int i, j, n, rc = 0;
+	size_t space, res = len;
+	struct vh_udma_peer *up;
+	struct veo_udma_req *reqs;
+	struct udma_bcast *bc = &udma_bcast;
 
-	struct vh_udma_peer *up = udma_peers[peer_id];
-	rc = ve_udma_close(up);
-	if (rc) {
-		eprintf("ve_udma_close failed for peer %d, rc=%d\n", peer_id, rc);
-		return rc;
+	if (npeers <= 0 || len == 0)
+		return 0;
+	reqs = (struct veo_udma_req *)calloc(npeers, sizeof(struct veo_udma_req));
+	if (!reqs) {
+		eprintf("veo_udma_bcast: malloc failed.\n");
+		return 0;
 	}
-	rc = vh_shm_fini(up->shm_segid, up->shm_addr);
-	if (rc) {
-		eprintf("vh_shm_fini failed for peer %d, rc=%d\n", peer_id, rc);
-		return rc;
+	pthread_mutex_lock(&udma_bcast_lock);
+	for (i = 0; i < npeers; i++) {
+		if ((up = _udma_peer(peers[i])) == NULL) {
+			eprintf("veo_udma_bcast: illegal peer id: %d\n", peers[i]);
+			goto err;
+		}
+		for (j = 0; j < i; j++)
+			if (reqs[j].up->ctx == up->ctx) {
+				eprintf("veo_udma_bcast: peer %d is used twice\n", peers[i]);
+				goto err;
+			}
+		if ((rc = _udma_bcast_attach(up)) != 0)
+			goto err;
+		_udma_req_init(&reqs[i], UDMA_OP_BCAST, up, src, dsts[i], len);
+	}
+
+	/* all VEs use the same splits, fitting into every peer */
+	space = bc->size;
+	for (i = 0; i < npeers; i++) {
+		up = reqs[i].up;
+		for (j = 0, n = 0; j < npeers; j++)
+			if (up->pool && reqs[j].up->pool == up->pool)
+				n++;
+		/* peers sharing a pool need their splits at the same time */
+		if (n > 1)
+			space = MIN(space, (up->split_space / n) & ~((size_t)UDMA_POOL_CHUNK - 1));
+		else
+			space = MIN(space, up->split_space);
 	}
-	udma_procs[up->proc_id]->count--;
-	if (udma_procs[up->proc_id]->count == 0) {
-		free(udma_procs[up->proc_id]);
-		udma_procs[up->proc_id] = NULL;
+	bc->split = calc_split_send(reqs[0].up->pp->tune, len, &bc->split_size);
+	reqs[0].split = bc->split;
+	reqs[0].split_size = bc->split_size;
+	_udma_split_fit(&reqs[0], space);
+	bc->split = reqs[0].split;
+	bc->split_size = reqs[0].split_size;
+	bc->reqs = reqs;
+	bc->n = npeers;
+	bc->hp = (char *)src;
+	bc->len = len;
+	bc->lenp = len;
+	bc->slot = 0;
+	for (i = 0; i < npeers; i++) {
+		reqs[i].split = bc->split;
+		reqs[i].split_size = bc->split_size;
+		reqs[i].zc = reqs[i].up->pp->bcast_vehva;
+		reqs[i].bc = bc;
+		_udma_req_submit(&reqs[i]);
 	}
-	free(up->send_pack.buff);
-	free(up);
-	udma_peers[peer_id] = NULL;
+	for (i = 0; i < npeers; i++) {
+		_udma_req_wait(&reqs[i]);
+		if (reqs[i].err || reqs[i].result != len) {
+			eprintf("veo_udma_bcast: peer %d failed, err=%d, %lu of %lu bytes\n",
+				peers[i], reqs[i].err, reqs[i].result, len);
+			res = 0;
+		}
+	}
+	bc->reqs = NULL;
+	bc->n = 0;
+	pthread_mutex_unlock(&udma_bcast_lock);
+	free(reqs);
+	return res;
+err:
+	pthread_mutex_unlock(&udma_bcast_lock);
+	free(reqs);
 	return 0;
 }
 
 /*
-  Tune splitting of buffers and overlap of transfers and memcopy.
-  The values in the tables are measured.
+  Calibration of the split tables. For each transfer size class all
+  sensible combinations of split count and split size are timed, the
+  fastest one goes into the table. Pool peers may shrink the splits,
+  *split and *size return what the transfers really used.
 */
-struct tune_split {
-	size_t transfer;
-	size_t size;
-	int split;
-};
-static int num_tune_send = 5;
-static struct tune_split tune_send[] = \
-{
-	{  524288,  524288,  1},
-	{ 1048576,  524288,  2},
-	{16777216, 1048576,  4},
-	{33554432, 2097152,  4},
-	{67108864, 4194304,  8}
-	
-};
-static int num_tune_recv = 6;
-static struct tune_split tune_recv[] = \
-{
-	{   4194304,  262144,  8},
-	{   8388608,  262144, 16},
-	{  16777216, 1048576,  4},
-	{  33554432, 1048576,  2},
-	{  67108864,   65536, 32},
-	{ 134217728,   65536, 16}
-};
-
-static int calc_split_send(size_t len, size_t *split_size)
+static double _udma_calib_bw(struct vh_udma_peer *up, int op, char *hp, uint64_t vp,
+			     size_t len, int *split, size_t *size)
 {
-	int i, itune = 0, split = 0;
-	size_t size = 0;
-	char *env = getenv("UDMA_SPLIT_SEND");
-	if (env)
-		split = atoi(env);
-	env = getenv("UDMA_SPLIT_SIZE_SEND");
-	if (env)
-		size = atol(env);
-	if (split && split_size)
-		if (split * size > (UDMA_BUFF_LEN - UDMA_MAX_SPLIT * 8)) {
-			eprintf("ERROR: split * split_size > %u\n",
-				(UDMA_BUFF_LEN - UDMA_MAX_SPLIT * 8));
-		} else {
-			*split_size = size;
-			return split;
-		}
-
-	for (i = 0; i < num_tune_send - 1; i++) {
-		if (len >= tune_send[i].transfer)
-			itune = i + 1;
-		else
-			break;
+	int i, reps;
+	uint64_t t0;
+	struct veo_udma_req r;
+
+	reps = (int)(UDMA_CALIB_MAX_LEN / 2 / len);
+	reps = reps < 2 ? 2 : (reps > 16 ? 16 : reps);
+	t0 = udma_now_ns();
+	for (i = 0; i < reps; i++) {
+		_udma_req_init(&r, op, up, hp, vp, len);
+		r.adapt = NULL;
+		r.split = *split;
+		r.split_size = *size;
+		_udma_req_submit(&r);
+		_udma_req_wait(&r);
+		if (r.err || r.result != len)
+			return 0.0;
 	}
-	*split_size = tune_send[itune].size;
-	return tune_send[itune].split;
+	*split = r.split;
+	*size = r.split_size;
+	return (double)len * reps / (double)(udma_now_ns() - t0);
 }
 
-static int calc_split_recv(size_t len, size_t *split_size)
+static void _udma_calib_dir(struct vh_udma_peer *up, int op, char *hp, uint64_t vp,
+			    size_t max_len, struct tune_split *tune, int *num_tune)
 {
-	int i, itune = 0, split = 0;
-	size_t size = 0;
-	char *env = getenv("UDMA_SPLIT_RECV");
-	if (env)
-		split = atoi(env);
-	env = getenv("UDMA_SPLIT_SIZE_RECV");
-	if (env)
-		size = atol(env);
-	if (split && split_size)
-		if (split * size > (UDMA_BUFF_LEN - UDMA_MAX_SPLIT * 8)) {
-			eprintf("ERROR: split * split_size > %u\n",
-				(UDMA_BUFF_LEN - UDMA_MAX_SPLIT * 8));
-		} else {
-			*split_size = size;
-			return split;
+	static const int splits[] = {1, 2, 4, 8, 16, 32};
+	int i, n = 0, split;
+	size_t len, size, ssize;
+	double bw, best;
+
+	for (len = UDMA_CALIB_MIN_LEN; len <= max_len && n < UDMA_MAX_TUNE; len *= 2, n++) {
+		best = 0.0;
+		tune[n].transfer = 2 * len;	// used up to the next size class
+		tune[n].split = 1;
+		tune[n].size = MIN(len, up->split_space);
+		for (i = 0; i < (int)(sizeof(splits) / sizeof(int)); i++) {
+			for (size = UDMA_CALIB_MIN_SPLIT; size <= up->split_space; size *= 2) {
+				if (splits[i] * size > up->split_space)
+					break;
+				/* more or larger split buffers than data */
+				if ((splits[i] - 1) * size >= len || size >= 2 * len)
+					break;
+				split = splits[i];
+				ssize = size;
+				bw = _udma_calib_bw(up, op, hp, vp, len, &split, &ssize);
+				dprintf("calib %s len=%lu split=%d size=%lu bw=%.0f MB/s\n",
+					op == UDMA_OP_SEND ? "send" : "recv", len,
+					split, ssize, bw * 1e3);
+				if (bw > best) {
+					best = bw;
+					tune[n].split = split;
+					tune[n].size = ssize;
+				}
+			}
 		}
-	
-	for (i = 0; i < num_tune_recv - 1; i++) {
-		if (len >= tune_recv[i].transfer)
-			itune = i + 1;
-		else
-			break;
 	}
-	*split_size = tune_recv[itune].size;
-	return tune_recv[itune].split;
+	*num_tune = n;
 }
 
-#define SPLITBUFF(base, idx, size) (void *)((char *)base + idx * size)
-
 /*
-  Sent buffer from VH to VE internal routine with pack option.
+  Measure the split tables for the VE and host of a peer with transfers
+  of up to max_len bytes, install them for all peers of its proc and,
+  if save is set, store them in the cache file.
+
+  Returns 0 if successful, negative number in case of failure.
 */
-static size_t
-_veo_udma_send(struct veo_thr_ctxt *ctx, void *src, uint64_t dst, size_t len, int pack)
+int veo_udma_calibrate(int peer, size_t max_len, int save)
 {
-	size_t tlen, lenp, split_size;
-	uint64_t req, retval = 0, dstp = dst;
-	int i, rc, split, err = 0;
-	char *srcp;
-	void *mp;
-	struct vh_udma_peer *up = NULL;
+	char *hp;
+	uint64_t vp;
+	struct udma_tune *t;
+	struct vh_udma_peer *up;
 
-	for (i = 0; i < udma_num_peers; i++) {
-		if (udma_peers[i]->ctx == ctx) {
-			up = udma_peers[i];
-			break;
-		}
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_calibrate: illegal peer id: %d\n", peer);
+		return -EINVAL;
 	}
-	if (!up) {
-		eprintf("veo_udma_recv ctx not found!\n");
-		return 0;
+	if (max_len < UDMA_CALIB_MIN_LEN)
+		max_len = UDMA_CALIB_MIN_LEN;
+	t = (struct udma_tune *)calloc(1, sizeof(struct udma_tune));
+	hp = (char *)malloc(max_len);
+	if (!t || !hp) {
+		free(t);
+		free(hp);
+		return -ENOMEM;
 	}
-	if (pthread_mutex_trylock(&up->lock) != 0) {
-		eprintf("veo_udma_send found mutex locked!?\n");
-		return 0;
+	memset(hp, 1, max_len);
+	if (veo_alloc_mem(up->pp->proc, &vp, max_len) != 0) {
+		eprintf("veo_udma_calibrate: veo_alloc_mem failed\n");
+		free(t);
+		free(hp);
+		return -ENOMEM;
 	}
-	if (pack) {
-		len = up->send_pack.len;
-		src = up->send_pack.buff;
-		split = 1;
-		split_size = len;
-	} else
-		split = calc_split_send(len, &split_size);
+	_udma_calib_dir(up, UDMA_OP_SEND, hp, vp, max_len, t->send, &t->num_send);
+	_udma_calib_dir(up, UDMA_OP_RECV, hp, vp, max_len, t->recv, &t->num_recv);
+	veo_free_mem(up->pp->proc, vp);
+	free(hp);
 
-	if (len == 0)
-		goto out;
+	/* requests in flight may still look at the old tables */
+	t->source = UDMA_TUNE_CALIBRATED;
+	pthread_rwlock_wrlock(&udma_reg_lock);
+	t->prev = up->pp->tune;
+	up->pp->tune = t;
+	pthread_rwlock_unlock(&udma_reg_lock);
+	if (save)
+		return _udma_tune_save(up->pp->ve_node_id, t);
+	return 0;
+}
 
-	srcp = (char *)src;
-	lenp = len;
-	struct veo_args *argp = veo_args_alloc();
-	veo_args_set_u64(argp, 0, (uint64_t)dst);
-	veo_args_set_u64(argp, 1, (uint64_t)len);
-	veo_args_set_i32(argp, 2, split);
-	veo_args_set_u64(argp, 3, (uint64_t)split_size);
-	veo_args_set_i32(argp, 4, pack);
-	req = veo_call_async(ctx, udma_procs[up->proc_id]->ve_udma_recv, argp);
-	i = 0;
-	while (lenp > 0) {
-		tlen = MIN(split_size, lenp);
-		mp = memcpy(SPLITBUFF(up->send.shm, i, split_size), (void *)srcp, tlen);
-		*(volatile size_t *)(up->send.len + i) = tlen;
-		dstp += tlen;
-		srcp += tlen;
-		lenp -= tlen;
-		i = (i + 1) % split;
-		// poll until len field is set to 0
-		while (*(volatile size_t *)(up->send.len + i) > 0) {
-			// peek at request, did it bail out?
-			rc = veo_call_peek_result(ctx, req, &retval);
-			if (rc != VEO_COMMAND_UNFINISHED &&	\
-			    (size_t)retval != len) {
-				err = 1;
-				break;
-			}
-		}
-		if (err)
-			break;
+/*
+  Host pool: buffers allocated inside shm segments which are attached
+  on the VE, too. Transfers from and to these buffers skip the VH side
+  staging memcpy, the VE DMAs directly from or into them.
+
+  Each block is preceeded by a header of UDMA_HOST_ALIGN bytes, free
+  blocks are kept in an address ordered list per segment.
+*/
+#define UDMA_HOST_ALIGN 256
+#define UDMA_HOST_SEG_LEN (64 * 1024 * 1024)
+/*
+  Returns the VEHVA of a host buffer lying entirely inside the host pool
+  of the peer, 0 if it doesn't.
+*/
+static uint64_t _udma_host_vehva(struct vh_udma_peer *up, void *p, size_t len)
+{
+	struct udma_host_seg *seg;
+
+	for (seg = up->host_segs; seg; seg = seg->next)
+		if ((char *)p >= (char *)seg->addr &&
+		    (char *)p + len <= (char *)seg->addr + seg->size)
+			return seg->vehva + ((char *)p - (char *)seg->addr);
+	return 0;
+}
+
+static struct udma_host_seg *_udma_host_seg_create(struct vh_udma_peer *up, size_t size)
+{
+	int rc;
+	uint64_t retval, out[2];
+	struct veo_args *argp;
+	struct udma_host_seg *seg;
+
+	seg = (struct udma_host_seg *)malloc(sizeof(struct udma_host_seg));
+	if (!seg) {
+		eprintf("veo_udma_alloc_host: malloc failed.\n");
+		return NULL;
 	}
-	if (!err) {
-		rc = veo_call_wait_result(ctx, req, &retval);
+	seg->size = ALIGN_UP(size, UDMA_HUGE_PAGE);
+	seg->key = up->shm_key + 1;
+	seg->segid = vh_shm_init(&seg->key, seg->size, &seg->addr, up->numa_node);
+	if (seg->segid < 0) {
+		free(seg);
+		return NULL;
 	}
-	veo_args_free(argp);
-	if (pack) {
-		up->send_pack.len = 0;
-		retval = len - retval;
+	argp = veo_args_alloc();
+	veo_args_set_i32(argp, 0, seg->key);
+	veo_args_set_u64(argp, 1, (uint64_t)seg->size);
+	veo_args_set_stack(argp, VEO_INTENT_OUT, 2, (char *)out, sizeof(out));
+	rc = _udma_ve_call(up, up->pp->ve_udma_shm_attach, argp, &retval);
+	vh_shm_destroy(seg->segid);
+	if (rc || (int)retval != 0) {
+		eprintf("veo_udma_alloc_host: attaching segment on VE failed, "
+			"rc=%d retval=%d\n", rc, (int)retval);
+		vh_shm_fini(seg->segid, seg->addr);
+		free(seg);
+		return NULL;
 	}
-out:
-	pthread_mutex_unlock(&up->lock);
-	return (size_t)retval;
+	seg->vehva = out[0];
+	seg->ve_addr = out[1];
+	seg->free = (struct udma_host_blk *)seg->addr;
+	seg->free->size = seg->size;
+	seg->free->next = NULL;
+	seg->next = up->host_segs;
+	up->host_segs = seg;
+	return seg;
+}
+
+static void *_udma_host_seg_alloc(struct udma_host_seg *seg, size_t need)
+{
+	struct udma_host_blk *b, **bp, *rest;
+
+	for (bp = &seg->free; (b = *bp) != NULL; bp = &b->next) {
+		if (b->size < need)
+			continue;
+		if (b->size - need >= 2 * UDMA_HOST_ALIGN) {
+			rest = (struct udma_host_blk *)((char *)b + need);
+			rest->size = b->size - need;
+			rest->next = b->next;
+			*bp = rest;
+			b->size = need;
+		} else
+			*bp = b->next;
+		b->next = NULL;
+		return (void *)((char *)b + UDMA_HOST_ALIGN);
+	}
+	return NULL;
 }
 
 /*
-  Sent buffer from VH to VE, function exposed to users.
+  Allocate a host buffer of size bytes inside the UDMA shared memory of a peer.
+  Transfers from or to such a buffer (with the same peer) are zero-copy on VH.
+
+  Returns NULL if the allocation failed.
 */
-size_t veo_udma_send(struct veo_thr_ctxt *ctx, void *src, uint64_t dst, size_t len)
+void *veo_udma_alloc_host(int peer, size_t size)
 {
-	return _veo_udma_send(ctx, src, dst, len, 0);
+	void *p = NULL;
+	size_t need;
+	struct udma_host_seg *seg;
+	struct vh_udma_peer *up;
+
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_alloc_host: illegal peer id: %d\n", peer);
+		return NULL;
+	}
+	need = ALIGN_UP(size, UDMA_HOST_ALIGN) + UDMA_HOST_ALIGN;
+	pthread_mutex_lock(&up->lock);
+	for (seg = up->host_segs; seg; seg = seg->next)
+		if ((p = _udma_host_seg_alloc(seg, need)) != NULL)
+			goto out;
+	seg = _udma_host_seg_create(up, need > UDMA_HOST_SEG_LEN ? need : UDMA_HOST_SEG_LEN);
+	if (seg)
+		p = _udma_host_seg_alloc(seg, need);
+out:
+	pthread_mutex_unlock(&up->lock);
+	return p;
 }
 
 /*
-  Recv buffer from VE to VH
+  Return a buffer allocated by veo_udma_alloc_host() to the host pool.
+
+  Returns 0 if successful, -EINVAL if the buffer is not from the peer's pool.
 */
-size_t veo_udma_recv(struct veo_thr_ctxt *ctx, uint64_t src, void *dst, size_t len)
+int veo_udma_free_host(int peer, void *ptr)
 {
-	size_t tlen, lenp = len, split_size;
-	uint64_t req, retval = 0;
-	int i, j, rc, split, err = 0;
-	char *dstp = (char *)dst;
-	void *mp;
-	struct vh_udma_peer *up = NULL;
+	struct udma_host_seg *seg;
+	struct udma_host_blk *b, *f, **bp;
+	struct vh_udma_peer *up;
 
-	for (i = 0; i < udma_num_peers; i++)
-		if (udma_peers[i]->ctx == ctx) {
-			up = udma_peers[i];
+	if ((up = _udma_peer(peer)) == NULL) {
+		eprintf("veo_udma_free_host: illegal peer id: %d\n", peer);
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&up->lock);
+	for (seg = up->host_segs; seg; seg = seg->next)
+		if ((char *)ptr > (char *)seg->addr &&
+		    (char *)ptr < (char *)seg->addr + seg->size)
 			break;
-		}
-	if (!up) {
-		eprintf("veo_udma_recv ctx not found!\n");
-		return 0;
+	if (!seg) {
+		pthread_mutex_unlock(&up->lock);
+		eprintf("veo_udma_free_host: %p is not in the host pool\n", ptr);
+		return -EINVAL;
 	}
-	if (pthread_mutex_trylock(&up->lock) != 0) {
-		eprintf("veo_udma_recv found mutex locked!?\n");
-		return 0;
+	b = (struct udma_host_blk *)((char *)ptr - UDMA_HOST_ALIGN);
+	for (bp = &seg->free; (f = *bp) != NULL && f < b; bp = &f->next)
+		;
+	/* merge with following free block */
+	if (f && (char *)b + b->size == (char *)f) {
+		b->size += f->size;
+		b->next = f->next;
+	} else
+		b->next = f;
+	/* merge with preceeding free block */
+	if (bp != &seg->free) {
+		f = (struct udma_host_blk *)((char *)bp - offsetof(struct udma_host_blk, next));
+		if ((char *)f + f->size == (char *)b) {
+			f->size += b->size;
+			f->next = b->next;
+			goto out;
+		}
 	}
+	*bp = b;
+out:
+	pthread_mutex_unlock(&up->lock);
+	return 0;
+}
 
-	split = calc_split_recv(len, &split_size);
+/*
+  Detach and release all host pool segments of a peer.
+*/
+static void _udma_host_pool_fini(struct vh_udma_peer *up)
+{
+	uint64_t retval;
+	struct veo_args *argp;
+	struct udma_host_seg *seg;
 
-	struct veo_args *argp = veo_args_alloc();
-	veo_args_set_u64(argp, 0, (uint64_t)src);
-	veo_args_set_u64(argp, 1, (uint64_t)len);
-	veo_args_set_i32(argp, 2, split);
-	veo_args_set_u64(argp, 3, (uint64_t)split_size);
-	req = veo_call_async(ctx, udma_procs[up->proc_id]->ve_udma_send, argp);
-	j = 0;
-	while (lenp > 0) {
-		while ((tlen = *(up->recv.len +j)) == 0) {
-			rc = veo_call_peek_result(ctx, req, &retval);
-			if (rc != VEO_COMMAND_UNFINISHED &&	\
-			    (size_t)retval != len) {
-				err = 1;
-				break;
-			}
-		}
-		if (err)
-			break;
-		memcpy((void *)dstp, SPLITBUFF(up->recv.shm, j, split_size), tlen);
-		*(volatile size_t *)(up->recv.len + j) = 0;
-		dstp += tlen;
-		lenp -= tlen;
-		j = (j + 1) % split;
-	}
-	if (!err) {
-		rc = veo_call_wait_result(ctx, req, &retval);
+	while ((seg = up->host_segs) != NULL) {
+		up->host_segs = seg->next;
+		argp = veo_args_alloc();
+		veo_args_set_u64(argp, 0, seg->ve_addr);
+		if (_udma_ve_call(up, up->pp->ve_udma_shm_detach, argp, &retval)
+		    || (int)retval != 0)
+			eprintf("veo_udma: detaching host pool segment on VE failed\n");
+		vh_shm_fini(seg->segid, seg->addr);
+		free(seg);
 	}
-	veo_args_free(argp);
-	pthread_mutex_unlock(&up->lock);
-	return (size_t)retval;
 }
 
 /*
-  Recv several (packed) buffers from VE to VH in one transfer.
+  Recv several (packed) buffers from VE to VH in one transfer. The
+  entries go through the vectored recv pipeline: while the VE packs and
+  DMAs later entries, the VH already unpacks the splits that arrived.
 */
 static int _veo_udma_recv_packed(int peer)
 {
-	uint64_t req, retval = 0;
-	int i, rc = 0, err = 0;
-	size_t elen;
-	char *pb;
+	int rc = 0;
+	size_t len;
 	struct vh_udma_peer *up;
 
-	if (peer < 0 || peer >= udma_num_peers) {
+	if ((up = _udma_peer(peer)) == NULL) {
 		eprintf("veo_udma_recv_packed: illegal peer id: %d\n", peer);
 		return -EINVAL;
 	}
-	up = udma_peers[peer];
-	if (!up) {
-		eprintf("veo_udma_recv ctx not found!\n");
-		return 0;
-	}
-	if (pthread_mutex_trylock(&up->lock) != 0) {
-		eprintf("veo_udma_recv_packed found mutex locked!?\n");
-		return 0;
-	}
+	pthread_mutex_lock(&up->lock);
 	if (up->recv_pack.num_entries == 0)
 		goto out;
 
-	struct veo_args *argp = veo_args_alloc();
-	veo_args_set_stack(argp, VEO_INTENT_IN, 0, (char *)&up->recv_pack.entries,
-			   sizeof(struct udma_recv_entry) * up->recv_pack.num_entries);
-	veo_args_set_i32(argp, 1, up->recv_pack.num_entries);
-	req = veo_call_async(up->ctx, udma_procs[up->proc_id]->ve_udma_send_packed, argp);
-	/* TODO: check if req is valid */
-	rc = veo_call_wait_result(up->ctx, req, &retval);
-	veo_args_free(argp);
-	if (rc) {
-		if (rc == VEO_COMMAND_EXCEPTION)
-			eprintf("recv_packed failed with exception on VE. %p\n", (void *)retval);
-		else if (rc = VEO_COMMAND_ERROR)
-			eprintf("recv_packed failed with error on VH.\n");
-		goto out;
-	}
-	if ((int)retval != 0) {
-		rc = (int)retval;
-		goto out;
-	}
-
-	/* unpack buffer */
-	pb = (char *)up->recv.shm;
-	for (i = 0; i < up->recv_pack.num_entries; i++) {
-		elen = up->recv_pack.entries[i].len;
-		memcpy(up->recv_pack.entries[i].dst, pb, elen);
-		pb += ALIGN8B(elen);
+	pthread_mutex_lock(&up->q_lock);
+	up->stats.pack_commits++;
+	pthread_mutex_unlock(&up->q_lock);
+	len = _veo_udma_vec(up, UDMA_OP_RECV, up->recv_pack.hseg, up->recv_pack.vseg,
+			    up->recv_pack.num_entries, up->recv_pack.data_len);
+	if (len != up->recv_pack.data_len) {
+		eprintf("veo_udma_recv_packed: received %lu of %lu bytes\n",
+			len, up->recv_pack.data_len);
+		rc = -EIO;
 	}
 out:
 	up->recv_pack.num_entries = 0;
@@ -560,11 +4362,14 @@ out:
 }
 
 /*
-  Pack (small) buffer for sending from VH to VE.
+  Pack (small) buffer for sending from VH to VE. The buffer is copied
+  into the send splits in shm right away, full splits are unpacked by
+  the VE while packing goes on. Buffers too large for a split are sent
+  directly, after the packed ones.
 
   Return 0 if successful, negative number in case of failure:
   -EINVAL for invalid peer id,
-  -EPIPE if direct buffer send failed,
+  -EPIPE if direct buffer send failed or the VE side bailed out,
   ...
 */
 int veo_udma_send_pack(int peer, void *src, uint64_t dst, size_t len)
@@ -572,56 +4377,60 @@ int veo_udma_send_pack(int peer, void *src, uint64_t dst, size_t len)
 	int rc = 0;
 	size_t tlen;
 	struct vh_udma_peer *up;
+	struct udma_send_pack *sp;
 
-	if (peer < 0 || peer >= udma_num_peers) {
+	if ((up = _udma_peer(peer)) == NULL) {
 		eprintf("veo_udma_send_pack: illegal peer id: %d\n", peer);
 		return -EINVAL;
 	}
-	up = udma_peers[peer];
+	sp = &up->send_pack;
 
-	pthread_mutex_lock(&up->lock);
+	pthread_mutex_lock(&sp->lock);
+	if (len < up->max_pack_send && !sp->open && (rc = _udma_send_pack_open(up)) != 0) {
+		eprintf("veo_udma_send_pack: opening pack stream failed, rc=%d\n", rc);
+		goto done;
+	}
 	/* buffer large enough to be sent directly? */
-	if (len >= up->max_pack_send) {
-		pthread_mutex_unlock(&up->lock);
-		tlen = _veo_udma_send(up->ctx, src, dst, len, 0);
+	if (len >= up->max_pack_send
+	    || 2 * sizeof(uint64_t) + ALIGN8B(len) > sp->req.split_size) {
+		pthread_mutex_unlock(&sp->lock);
+		tlen = veo_udma_send(up->ctx, src, dst, len);
 		if (tlen != len) {
 			eprintf("veo_udma_pack: direct send failed, %lu of %lu\n", tlen, len);
 			rc = -EPIPE;
 		}
-		goto done_nolock;
+		return rc;
 	}
 
-	/* current request too large?
-	   send what we have in pack buffer and pack current req. */
-	if (_buffer_send_pack(&up->send_pack, src, dst, len) < 0) {
-		/* send */
-		pthread_mutex_unlock(&up->lock);
-		if ((rc = veo_udma_send_pack_commit(peer)) != 0) {
-			eprintf("veo_udma_send_pack: commit failed, rc=%d\n", rc);
-			goto done_nolock;
+	/* current split full? hand it to the VE and pack into the next one */
+	if (_buffer_send_pack(SPLITBUFF(sp->req.sbuf, sp->req.slot, sp->req.split_size),
+			      sp->req.split_size, &sp->fill, src, dst, len) < 0) {
+		if ((rc = _udma_send_pack_flush(up, 0)) != 0) {
+			eprintf("veo_udma_send_pack: flush failed, rc=%d\n", rc);
+			goto done;
 		}
-		pthread_mutex_lock(&up->lock);
-		rc = _buffer_send_pack(&up->send_pack, src, dst, len);
+		rc = _buffer_send_pack(SPLITBUFF(sp->req.sbuf, sp->req.slot, sp->req.split_size),
+				       sp->req.split_size, &sp->fill, src, dst, len);
 	}
 done:
-	pthread_mutex_unlock(&up->lock);
-done_nolock:
+	pthread_mutex_unlock(&sp->lock);
 	return rc;
 }
 
 int veo_udma_send_pack_commit(int peer)
 {
-	size_t res;
+	int rc;
 	struct vh_udma_peer *up;
 
-	if (peer < 0 || peer >= udma_num_peers) {
+	if ((up = _udma_peer(peer)) == NULL) {
 		eprintf("veo_udma_pack: illegal peer id: %d\n", peer);
 		return -EINVAL;
 	}
-	up = udma_peers[peer];
 
-	/* src and len are set in _send() while the mutex is held */
-	return _veo_udma_send(up->ctx, NULL, 0, 0, 1);
+	pthread_mutex_lock(&up->send_pack.lock);
+	rc = _udma_send_pack_close(up);
+	pthread_mutex_unlock(&up->send_pack.lock);
+	return rc;
 }
 
 /*
@@ -638,11 +4447,10 @@ int veo_udma_recv_pack(int peer, uint64_t src, void *dst, size_t len)
 	size_t tlen;
 	struct vh_udma_peer *up;
 
-	if (peer < 0 || peer >= udma_num_peers) {
+	if ((up = _udma_peer(peer)) == NULL) {
 		eprintf("veo_udma_recv_pack: illegal peer id: %d\n", peer);
 		return -EINVAL;
 	}
-	up = udma_peers[peer];
 
 	pthread_mutex_lock(&up->lock);
 	/* buffer large enough to be sent directly? */
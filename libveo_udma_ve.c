@@ -13,6 +13,8 @@
 #include <unistd.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <stddef.h>
 
 #include <vhshm.h>
 #include <vedma.h>
@@ -20,23 +22,21 @@
 #include "ve_inst.h"
 #include "veo_udma.h"
 
-int shm_key, shm_segid;
-uint64_t shm_vehva = 0;		// VEHVA of remote shared memory segment
-size_t shm_size = 0;		// remote shared memory segment size
-void *shm_remote_addr = NULL;	// remote address
-
-/*
-  The following variables are thread local because each Context Thread can be a peer!
-*/
-//__thread int this_peer = -1;			// local peer ID
-struct ve_udma_peer *udma_peer;	// this peer's UDMA comm struct
-//__thread struct ve_udma_peer *udma_peer;	// this peer's UDMA comm struct
-
-
+#ifdef __ve__
 static inline long getusrcc()
 {
 	asm("smir %s0, %usrcc");
 }
+#else
+/* emulated usrcc, ticking with 1400MHz */
+static inline long getusrcc()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec * 1000000000L + t.tv_nsec) * 14 / 10;
+}
+#endif
 
 /* following functions imply that the VE runs with 1400MHz,
    for their purpose the exact frequency doesn't actually matter */
@@ -52,347 +52,832 @@ static inline void busy_sleep_us(long us)
 }
 
 /*
-  Initialize VH-SHM segment, map it as VEHVA.
+  Initialize a VH-SHM segment, map it as VEHVA and allocate its DMA
+  mirror buffer.
 */
-static int vhshm_register(int key, size_t size)
+static int _ve_udma_seg_init(struct ve_udma_seg *sg, int key, size_t size)
 {
-	struct shmid_ds ds;
-	uint64_t remote_vehva = 0;
-	void *remote_addr = NULL;
-	int err = 0;
-
-	//TODO: unregister and release old segment if reinitializing a new one
-	shm_key = key;
-	shm_size = size;
-	dprintf("VE: (shm_key = %d, size = %d)\n", shm_key, shm_size);
+	sg->shm_key = key;
+	sg->shm_size = size;
+	dprintf("VE: (shm_key = %d, size = %d)\n", key, size);
 
 	//
 	// determine shm segment ID from its key
 	//
-	shm_segid = vh_shmget(shm_key, shm_size, SHM_HUGETLB);
-	if (shm_segid == -1) {
+	sg->shm_segid = vh_shmget(key, size, SHM_HUGETLB);
+	if (sg->shm_segid == -1) {
 		eprintf("VE: vh_shmget key=%d failed, reason: %s\n", key, strerror(errno));
 		return -EINVAL;
 	}
-	dprintf("VE: shm_segid = %d\n", shm_segid);
+	dprintf("VE: shm_segid = %d\n", sg->shm_segid);
 
 	//
 	// attach shared memory VH address space and register it to DMAATB,
 	// the region is accessible for DMA unter its VEHVA remote_vehva
 	//
-        shm_remote_addr = vh_shmat(shm_segid, NULL, 0, (void **)&shm_vehva);
-	if (shm_remote_addr == NULL) {
+	sg->shm_remote_addr = vh_shmat(sg->shm_segid, NULL, 0,
+				       (void **)&sg->shm_vehva);
+	if (sg->shm_remote_addr == NULL) {
 		eprintf("VE: (remote_addr == NULL)\n");
 		return -ENOMEM;
 	}
-	if (shm_vehva == (uint64_t)-1) {
-		eprintf("VE: failed to attach to shm segment %d, shm_vehva=-1\n", shm_segid);
+	if (sg->shm_vehva == (uint64_t)-1) {
+		eprintf("VE: failed to attach to shm segment %d, shm_vehva=-1\n",
+			sg->shm_segid);
+		sg->shm_remote_addr = NULL;
 		return -ENOMEM;
 	}
+
+	char *buff_base = NULL;
+	size_t align_64mb = 64 * 1024 * 1024;
+	size_t buff_size = (size + align_64mb - 1) & ~(align_64mb - 1);
+
+	posix_memalign((void **)&buff_base, align_64mb, buff_size);
+	if (buff_base == NULL) {
+		eprintf("VE: allocating udma buffer failed! buffsize=%lu\n", buff_size);
+		goto err_shm;
+	}
+	dprintf("ve allocated buff at %p\n", buff_base);
+	sg->buff_vehva = ve_register_mem_to_dmaatb(buff_base, buff_size);
+	if (sg->buff_vehva == (uint64_t)-1) {
+		eprintf("VE: mapping udma buffer failed! buffsize=%lu\n", buff_size);
+		free(buff_base);
+		goto err_shm;
+	}
+	dprintf("ve_register_mem_to_dmaatb succeeded for %p\n", buff_base);
+	sg->buff = buff_base;
 	return 0;
+
+err_shm:
+	vh_shmdt(sg->shm_remote_addr);
+	sg->shm_remote_addr = NULL;
+	return -ENOMEM;
+}
+
+static int _ve_udma_seg_fini(struct ve_udma_seg *sg)
+{
+	int err, rc = 0;
+
+	// unregister local buffer from DMAATB
+	err = ve_unregister_mem_from_dmaatb(sg->buff_vehva);
+	if (err) {
+		eprintf("VE: Failed to unregister local buffer from DMAATB\n");
+		rc = err;
+	} else
+		free(sg->buff);
+
+	// detach VH sysV shm segment
+	if (sg->shm_remote_addr) {
+		err = vh_shmdt(sg->shm_remote_addr);
+		if (err) {
+			eprintf("VE: Failed to detach from VH sysV shm\n");
+			rc = err;
+		}
+	}
+	return rc;
 }
 
-int ve_udma_init(struct vh_udma_peer *vh_up)
+/*
+  Set up the VE side of a peer. Each thread context has its own peer
+  with its own shm segment mapping and DMA mirror buffers, or uses the
+  segment and mirror of a shared pool. The peer's address is returned
+  in *ve_peer and is passed to all other calls.
+*/
+int ve_udma_init(struct vh_udma_peer *vh_up, uint64_t *ve_peer)
 {
-	int err, j;
-	int key = vh_up->shm_key;
-	size_t size = vh_up->shm_size;
+	int err;
 	uint64_t vh_shm_base = (uint64_t)vh_up->shm_addr;
 	struct ve_udma_peer *ve_up;
+	struct ve_udma_seg *sg;
 
-	ve_up = (struct ve_udma_peer *)malloc(sizeof(struct ve_udma_peer));
+	ve_up = (struct ve_udma_peer *)calloc(1, sizeof(struct ve_udma_peer));
 	if (ve_up == NULL) {
 		eprintf("VE: malloc failed for peer struct.\n");
 		return -ENOMEM;
 	}
 	dprintf("ve allocated ve_up=%p\n", (void *)ve_up);
-	udma_peer = ve_up;
 
-	// find and register shm segment, if not done, yet
-	if (shm_vehva == 0) {
-		err = vhshm_register(key, size);
+	// Initialize DMA
+	err = ve_dma_init();
+	if (err) {
+		eprintf("Failed to initialize DMA\n");
+		free(ve_up);
+		return err;
+	}
+
+	if (vh_up->ve_pool) {
+		ve_up->seg = (struct ve_udma_seg *)vh_up->ve_pool;
+		ve_up->shared = 1;
+	} else {
+		// find and register this peer's shm segment
+		err = _ve_udma_seg_init(&ve_up->own, vh_up->shm_key, vh_up->shm_size);
 		if (err) {
-			free(udma_peer);
-			udma_peer = NULL;
+			free(ve_up);
 			eprintf("VE: vh_shm_register failed, err=%d.\n", err);
 			return err;
 		}
+		ve_up->seg = &ve_up->own;
 	}
-	
-	// now fill the ve_udma_peer structure
-	ve_up->send.len_vehva = shm_vehva +((uint64_t)vh_up->recv.len - vh_shm_base);
-	ve_up->send.shm_vehva = shm_vehva +((uint64_t)vh_up->recv.shm - vh_shm_base);
-	ve_up->recv.len_vehva = shm_vehva +((uint64_t)vh_up->send.len - vh_shm_base);
-	ve_up->recv.shm_vehva = shm_vehva +((uint64_t)vh_up->send.shm - vh_shm_base);
+	sg = ve_up->seg;
+
+	// now fill the ve_udma_peer structure, the mirror has the layout of the segment
+#define SEGOFFS(p) ((uint64_t)(p) - vh_shm_base)
+	ve_up->send.len_vehva = sg->shm_vehva + SEGOFFS(vh_up->recv.len);
+	ve_up->send.shm_vehva = sg->shm_vehva + SEGOFFS(vh_up->recv.shm);
+	ve_up->send.buff_vehva = sg->buff_vehva + SEGOFFS(vh_up->recv.shm);
+	ve_up->send.buff = (char *)sg->buff + SEGOFFS(vh_up->recv.shm);
+	ve_up->recv.len_vehva = sg->shm_vehva + SEGOFFS(vh_up->send.len);
+	ve_up->recv.shm_vehva = sg->shm_vehva + SEGOFFS(vh_up->send.shm);
+	ve_up->recv.buff_vehva = sg->buff_vehva + SEGOFFS(vh_up->send.shm);
+	ve_up->recv.buff = (char *)sg->buff + SEGOFFS(vh_up->send.shm);
 	ve_up->send.buff_len = vh_up->recv.buff_len;
 	ve_up->recv.buff_len = vh_up->send.buff_len;
-	
+	ve_up->desc_offs = SEGOFFS(vh_up->desc);
+	ve_up->cmd_offs = SEGOFFS(vh_up->cmd);
+	ve_up->send.eager_offs = SEGOFFS(vh_up->recv.eager);
+	ve_up->recv.eager_offs = SEGOFFS(vh_up->send.eager);
+	if (vh_up->trace) {
+		ve_up->trace_offs = SEGOFFS(vh_up->trace);
+		ve_up->trace = (struct udma_trace_buf *)((char *)sg->buff + ve_up->trace_offs);
+		ve_up->trace->n = 0;
+		ve_up->trace->dropped = 0;
+	}
+#undef SEGOFFS
+	*ve_peer = (uint64_t)ve_up;
+	return 0;
+}
 
-	// Initialize DMA
+/*
+  The VH estimates the offset between its clock and usrcc with this call.
+*/
+uint64_t ve_udma_usrcc(void)
+{
+	return getusrcc();
+}
+
+int ve_udma_fini(struct ve_udma_peer *ve_up)
+{
+	int rc = 0;
+
+	if (!ve_up->shared)
+		rc = _ve_udma_seg_fini(&ve_up->own);
+	free(ve_up);
+	return rc;
+}
+
+/*
+  Attach the segment of a shared split pool, its address is returned in
+  *ve_pool and passed to ve_udma_init() of the peers using it.
+*/
+int ve_udma_pool_init(int key, size_t size, uint64_t *ve_pool)
+{
+	int err;
+	struct ve_udma_seg *sg;
+
+	sg = (struct ve_udma_seg *)calloc(1, sizeof(struct ve_udma_seg));
+	if (sg == NULL)
+		return -ENOMEM;
 	err = ve_dma_init();
+	if (!err)
+		err = _ve_udma_seg_init(sg, key, size);
 	if (err) {
-		eprintf("Failed to initialize DMA\n");
+		eprintf("VE: attaching split pool failed, err=%d\n", err);
+		free(sg);
 		return err;
 	}
-	char *buff_base;
-	uint64_t buff_base_vehva;
-	size_t align_64mb = 64 * 1024 * 1024;
-	size_t buff_size = 2 * UDMA_BUFF_LEN;
-	buff_size = (buff_size + align_64mb - 1) & ~(align_64mb - 1);
-	
-	// allocate read and write buffers in one call
-	posix_memalign((void **)&buff_base, align_64mb, buff_size);
-	if (buff_base == NULL) {
-		eprintf("VE: allocating udma buffer failed! buffsize=%lu\n", buff_size);
-		return -ENOMEM;
+	*ve_pool = (uint64_t)sg;
+	return 0;
+}
+
+int ve_udma_pool_fini(struct ve_udma_seg *sg)
+{
+	int rc = _ve_udma_seg_fini(sg);
+
+	free(sg);
+	return rc;
+}
+
+/*
+  Attach an additional VH shm segment, e.g. a host pool segment.
+  Its VEHVA and VE address are returned in out[0] and out[1].
+*/
+int ve_udma_shm_attach(int key, size_t size, uint64_t *out)
+{
+	int segid;
+	uint64_t vehva = 0;
+	void *addr;
+
+	segid = vh_shmget(key, size, SHM_HUGETLB);
+	if (segid == -1) {
+		eprintf("VE: vh_shmget key=%d failed, reason: %s\n", key, strerror(errno));
+		return -EINVAL;
 	}
-	dprintf("ve allocated buff at %p\n", buff_base);
-	//busy_sleep_us(1*1000*1000);
-	buff_base_vehva = ve_register_mem_to_dmaatb(buff_base, buff_size);
-	if (buff_base_vehva == (uint64_t)-1) {
-		eprintf("VE: mapping udma buffer failed! buffsize=%lu\n", buff_size);
+	addr = vh_shmat(segid, NULL, 0, (void **)&vehva);
+	if (addr == NULL || vehva == (uint64_t)-1) {
+		eprintf("VE: failed to attach to shm segment %d\n", segid);
 		return -ENOMEM;
 	}
-	dprintf("ve_register_mem_to_dmaatb succeeded for %p\n", buff_base);
-	ve_up->send.buff = buff_base;
-	buff_base += UDMA_BUFF_LEN;
-	ve_up->send.buff_vehva = buff_base_vehva;
-	buff_base_vehva += UDMA_BUFF_LEN;
-	ve_up->recv.buff = buff_base;
-	buff_base += UDMA_BUFF_LEN;
-	ve_up->recv.buff_vehva = buff_base_vehva;
-	buff_base_vehva += UDMA_BUFF_LEN;
+	out[0] = vehva;
+	out[1] = (uint64_t)addr;
 	return 0;
 }
 
-void ve_udma_fini()
+int ve_udma_shm_detach(uint64_t addr)
 {
+	return vh_shmdt((void *)addr);
+}
+
+#define SPLITBUFF(base, idx, size) (void *)((char *)base + idx * size)
+#define SPLITADDR(base, idx, size) (base + idx * size)
+#define SPLITLEN(base, idx) (void *)(base + idx * sizeof(size_t))
+
+/*
+  The splits of a pool peer are placed per transfer, the VH puts their
+  offset in the segment into the mailbox word behind the split lengths.
+*/
+static void _ve_udma_splits(struct ve_udma_peer *ve_up, struct ve_udma_comm *c)
+{
+	uint64_t offs;
+
+	if (!ve_up->shared)
+		return;
+	ve_inst_fenceLF();
+	offs = ve_inst_lhm(SPLITLEN(c->len_vehva, UDMA_MBOX_DATA));
+	c->shm_vehva = ve_up->seg->shm_vehva + offs;
+	c->buff_vehva = ve_up->seg->buff_vehva + offs;
+	c->buff = (char *)ve_up->seg->buff + offs;
+}
+
+/*
+  Record a trace event of a peer. The events of a VE call are collected
+  in the mirror and DMAed to the peer's trace area in shm when the call
+  ends, the VH picks them up when the request completes.
+*/
+static void _ve_udma_trace(struct udma_trace_buf *tb, int ev, int dir, int split,
+			   uint64_t len, long t, long dur)
+{
+	struct udma_trace_ev *e;
+
+	if (tb->n >= UDMA_TRACE_EVENTS) {
+		tb->dropped++;
+		return;
+	}
+	e = &tb->ev[tb->n++];
+	e->t = t;
+	e->dur = dur > UINT32_MAX ? UINT32_MAX : (uint32_t)dur;
+	e->ev = ev;
+	e->dir = dir;
+	e->split = split;
+	e->len = len;
+}
+
+static void _ve_udma_trace_flush(struct ve_udma_peer *ve_up)
+{
+	struct udma_trace_buf *tb = ve_up->trace;
 	int err;
 
-	// unregister local buffer from DMAATB
-	err = ve_unregister_mem_from_dmaatb(udma_peer->send.buff_vehva);
+	if (tb == NULL || (tb->n == 0 && tb->dropped == 0))
+		return;
+	err = ve_dma_post_wait(ve_up->seg->shm_vehva + ve_up->trace_offs,
+			       ve_up->seg->buff_vehva + ve_up->trace_offs,
+			       (int)(sizeof(struct udma_trace_buf)
+				     + tb->n * sizeof(struct udma_trace_ev)));
 	if (err)
-		eprintf("VE: Failed to unregister local buffer from DMAATB\n");
+		eprintf("VE: storing trace events failed, err=%d\n", err);
+	tb->n = 0;
+	tb->dropped = 0;
+}
 
-	// detach VH sysV shm segment
-	if (shm_remote_addr) {
-		err = vh_shmdt(shm_remote_addr);
-		if (err)
-			eprintf("VE: Failed to detach from VH sysV shm\n");
-		else {
-			shm_remote_addr = NULL;
-			shm_vehva = 0;
+/*
+  State of one direction of a transfer. The step functions below never
+  block, so that both directions of an exchange can be interleaved.
+*/
+struct ve_udma_xfer {
+	struct ve_udma_comm *c;
+	char *p;		// contiguous VE buffer, advanced while posting
+	struct udma_strided *sd;	// or strided VE layout
+	struct udma_seg_cursor *sc;	// or VE segments
+	size_t len;
+	int64_t lenp;		// length not posted, yet
+	int split;
+	size_t split_size;
+	uint64_t zc;		// VEHVA of the host pool buffer, or 0
+	int j, jr;		// next split to post, oldest split in flight
+	int copied;		// send: split j is filled, its post was retried
+	int done;
+	struct udma_ve_stats *st;
+	struct udma_trace_buf *tb;	// trace events, or NULL
+	int dir;		// trace direction, 0: VH -> VE
+	long ts;
+	long tpost[UDMA_MAX_SPLIT];	// post time of the DMAs in flight, when tracing
+	int64_t tlenr[UDMA_MAX_SPLIT];
+	uint64_t dstr[UDMA_MAX_SPLIT];	// recv: dst address or stream offset
+	ve_dma_handle_t handle[UDMA_MAX_SPLIT];
+};
+
+static void _ve_udma_xfer_init(struct ve_udma_xfer *x, struct ve_udma_peer *ve_up,
+			       struct ve_udma_comm *c, void *p, struct udma_strided *sd,
+			       struct udma_seg_cursor *sc, size_t len, int split,
+			       size_t split_size, uint64_t zc)
+{
+	memset(x->tlenr, 0, sizeof(x->tlenr));
+	x->c = c;
+	x->p = (char *)p;
+	x->sd = sd;
+	x->sc = sc;
+	x->len = len;
+	x->lenp = len;
+	x->split = split;
+	x->split_size = split_size;
+	x->zc = zc;
+	x->j = 0;
+	x->jr = -1;
+	x->copied = 0;
+	x->done = len == 0;
+	x->st = &ve_up->stats;
+	x->tb = ve_up->trace;
+	x->dir = c == &ve_up->send;
+	x->ts = getusrcc();
+	_ve_udma_splits(ve_up, c);
+}
+
+static inline int _ve_udma_xfer_busy(struct ve_udma_xfer *x)
+{
+	return x->lenp > 0 || (x->jr >= 0 && x->tlenr[x->jr] > 0);
+}
+
+/*
+  Send to VH: fill the next free split from the VE buffer and post its
+  DMA, then check the oldest DMA in flight and hand its split to the
+  VH. With zc set the data is DMAed directly into the host pool buffer,
+  without handshake through the length mailbox.
+*/
+static void _ve_udma_send_step(struct ve_udma_xfer *x)
+{
+	struct ve_udma_comm *c = x->c;
+	int64_t tlen;
+	uint64_t dsta;
+	int j = x->j, err;
+
+	if (x->tlenr[j] == 0 && x->lenp > 0) {
+		ve_inst_fenceLF();
+		if (!x->zc && ve_inst_lhm(SPLITLEN(c->len_vehva, j)) > 0) {
+			if (usrcc_diff_us(x->ts) > UDMA_TIMEOUT_US) {
+				eprintf("VE: timeout waiting for VH recv. "
+					"len=%ld of %lu, split=%d, split_sz=%lu\n",
+					x->lenp, x->len, x->split, x->split_size);
+				x->done = 1;
+				return;
+			}
+			goto poll;
+		}
+		tlen = MIN(x->split_size, x->lenp);
+		if (!x->copied) {
+			long tc = getusrcc();
+
+			if (x->sd)
+				_strided_copy(x->sd, x->len - x->lenp,
+					      SPLITBUFF(c->buff, j, x->split_size), tlen, 0);
+			else if (x->sc)
+				_seg_copy(x->sc, SPLITBUFF(c->buff, j, x->split_size), tlen, 0);
+			else
+				memcpy(SPLITBUFF(c->buff, j, x->split_size), x->p, tlen);
+			x->st->memcpy_cc += getusrcc() - tc;
+			if (x->tb)
+				_ve_udma_trace(x->tb, UDMA_TR_COPY, x->dir, j, tlen, tc,
+					       getusrcc() - tc);
+			x->copied = 1;
 		}
+
+		// dma from buff to shm or directly into the host pool buffer
+		dsta = x->zc ? x->zc + (x->len - x->lenp)
+			: SPLITADDR(c->shm_vehva, j, x->split_size);
+		err = ve_dma_post(dsta, SPLITADDR(c->buff_vehva, j, x->split_size),
+				  (int)tlen, &x->handle[j]);
+		if (err == -EAGAIN)
+			goto poll;
+		if (err) {
+			eprintf("VE: ve_dma_post has failed! err = %d\n", err);
+			if (!x->zc) {
+				ve_inst_shm(SPLITLEN(c->len_vehva, j), 0);
+				ve_inst_fenceSF();
+			}
+			x->done = 1;
+			return;
+		}
+		x->st->dma_posts++;
+		if (x->tb)
+			x->tpost[j] = getusrcc();
+		x->copied = 0;
+		x->tlenr[j] = tlen;
+		if (x->jr == -1)
+			x->jr = j;
+		x->lenp -= tlen;
+		x->p += tlen;
+		x->j = (j + 1) % x->split;
 	}
-}
 
-#define SPLITBUFF(base, idx, size) (void *)((char *)base + idx * size)
-#define SPLITADDR(base, idx, size) (base + idx * size)
-#define SPLITLEN(base, idx) (void *)(base + idx * sizeof(size_t))
+poll:
+	if (x->jr >= 0 && x->tlenr[x->jr] > 0) {
+		long tc = getusrcc();
 
-size_t ve_udma_send(void *src, size_t len, int split, size_t split_size)
+		err = ve_dma_poll(&x->handle[x->jr]);
+		x->st->dma_poll_cc += getusrcc() - tc;
+
+		if (err == 0) { // DMA completed normally
+			if (x->tb)
+				_ve_udma_trace(x->tb, UDMA_TR_DMA, x->dir, x->jr, x->tlenr[x->jr],
+					       x->tpost[x->jr], getusrcc() - x->tpost[x->jr]);
+			if (!x->zc) {
+				ve_inst_shm(SPLITLEN(c->len_vehva, x->jr), x->tlenr[x->jr]);
+				ve_inst_fenceLSF();
+				if (x->tb)
+					_ve_udma_trace(x->tb, UDMA_TR_ACK, x->dir, x->jr,
+						       x->tlenr[x->jr], getusrcc(), 0);
+			}
+			x->tlenr[x->jr] = 0;
+			x->jr = (x->jr + 1) % x->split;
+			x->ts = getusrcc();
+		} else if (err != -EAGAIN) {
+			eprintf("VE: ve_dma_poll returned an error: 0x%x\n", err);
+			x->done = 1;
+			return;
+		} else if (usrcc_diff_us(x->ts) > UDMA_TIMEOUT_US) {
+			eprintf("VE: timeout waiting for DMA descriptor. "
+				"len=%ld of %lu, split=%d, split_sz=%lu, "
+				"jr=%d, tlen=%ld\n",
+				x->lenp, x->len, x->split, x->split_size, x->jr,
+				x->tlenr[x->jr]);
+			x->done = 1;
+			return;
+		}
+	}
+	x->done = !_ve_udma_xfer_busy(x);
+}
+
+/*
+  Receive from VH: post the DMA of the next split the VH has filled,
+  then check the oldest DMA in flight, copy its split out and hand it
+  back to the VH. With zc set the data is DMAed directly from the host
+  pool buffer, without handshake through the length mailbox.
+*/
+static void _ve_udma_recv_step(struct ve_udma_xfer *x)
 {
-	int j, jr, err;
-	int64_t lenp = len, tlen;
-	int64_t tlenr[UDMA_MAX_SPLIT] = {0};
-	struct ve_udma_peer *ve_up = udma_peer;
-	char *srcp = (char *)src;
-	uint64_t srcr[UDMA_MAX_SPLIT];
-	long ts = getusrcc();
-	ve_dma_handle_t handle[UDMA_MAX_SPLIT];
+	struct ve_udma_comm *c = x->c;
+	int64_t tlen;
+	uint64_t srca;
+	int j = x->j, jr, err;
 
-	j = 0; jr = -1;
-	while(lenp > 0 || (jr >= 0 && tlenr[jr] > 0)) {
-		if (tlenr[j] == 0 && lenp > 0) {
-			err = 0;
+	if (x->tlenr[j] == 0 && x->lenp > 0) {
+		if (x->zc) {
+			tlen = MIN(x->split_size, x->lenp);
+			srca = x->zc + (x->len - x->lenp);
+		} else {
+			srca = SPLITADDR(c->shm_vehva, j, x->split_size);
+			// wait for len signal to be set
 			ve_inst_fenceLF();
-			while(ve_inst_lhm(SPLITLEN(ve_up->send.len_vehva, j)) > 0) {
-				ve_inst_fenceLF();
-				if (usrcc_diff_us(ts) > UDMA_TIMEOUT_US) {
-					eprintf("VE: timeout waiting for VH recv. "
+			if ((tlen = ve_inst_lhm(SPLITLEN(c->len_vehva, j))) == 0) {
+				if (usrcc_diff_us(x->ts) > UDMA_TIMEOUT_US) {
+					eprintf("VE: timeout waiting for tlen. "
 						"len=%ld of %lu, split=%d, split_sz=%lu\n",
-						lenp, len, split, split_size);
-					err = -ETIME;
-					break;
+						x->lenp, x->len, x->split, x->split_size);
+					x->done = 1;
+					return;
 				}
+				goto poll;
 			}
-			if (err)
-				break;
-			tlen = MIN(split_size, lenp);
-			memcpy(SPLITBUFF(ve_up->send.buff, j, split_size), (void *)srcp, tlen);
-
-			// dma from shm to buff
-			err = ve_dma_post(SPLITADDR(ve_up->send.shm_vehva, j, split_size),
-					  SPLITADDR(ve_up->send.buff_vehva, j, split_size),
-					  (int)tlen, &handle[j]);
-			if (err) {
-				if (err == -EAGAIN)
-					continue;
-				eprintf("VE: ve_dma_post has failed! err = %d\n", err);
-				ve_inst_shm(SPLITLEN(ve_up->send.len_vehva, j), 0);
+			if (tlen > x->lenp) {
+				eprintf("VE: stopping veo-udma: something's wrong:"
+					" tlen=%ld > lenp=%ld, j=%d, jr=%d,"
+					" len=%lu, split=%d, split_sz=%lu\n",
+					tlen, x->lenp, j, x->jr, x->len, x->split,
+					x->split_size);
+				x->done = 1;
+				return;
+			}
+		}
+		// dma from shm to buff
+		err = ve_dma_post(SPLITADDR(c->buff_vehva, j, x->split_size),
+				  srca, (int)tlen, &x->handle[j]);
+		if (err == -EAGAIN)
+			goto poll;
+		if (err) {
+			eprintf("VE: ve_dma_post has failed! err = %d\n", err);
+			if (!x->zc) {
+				ve_inst_shm(SPLITLEN(c->len_vehva, j), 0);
 				ve_inst_fenceSF();
-				break;
 			}
-			tlenr[j] = tlen;
-			if (jr == -1)
-				jr = j;
-		
-			lenp -= tlen;
-			srcp += tlen;
-			j = (j + 1) % split;
+			x->done = 1;
+			return;
 		}
+		x->st->dma_posts++;
+		if (x->tb)
+			x->tpost[j] = getusrcc();
+		x->dstr[j] = x->sd ? x->len - x->lenp : (uint64_t)x->p;
+		x->tlenr[j] = tlen;
+		if (x->jr == -1)
+			x->jr = j;
+		x->lenp -= tlen;
+		x->p += tlen;
+		x->j = (j + 1) % x->split;
+	}
 
-		if (jr >= 0 && tlenr[jr] > 0) {
-			err = ve_dma_poll(&handle[jr]);
+poll:
+	jr = x->jr;
+	if (jr >= 0 && x->tlenr[jr] > 0) {
+		long tc = getusrcc();
 
-			if (err == 0) { // DMA completed normally
-				ve_inst_shm(SPLITLEN(ve_up->send.len_vehva, jr), tlenr[jr]);
+		err = ve_dma_poll(&x->handle[jr]);
+		x->st->dma_poll_cc += getusrcc() - tc;
+
+		if (err == 0) { // DMA completed normally
+			tc = getusrcc();
+			if (x->tb)
+				_ve_udma_trace(x->tb, UDMA_TR_DMA, x->dir, jr, x->tlenr[jr],
+					       x->tpost[jr], tc - x->tpost[jr]);
+			if (x->sd)
+				_strided_copy(x->sd, x->dstr[jr],
+					      SPLITBUFF(c->buff, jr, x->split_size),
+					      x->tlenr[jr], 1);
+			else if (x->sc)
+				_seg_copy(x->sc, SPLITBUFF(c->buff, jr, x->split_size),
+					  x->tlenr[jr], 1);
+			else
+				memcpy((void *)x->dstr[jr],
+				       SPLITBUFF(c->buff, jr, x->split_size), x->tlenr[jr]);
+			x->st->memcpy_cc += getusrcc() - tc;
+			if (x->tb)
+				_ve_udma_trace(x->tb, UDMA_TR_COPY, x->dir, jr, x->tlenr[jr], tc,
+					       getusrcc() - tc);
+			if (!x->zc) {
+				ve_inst_shm(SPLITLEN(c->len_vehva, jr), 0);
 				ve_inst_fenceLSF();
-				tlenr[jr] = 0;
-				jr = (jr + 1) % split;
-				ts = getusrcc();
-			} else if (err != -EAGAIN) {
-				eprintf("VE: ve_dma_poll returned an error: 0x%x\n", err);
-				break;
-			} else {
-				if (usrcc_diff_us(ts) > UDMA_TIMEOUT_US) {
-					eprintf("VE: timeout waiting for DMA descriptor. "
-						"len=%ld of %lu, split=%d, split_sz=%lu, "
-						"jr=%d, tlen=%ld\n",
-						lenp, len, split, split_size, jr, tlenr[jr]);
-					err = -ETIME;
-					break;
-				}
+				if (x->tb)
+					_ve_udma_trace(x->tb, UDMA_TR_ACK, x->dir, jr, x->tlenr[jr],
+						       getusrcc(), 0);
 			}
+			x->tlenr[jr] = 0;
+			x->jr = (jr + 1) % x->split;
+			x->ts = getusrcc();
+		} else if (err != -EAGAIN) {
+			eprintf("VE: ve_dma_poll returned an error: 0x%x\n", err);
+			x->done = 1;
+			return;
+		} else if (usrcc_diff_us(x->ts) > UDMA_TIMEOUT_US) {
+			eprintf("VE: timeout waiting for DMA descriptor. "
+				"len=%ld of %lu, split=%d, split_sz=%lu, "
+				"jr=%d, tlen=%ld\n",
+				x->lenp, x->len, x->split, x->split_size, jr, x->tlenr[jr]);
+			x->done = 1;
+			return;
 		}
 	}
-	return len - lenp;
+	x->done = !_ve_udma_xfer_busy(x);
+}
+
+/*
+  Send len bytes from src, or gathered from the strided layout sd or the
+  segments of sc, to VH. dst_vehva is set if the VH buffer is in a host
+  pool segment.
+*/
+static size_t _ve_udma_send(struct ve_udma_peer *ve_up, void *src, struct udma_strided *sd,
+			    struct udma_seg_cursor *sc, size_t len, int split,
+			    size_t split_size, uint64_t dst_vehva)
+{
+	struct ve_udma_xfer x;
+
+	_ve_udma_xfer_init(&x, ve_up, &ve_up->send, src, sd, sc, len, split, split_size,
+			   dst_vehva);
+	while (!x.done)
+		_ve_udma_send_step(&x);
+	_ve_udma_trace_flush(ve_up);
+	return x.len - x.lenp;
 }
 
+size_t ve_udma_send(struct ve_udma_peer *ve_up, void *src, size_t len, int split,
+		    size_t split_size, uint64_t dst_vehva)
+{
+	return _ve_udma_send(ve_up, src, NULL, NULL, len, split, split_size, dst_vehva);
+}
 
-int ve_udma_send_packed(struct udma_recv_entry *e, int num_entries)
+size_t ve_udma_send_strided(struct ve_udma_peer *ve_up, struct udma_strided *sd, size_t len,
+			    int split, size_t split_size)
 {
-	int i, err;
-	size_t tlen = 0, elen;
-	struct ve_udma_peer *ve_up = udma_peer;
-	long ts = getusrcc();
-	ve_dma_handle_t dma_handle;
-	char *pb = (char *)ve_up->send.buff;
-
-	/* pack data into buffer */
-	for (i = 0; i < num_entries; i++) {
-		elen = ALIGN8B(e[i].len);
-		if (tlen + elen > ve_up->send.buff_len) {
-			eprintf("VE: send_packed buffer overflow! "
-				"i=%d, num_entries=%d, tlen=%lu, elen=%lu, "
-				"buff_len=$lu\n",
-				i, num_entries, tlen, elen, ve_up->send.buff_len);
-			return -ENOMEM;
-		}
-		memcpy((void *)pb, (void *)e[i].src, e[i].len);
-		tlen += elen;
-		pb += elen;
-	}
-	while ((err = ve_dma_post(ve_up->send.shm_vehva, ve_up->send.buff_vehva,
-				  (int)tlen, &dma_handle)) == -EAGAIN) {
-		if (usrcc_diff_us(ts) > 5 * UDMA_TIMEOUT_US) {
-			eprintf("VE: send_packed timeout waiting for DMA post. "
-				"num_entries=%d, tlen=%ld\n",
-				num_entries, tlen);
-			err = -ETIME;
-			break;
-		}
+	return _ve_udma_send(ve_up, NULL, sd, NULL, len, split, split_size, 0);
+}
+
+/*
+  Fetch len bytes of descriptors from the descriptor space in shm into
+  the same place of the mirror buffer.
+*/
+static void *_ve_udma_get_desc(struct ve_udma_peer *ve_up, size_t len)
+{
+	int err;
+
+	if (len == 0 || len > UDMA_DESC_SPACE) {
+		eprintf("VE: illegal descriptor length: %lu\n", len);
+		return NULL;
 	}
+	err = ve_dma_post_wait(ve_up->seg->buff_vehva + ve_up->desc_offs,
+			       ve_up->seg->shm_vehva + ve_up->desc_offs, (int)len);
 	if (err) {
-		eprintf("VE: ve_dma_post has failed! err = %d\n", err);
-		return err;
+		eprintf("VE: fetching descriptors failed, err=%d\n", err);
+		return NULL;
 	}
-	while ((err = ve_dma_poll(&dma_handle)) == -EAGAIN) {
-		if (usrcc_diff_us(ts) > 5 * UDMA_TIMEOUT_US) {
-			eprintf("VE: send_packed timeout waiting for DMA descriptor. "
-				"num_entries=%d, tlen=%ld\n",
-				num_entries, tlen);
-			err = -ETIME;
-			break;
-		}
+	return (char *)ve_up->seg->buff + ve_up->desc_offs;
+}
+
+size_t ve_udma_sendv(struct ve_udma_peer *ve_up, int nseg, size_t len, int split,
+		     size_t split_size)
+{
+	struct udma_seg_cursor sc = {NULL, nseg, 0, 0};
+
+	if ((sc.seg = _ve_udma_get_desc(ve_up, nseg * sizeof(struct udma_seg))) == NULL)
+		return 0;
+	return _ve_udma_send(ve_up, NULL, NULL, &sc, len, split, split_size, 0);
+}
+
+
+/*
+  Receive len bytes from VH into dst, or scattered into the strided layout
+  sd or the segments of sc. src_vehva is set if the VH buffer is in a
+  host pool segment.
+*/
+static size_t _ve_udma_recv(struct ve_udma_peer *ve_up, void *dst, struct udma_strided *sd,
+			    struct udma_seg_cursor *sc, size_t len, int split,
+			    size_t split_size, uint64_t src_vehva)
+{
+	struct ve_udma_xfer x;
+
+	_ve_udma_xfer_init(&x, ve_up, &ve_up->recv, dst, sd, sc, len, split, split_size,
+			   src_vehva);
+	while (!x.done)
+		_ve_udma_recv_step(&x);
+	_ve_udma_trace_flush(ve_up);
+	return x.len - x.lenp;
+}
+
+size_t ve_udma_recv(struct ve_udma_peer *ve_up, void *dst, size_t len, int split,
+		    size_t split_size, uint64_t src_vehva)
+{
+	return _ve_udma_recv(ve_up, dst, NULL, NULL, len, split, split_size, src_vehva);
+}
+
+size_t ve_udma_recv_strided(struct ve_udma_peer *ve_up, struct udma_strided *sd, size_t len,
+			    int split, size_t split_size)
+{
+	return _ve_udma_recv(ve_up, NULL, sd, NULL, len, split, split_size, 0);
+}
+
+size_t ve_udma_recvv(struct ve_udma_peer *ve_up, int nseg, size_t len, int split,
+		     size_t split_size)
+{
+	struct udma_seg_cursor sc = {NULL, nseg, 0, 0};
+
+	if ((sc.seg = _ve_udma_get_desc(ve_up, nseg * sizeof(struct udma_seg))) == NULL)
+		return 0;
+	return _ve_udma_recv(ve_up, NULL, NULL, &sc, len, split, split_size, 0);
+}
+
+/*
+  Receive a broadcast: the VH stages the splits once in the broadcast
+  segment at bcast_vehva for all VEs, this peer's mailbox tells which
+  of them are filled and hands them back after the DMA.
+*/
+size_t ve_udma_recv_bcast(struct ve_udma_peer *ve_up, void *dst, size_t len, int split,
+			  size_t split_size, uint64_t bcast_vehva)
+{
+	struct ve_udma_comm c;
+	struct ve_udma_xfer x;
+
+	_ve_udma_xfer_init(&x, ve_up, &ve_up->recv, dst, NULL, NULL, len, split, split_size, 0);
+	c = ve_up->recv;
+	c.shm_vehva = bcast_vehva;
+	x.c = &c;
+	while (!x.done)
+		_ve_udma_recv_step(&x);
+	_ve_udma_trace_flush(ve_up);
+	return x.len - x.lenp;
+}
+
+/*
+  Full duplex: receive recv_len bytes from VH into dst while sending
+  send_len bytes from src to VH. The two directions use the two halves
+  of the peer's shm and proceed independently, their steps are
+  interleaved so that DMAs of both directions are in flight together.
+
+  Returns the total number of bytes moved.
+*/
+size_t ve_udma_exchange(struct ve_udma_peer *ve_up, void *dst, size_t recv_len,
+			int r_split, size_t r_split_size, uint64_t src_vehva,
+			void *src, size_t send_len, int s_split, size_t s_split_size,
+			uint64_t dst_vehva)
+{
+	struct ve_udma_xfer xr, xs;
+
+	_ve_udma_xfer_init(&xr, ve_up, &ve_up->recv, dst, NULL, NULL, recv_len, r_split,
+			   r_split_size, src_vehva);
+	_ve_udma_xfer_init(&xs, ve_up, &ve_up->send, src, NULL, NULL, send_len, s_split,
+			   s_split_size, dst_vehva);
+	while (!xr.done || !xs.done) {
+		if (!xr.done)
+			_ve_udma_recv_step(&xr);
+		if (!xs.done)
+			_ve_udma_send_step(&xs);
 	}
-	return err;
+	_ve_udma_trace_flush(ve_up);
+	return (xr.len - xr.lenp) + (xs.len - xs.lenp);
 }
 
-size_t ve_udma_recv(void *dst, size_t len, int split, size_t split_size, int pack)
+/*
+  Receive a send pack stream from VH and unpack its entries. The stream
+  length is not known in advance, the VH marks the last split with
+  UDMA_LEN_LAST. While waiting for the next split the DMA of the
+  previous ones is polled. Without a new split for UDMA_TIMEOUT_US the
+  stream is given up, the VH then fails it with -EPIPE.
+
+  Returns the number of unpacked bytes.
+*/
+size_t ve_udma_recv_pack(struct ve_udma_peer *ve_up, int split, size_t split_size)
 {
-	int j, jr, err;
-	int64_t lenp = len, tlen;
+	int j, jr, last = 0, err;
+	int64_t tlen;
 	int64_t tlenr[UDMA_MAX_SPLIT] = {0};
-	struct ve_udma_peer *ve_up = udma_peer;
-	char *dstp = (char *)dst;
-	uint64_t dstr[UDMA_MAX_SPLIT];
-	long ts = getusrcc();
+	uint64_t v;
+	size_t len = 0;
+	long ts = getusrcc(), tc;
 	ve_dma_handle_t handle[UDMA_MAX_SPLIT];
+	long tpost[UDMA_MAX_SPLIT];
+	struct udma_ve_stats *st = &ve_up->stats;
+	struct udma_trace_buf *tb = ve_up->trace;
 
+	_ve_udma_splits(ve_up, &ve_up->recv);
 	j = 0; jr = -1;
-	while(lenp > 0 || (jr >= 0 && tlenr[jr] > 0)) {
-		if (tlenr[j] == 0 && lenp > 0) {
-			err = 0;
-			// wait for len signal to be set
+	while(!last || (jr >= 0 && tlenr[jr] > 0)) {
+		// next split of the stream, if the VH has handed it over
+		v = 0;
+		if (tlenr[j] == 0 && !last) {
 			ve_inst_fenceLF();
-			while((tlen = ve_inst_lhm(SPLITLEN(ve_up->recv.len_vehva, j))) == 0) {
-				ve_inst_fenceLF();
-				if (usrcc_diff_us(ts) > UDMA_TIMEOUT_US) {
-					eprintf("VE: timeout waiting for tlen. "
-						"len=%ld of %lu, split=%d, split_sz=%lu\n",
-						lenp, len, split, split_size);
-					err = -ETIME;
-					break;
-				}
-			}
-			if (err)
-				break;
-			if (tlen > lenp) {
-				eprintf("VE: stopping veo-udma: something's wrong:"
-					" tlen=%ld > lenp=%ld, j=%d, jr=%d,"
-                                        " len=%lu, split=%d, split_sz=%lu\n",
-					tlen, lenp, j, jr, len, split, split_size);
-				err = -EINVAL;
+			v = ve_inst_lhm(SPLITLEN(ve_up->recv.len_vehva, j));
+		}
+		if (v != 0) {
+			tlen = v & ~UDMA_LEN_LAST;
+			if (tlen > split_size) {
+				eprintf("VE: stopping veo-udma: pack split too large: "
+					"tlen=%ld, j=%d, split=%d, split_sz=%lu\n",
+					tlen, j, split, split_size);
 				break;
 			}
-			// dma from shm to buff
-			err = ve_dma_post(SPLITADDR(ve_up->recv.buff_vehva, j, split_size),
-					  SPLITADDR(ve_up->recv.shm_vehva, j, split_size),
-					  (int)tlen, &handle[j]);
-			if (err) {
-				if (err == -EAGAIN)
-					continue;
-				eprintf("VE: ve_dma_post has failed! err = %d\n", err);
+			if (tlen > 0) {
+				// dma from shm to buff
+				err = ve_dma_post(SPLITADDR(ve_up->recv.buff_vehva, j, split_size),
+						  SPLITADDR(ve_up->recv.shm_vehva, j, split_size),
+						  (int)tlen, &handle[j]);
+				if (err) {
+					if (err == -EAGAIN)
+						continue;
+					eprintf("VE: ve_dma_post has failed! err = %d\n", err);
+					ve_inst_shm(SPLITLEN(ve_up->recv.len_vehva, j), 0);
+					ve_inst_fenceSF();
+					break;
+				}
+				st->dma_posts++;
+				if (tb)
+					tpost[j] = getusrcc();
+				tlenr[j] = tlen;
+				if (jr == -1)
+					jr = j;
+			} else {
+				// empty last split
 				ve_inst_shm(SPLITLEN(ve_up->recv.len_vehva, j), 0);
 				ve_inst_fenceSF();
-				break;
 			}
-			dstr[j] = (uint64_t)dstp;
-			tlenr[j] = tlen;
-			if (jr == -1)
-				jr = j;
-		
-			lenp -= tlen;
-			dstp += tlen;
+			last = (v & UDMA_LEN_LAST) != 0;
 			j = (j + 1) % split;
+			ts = getusrcc();
 		}
 
 		if (jr >= 0 && tlenr[jr] > 0) {
+			tc = getusrcc();
 			err = ve_dma_poll(&handle[jr]);
+			st->dma_poll_cc += getusrcc() - tc;
 
 			if (err == 0) { // DMA completed normally
-				if (pack) {
-					err = _buffer_send_unpack(SPLITBUFF(ve_up->recv.buff, jr, split_size),
-                                                                  (size_t)tlenr[jr]);
-					/* TODO: error handling */
-				} else {
-					memcpy((void *)dstr[jr],
-					       SPLITBUFF(ve_up->recv.buff, jr, split_size),
-					       tlenr[jr]);
-				}
+				tc = getusrcc();
+				if (tb)
+					_ve_udma_trace(tb, UDMA_TR_DMA, 0, jr, tlenr[jr], tpost[jr],
+						       tc - tpost[jr]);
+				if (_buffer_send_unpack(SPLITBUFF(ve_up->recv.buff, jr, split_size),
+							(size_t)tlenr[jr]) == 0)
+					len += tlenr[jr];
+				st->memcpy_cc += getusrcc() - tc;
+				if (tb)
+					_ve_udma_trace(tb, UDMA_TR_COPY, 0, jr, tlenr[jr], tc,
+						       getusrcc() - tc);
 				ve_inst_shm(SPLITLEN(ve_up->recv.len_vehva, jr), 0);
 				ve_inst_fenceLSF();
+				if (tb)
+					_ve_udma_trace(tb, UDMA_TR_ACK, 0, jr, tlenr[jr], getusrcc(), 0);
 				tlenr[jr] = 0;
 				jr = (jr + 1) % split;
 				ts = getusrcc();
@@ -402,14 +887,139 @@ size_t ve_udma_recv(void *dst, size_t len, int split, size_t split_size, int pac
 			} else {
 				if (usrcc_diff_us(ts) > UDMA_TIMEOUT_US) {
 					eprintf("VE: timeout waiting for DMA descriptor. "
-						"len=%ld of %lu, split=%d, split_sz=%lu, "
-						"jr=%d, tlen=%ld\n",
-						lenp, len, split, split_size, jr, tlenr[jr]);
-					err = -ETIME;
+						"split=%d, split_sz=%lu, jr=%d, tlen=%ld\n",
+						split, split_size, jr, tlenr[jr]);
 					break;
 				}
 			}
+		} else if (usrcc_diff_us(ts) > UDMA_TIMEOUT_US) {
+			eprintf("VE: timeout waiting for the next pack split. "
+				"split=%d, split_sz=%lu, j=%d\n", split, split_size, j);
+			break;
 		}
 	}
-	return len - lenp;
+	_ve_udma_trace_flush(ve_up);
+	return len;
+}
+
+/*
+  Eager transfers of tiny buffers: the payload sits in the eager area in
+  front of the length mailbox and is moved with one DMA, without split
+  handshake. The VH copies it in before the call, respectively out
+  after the call returned.
+*/
+size_t ve_udma_recv_eager(struct ve_udma_peer *ve_up, void *dst, size_t len)
+{
+	int err;
+
+	if (len > UDMA_EAGER_SPACE)
+		return 0;
+	err = ve_dma_post_wait(ve_up->seg->buff_vehva + ve_up->recv.eager_offs,
+			       ve_up->seg->shm_vehva + ve_up->recv.eager_offs, (int)ALIGN8B(len));
+	if (err) {
+		eprintf("VE: eager recv DMA failed, err=%d\n", err);
+		return 0;
+	}
+	memcpy(dst, (char *)ve_up->seg->buff + ve_up->recv.eager_offs, len);
+	return len;
+}
+
+size_t ve_udma_send_eager(struct ve_udma_peer *ve_up, void *src, size_t len)
+{
+	int err;
+
+	if (len > UDMA_EAGER_SPACE)
+		return 0;
+	memcpy((char *)ve_up->seg->buff + ve_up->send.eager_offs, src, len);
+	err = ve_dma_post_wait(ve_up->seg->shm_vehva + ve_up->send.eager_offs,
+			       ve_up->seg->buff_vehva + ve_up->send.eager_offs, (int)ALIGN8B(len));
+	if (err) {
+		eprintf("VE: eager send DMA failed, err=%d\n", err);
+		return 0;
+	}
+	return len;
+}
+
+/*
+  Run the transfer of one agent command.
+*/
+static size_t _ve_udma_agent_exec(struct ve_udma_peer *ve_up, struct udma_cmd *c)
+{
+	struct udma_seg_cursor sc = {NULL, c->nseg, 0, 0};
+	struct udma_strided *sd = NULL;
+
+	if (c->eager)
+		return c->op == UDMA_OP_SEND ? ve_udma_recv_eager(ve_up, (void *)c->vp, c->len)
+			: ve_udma_send_eager(ve_up, (void *)c->vp, c->len);
+	if (c->nseg) {
+		sc.seg = _ve_udma_get_desc(ve_up, c->nseg * sizeof(struct udma_seg));
+		if (sc.seg == NULL)
+			return 0;
+	} else if (c->strided) {
+		sd = _ve_udma_get_desc(ve_up, sizeof(struct udma_strided));
+		if (sd == NULL)
+			return 0;
+	}
+	switch (c->op) {
+	case UDMA_OP_SEND:
+		return _ve_udma_recv(ve_up, (void *)c->vp, sd, c->nseg ? &sc : NULL,
+				     c->len, c->split, c->split_size, c->zc);
+	case UDMA_OP_RECV:
+		return _ve_udma_send(ve_up, (void *)c->vp, sd, c->nseg ? &sc : NULL,
+				     c->len, c->split, c->split_size, c->zc);
+	case UDMA_OP_SEND_PACKED:
+		return ve_udma_recv_pack(ve_up, c->split, c->split_size);
+	case UDMA_OP_BCAST:
+		return ve_udma_recv_bcast(ve_up, (void *)c->vp, c->len, c->split, c->split_size,
+					  c->zc);
+	case UDMA_OP_EXCHANGE:
+		return ve_udma_exchange(ve_up, (void *)c->vp, c->len, c->split, c->split_size,
+					c->zc, (void *)c->vp2, c->len2, c->split2,
+					c->split_size2, c->zc2);
+	}
+	eprintf("VE: unknown agent command %u\n", c->op);
+	return 0;
+}
+
+/*
+  Transfer agent: poll the command ring in shm and run the commands
+  after seq until the VH posts UDMA_OP_STOP. Each command is DMAed into
+  the mirror buffer at the offset of the ring, its result is
+  stored back before its done field.
+*/
+int ve_udma_agent(struct ve_udma_peer *ve_up, uint64_t seq)
+{
+	int err;
+	uint64_t ring_vehva = ve_up->seg->shm_vehva + ve_up->cmd_offs;
+	uint64_t cmd_offs, res;
+	struct udma_cmd_ring *ring = (struct udma_cmd_ring *)((char *)ve_up->seg->buff
+							      + ve_up->cmd_offs);
+	struct udma_cmd *c;
+
+	for (;;) {
+		ve_inst_fenceLF();
+		while (ve_inst_lhm((void *)(ring_vehva + offsetof(struct udma_cmd_ring, head)))
+		       <= seq)
+			ve_inst_fenceLF();
+		seq++;
+		cmd_offs = offsetof(struct udma_cmd_ring, cmd)
+			+ (seq % UDMA_CMD_RING) * sizeof(struct udma_cmd);
+		c = (struct udma_cmd *)((char *)ring + cmd_offs);
+		err = ve_dma_post_wait(ve_up->seg->buff_vehva + ve_up->cmd_offs + cmd_offs,
+				       ring_vehva + cmd_offs, sizeof(struct udma_cmd));
+		if (err || c->seq != seq) {
+			eprintf("VE: fetching agent command %lu failed, err=%d\n", seq, err);
+			return -EIO;
+		}
+		if (c->op == UDMA_OP_STOP)
+			break;
+		res = _ve_udma_agent_exec(ve_up, c);
+		ve_inst_shm((void *)(ring_vehva + cmd_offs + offsetof(struct udma_cmd, result)),
+			    res);
+		ve_inst_fenceSF();
+		ve_inst_shm((void *)(ring_vehva + cmd_offs + offsetof(struct udma_cmd, done)),
+			    seq);
+		ve_inst_fenceSF();
+	}
+	return 0;
 }
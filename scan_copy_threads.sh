@@ -0,0 +1,21 @@
+#!/bin/bash
+#
+# Scaling of the VH side staging memcpy with the number of copy threads.
+# Pin the workers by setting UDMA_COPY_CPUS, e.g. UDMA_COPY_CPUS=2,3,4,5
+#
+
+threads="0 1 2 3 4"
+sizes="16M,32M,64M,256M,1G"
+
+printf "%8s %8s   %9s   %9s\n" "buff MB" "threads" "send MB/s" "recv MB/s"
+for t in $threads; do
+    UDMA_COPY_THREADS=$t ./udma_bench -a udma -s $sizes -f csv | awk -F, -v t=$t '
+NR > 1 {
+    if (!($3 in seen)) { seen[$3] = 1; order[n++] = $3 }
+    bw[$2, $3] = $12
+}
+END {
+    for (i = 0; i < n; i++)
+        printf "%8d %8d   %9.0f   %9.0f\n", order[i] / 1048576, t, bw["send", order[i]], bw["recv", order[i]]
+}'
+done
@@ -1,15 +1,19 @@
 #!/bin/bash
+#
+# Bandwidth over transfer sizes, all sizes in one VE process.
+# ./scan_perf.sh [udma|veo|pack]
+#
 
-kbscan="1 4 16 32 64 96 128 256 512 768"
-mbscan="1 2 4 8 16 32 64 256 1024"
+API=${1:-udma}
+sizes="1k,4k,16k,32k,64k,96k,128k,256k,512k,768k,1M,2M,4M,8M,16M,32M,64M,256M,1G"
 
-
-printf "%8s   %7s   %7s\n" "buff kB" "send MB/s" "recv MB/s"
-for s in $kbscan; do
-    bw=`./bandwidth $((s * 1024)) 2>&1 | grep "bw=" | sed -e 's,^.*bw=,,' -e 's,\..*$,,'`
-    printf "%8d   %7.0f   %7.0f\n" $s $bw
-done
-for s in $mbscan; do
-    bw=`./bandwidth $((s * 1024 * 1024)) 2>&1 | grep "bw=" | sed -e 's,^.*bw=,,' -e 's,\..*$,,'`
-    printf "%8d   %7.0f   %7.0f\n" $((s*1024)) $bw
-done
+./udma_bench -a $API -s $sizes -f csv | awk -F, '
+NR > 1 {
+    if (!($3 in seen)) { seen[$3] = 1; order[n++] = $3 }
+    bw[$2, $3] = $12
+}
+END {
+    printf "%8s   %9s   %9s\n", "buff kB", "send MB/s", "recv MB/s"
+    for (i = 0; i < n; i++)
+        printf "%8d   %9.0f   %9.0f\n", order[i] / 1024, bw["send", order[i]], bw["recv", order[i]]
+}'
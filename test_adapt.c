@@ -0,0 +1,102 @@
+/*
+  Test of the online split adaptation.
+
+  With UDMA_ADAPTIVE=1 (set here unless given) a buffer is sent to the
+  VE and received back many times. Every UDMA_ADAPT_EXPLORE-th transfer
+  of a size bucket must try a neighbouring split configuration, the
+  peer counters must show these trials. Run it with a small
+  UDMA_BUFF_LEN, too, the splits are then fitted to the peer.
+
+  ./test_adapt [len] [reps]
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+int main(int argc, char **argv)
+{
+	int k, rc, peer_id, reps = 4 * UDMA_ADAPT_EXPLORE, n = 0;
+	uint64_t ve_buff;
+	char *local_buff, *local_buff2;
+	size_t i, len = 16 * 1024 * 1024, res;
+	struct veo_udma_stats st;
+
+	if (argc > 1)
+		len = atol(argv[1]);
+	if (argc > 2)
+		reps = atoi(argv[2]);
+	if (len < UDMA_ADAPT_MIN_LEN)
+		len = UDMA_ADAPT_MIN_LEN;
+	setenv("UDMA_ADAPTIVE", "1", 0);
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	local_buff = (char *)malloc(len);
+	local_buff2 = (char *)malloc(len);
+	for (i = 0; i < len; i++)
+		local_buff[i] = (char)(i * 7 + 3);
+
+	rc = veo_alloc_mem(proc, &ve_buff, len);
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	printf("sending and receiving %lu bytes %d times\n", len, reps);
+	for (k = 0; k < reps; k++) {
+		memset(local_buff2, 0, len);
+		res = veo_udma_send(ctx, local_buff, ve_buff, len);
+		if (res != len) {
+			printf("send %d returned %lu\n", k, res);
+			n++;
+		}
+		res = veo_udma_recv(ctx, ve_buff, local_buff2, len);
+		if (res != len) {
+			printf("recv %d returned %lu\n", k, res);
+			n++;
+		}
+		if (memcmp(local_buff, local_buff2, len) != 0) {
+			printf("Verify error: round trip %d returned wrong data\n", k);
+			n++;
+		}
+	}
+
+	rc = veo_udma_get_stats(peer_id, &st);
+	if (rc) {
+		printf("veo_udma_get_stats failed with rc=%d\n", rc);
+		goto finish;
+	}
+	printf("split adaptation: %lu trials, %lu switches\n",
+	       st.adapt_trials, st.adapt_switches);
+	/* both directions explore at least once within reps transfers */
+	if (reps >= 2 * UDMA_ADAPT_EXPLORE && st.adapt_trials < 2) {
+		printf("Adaptation error: no split configurations were tried\n");
+		n++;
+	}
+	rc = n ? 1 : 0;
+	if (!rc)
+		printf("Adaptation tried neighbours, data is identical.\n");
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
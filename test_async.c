@@ -0,0 +1,131 @@
+/*
+  Test of the asynchronous veo_udma_send_async / veo_udma_recv_async calls.
+
+  Several transfers are queued at once, the host works on the next
+  batch while they are in flight. The peer counters must account for
+  all transfered bytes.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+#define NREQ 4
+
+int main(int argc, char **argv)
+{
+	int k, rc, peer_id, polls;
+	uint64_t ve_buff;
+	long *local_buff, *local_buff2;
+	size_t i, bsize = 4 * 1024 * 1024, chunk, res, lens[NREQ];
+	struct veo_udma_req *reqs[NREQ];
+	struct veo_udma_wait_stats ws;
+	struct veo_udma_stats st;
+
+	if (argc == 2)
+		bsize = atol(argv[1]);
+	bsize = bsize / sizeof(long) / NREQ * NREQ;
+	chunk = bsize / NREQ;
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	local_buff = (long *)malloc(bsize * sizeof(long));
+	local_buff2 = (long *)malloc(bsize * sizeof(long));
+	for (i = 0; i < bsize; i++)
+		local_buff[i] = (long)i;
+	memset(local_buff2, 0, bsize * sizeof(long));
+
+	rc = veo_alloc_mem(proc, &ve_buff, bsize * sizeof(long));
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	printf("calling veo_udma_send_async %d times\n", NREQ);
+	for (k = 0; k < NREQ; k++) {
+		reqs[k] = veo_udma_send_async(ctx, &local_buff[k * chunk],
+					      ve_buff + k * chunk * sizeof(long),
+					      chunk * sizeof(long));
+		if (reqs[k] == NULL) {
+			printf("veo_udma_send_async failed\n");
+			goto finish;
+		}
+	}
+	/* the host is free to do something else now */
+	polls = 0;
+	while (!veo_udma_test(reqs[0], &res))
+		polls++;
+	printf("first send completed after %d polls: %lu bytes\n", polls, res);
+	rc = veo_udma_waitall(NREQ - 1, &reqs[1], lens);
+	printf("veo_udma_waitall returned %d\n", rc);
+
+	printf("calling veo_udma_recv_async %d times\n", NREQ);
+	for (k = 0; k < NREQ; k++)
+		reqs[k] = veo_udma_recv_async(ctx, ve_buff + k * chunk * sizeof(long),
+					      &local_buff2[k * chunk],
+					      chunk * sizeof(long));
+	for (k = NREQ - 1; k >= 0; k--) {
+		res = veo_udma_wait(reqs[k]);
+		if (res != chunk * sizeof(long))
+			printf("veo_udma_wait: request %d returned %lu\n", k, res);
+	}
+
+	rc = 0;
+	// check local_buff content
+	for (i = 0; i < bsize; i++) {
+		if (local_buff[i] != local_buff2[i]) {
+			rc = 1;
+			break;
+		}
+	}
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+	if (veo_udma_peer_get_wait_stats(peer_id, &ws) == 0)
+		printf("wait: spin %.1f ms, yield %.1f ms, sleep %.1f ms, "
+		       "peeks %lu, skipped %lu\n", ws.spin_ns / 1e6,
+		       ws.yield_ns / 1e6, ws.sleep_ns / 1e6, ws.peeks,
+		       ws.peeks_skipped);
+	if (veo_udma_get_stats(peer_id, &st) == 0) {
+		printf("stats: send %lu bytes in %lu calls, recv %lu bytes in %lu calls\n"
+		       "  VH memcpy %.1f ms, slot wait %.1f ms, peek %.1f ms\n"
+		       "  VE memcpy %.1f ms, dma poll %.1f ms, %lu dma posts\n",
+		       st.send_bytes, st.send_calls, st.recv_bytes, st.recv_calls,
+		       st.memcpy_ns / 1e6, st.slot_wait_ns / 1e6, st.peek_ns / 1e6,
+		       st.ve_memcpy_ns / 1e6, st.ve_dma_poll_ns / 1e6, st.ve_dma_posts);
+		if (st.send_bytes != bsize * sizeof(long) || st.recv_bytes != bsize * sizeof(long)
+		    || st.send_calls != NREQ || st.recv_calls != NREQ) {
+			printf("Counter error: transfered bytes or calls don't match\n");
+			rc = 1;
+		}
+	} else
+		rc = 1;
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
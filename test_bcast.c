@@ -0,0 +1,210 @@
+/*
+  Test of the broadcast to and the gather from several VEs.
+
+  One VEO proc is created per VE, starting at VE_NODE_NUMBER, each with
+  ctx_per_ve thread contexts as peers. A buffer is broadcast to all
+  peers, received back from each of them and verified. Then each peer
+  contributes another slice of it to a gather. The times of broadcast
+  and gather are compared with one veo_udma_send()/veo_udma_recv() per
+  peer.
+
+  ./test_bcast [num_ves [ctx_per_ve [buffer size]]]
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+
+#define MAX_VE 8
+#define MAX_CTX 4
+
+/* variables for VEO demo */
+int ve_node_number = 0;
+struct veo_proc_handle *proc[MAX_VE];
+struct veo_thr_ctxt *ctx[MAX_VE * MAX_CTX];
+int nve = 2, nctx = 1;
+uint64_t handle[MAX_VE];
+int peer_id[MAX_VE * MAX_CTX];
+
+int veo_init()
+{
+	int i, k;
+	char *env;
+
+	env = getenv("VE_NODE_NUMBER");
+	if (env)
+		ve_node_number = atoi(env);
+
+	for (i = 0; i < nve; i++) {
+#ifdef VEO_STATIC
+		proc[i] = veo_proc_create_static(ve_node_number + i, "./veorun_static");
+#else
+		proc[i] = veo_proc_create(ve_node_number + i);
+#endif
+		if (proc[i] == NULL) {
+			perror("ERROR: veo_proc_create");
+			return -1;
+		}
+#ifdef VEO_STATIC
+		handle[i] = 0;
+#else
+		handle[i] = veo_load_library(proc[i], "./libveo_udma_ve.so");
+		if (handle[i] == 0) {
+			perror("ERROR: veo_load_library");
+			return -1;
+		}
+#endif
+		for (k = 0; k < nctx; k++) {
+			ctx[i * nctx + k] = veo_context_open(proc[i]);
+			if (ctx[i * nctx + k] == NULL) {
+				perror("ERROR: veo_context_open");
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int veo_finish()
+{
+	int i;
+
+	for (i = 0; i < nve * nctx; i++)
+		veo_context_close(ctx[i]);
+	for (i = 0; i < nve; i++)
+		veo_proc_destroy(proc[i]);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int i, k, n, rc = 0, err = 0;
+	uint64_t ve_buff[MAX_VE * MAX_CTX];
+	char *local_buff, *local_buff2;
+	size_t bsize = 32 * 1024 * 1024, res, slice;
+	size_t slens[MAX_VE * MAX_CTX];
+	uint64_t srcs[MAX_VE * MAX_CTX];
+	size_t lens[] = {1000, 3 * 1024 * 1024 + 5, 0};
+	double t, t_bc, t_send;
+
+	if (argc > 1)
+		nve = atoi(argv[1]);
+	if (nve < 1 || nve > MAX_VE)
+		nve = 2;
+	if (argc > 2)
+		nctx = atoi(argv[2]);
+	if (nctx < 1 || nctx > MAX_CTX)
+		nctx = 1;
+	if (argc > 3)
+		bsize = atol(argv[3]);
+	n = nve * nctx;
+
+	if (veo_init() != 0)
+		exit(1);
+
+	for (i = 0; i < n; i++) {
+		peer_id[i] = veo_udma_peer_init(ve_node_number + i / nctx, proc[i / nctx],
+						ctx[i], handle[i / nctx]);
+		if (peer_id[i] < 0) {
+			printf("veo_udma_peer_init failed for context %d, rc=%d\n",
+			       i, peer_id[i]);
+			exit(1);
+		}
+		rc = veo_alloc_mem(proc[i / nctx], &ve_buff[i], bsize);
+		if (rc != 0) {
+			printf("veo_alloc_mem failed with rc=%d\n", rc);
+			goto finish;
+		}
+	}
+
+	local_buff = (char *)malloc(bsize);
+	local_buff2 = (char *)malloc(bsize);
+	for (i = 0; i < bsize; i++)
+		local_buff[i] = (char)(i * 13 + 1);
+
+	lens[2] = bsize;
+	for (k = 0; k < 3; k++) {
+		if (lens[k] > bsize)
+			continue;
+		res = veo_udma_bcast(n, peer_id, local_buff, ve_buff, lens[k]);
+		if (res != lens[k]) {
+			printf("broadcast of %lu bytes returned %lu\n", lens[k], res);
+			err++;
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			memset(local_buff2, 0, lens[k]);
+			res = veo_udma_recv(ctx[i], ve_buff[i], local_buff2, lens[k]);
+			if (res != lens[k] || memcmp(local_buff, local_buff2, lens[k])) {
+				printf("broadcast of %lu bytes: peer %d has wrong data\n",
+				       lens[k], i);
+				err++;
+			}
+		}
+	}
+
+	/* peer i returns slice i, the last one the rest */
+	slice = bsize / n;
+	for (i = 0; i < n; i++) {
+		srcs[i] = ve_buff[i] + i * slice;
+		slens[i] = i < n - 1 ? slice : bsize - i * slice;
+	}
+	memset(local_buff2, 0, bsize);
+	res = veo_udma_gather(n, peer_id, srcs, slens, local_buff2);
+	if (res != bsize || memcmp(local_buff, local_buff2, bsize)) {
+		printf("gather of %lu bytes returned %lu or wrong data\n", bsize, res);
+		err++;
+	}
+
+	t = now();
+	for (k = 0; k < 4; k++)
+		veo_udma_gather(n, peer_id, srcs, slens, local_buff2);
+	t_bc = (now() - t) / k;
+	t = now();
+	for (k = 0; k < 4; k++)
+		for (i = 0; i < n; i++)
+			veo_udma_recv(ctx[i], srcs[i], local_buff2 + i * slice, slens[i]);
+	t_send = (now() - t) / k;
+	printf("%d peers, %lu bytes: gather %.3f ms %.0f MB/s, recvs %.3f ms %.0f MB/s\n",
+	       n, bsize, t_bc * 1e3, bsize / t_bc / 1e6,
+	       t_send * 1e3, bsize / t_send / 1e6);
+
+	t = now();
+	for (k = 0; k < 4; k++)
+		veo_udma_bcast(n, peer_id, local_buff, ve_buff, bsize);
+	t_bc = (now() - t) / k;
+	t = now();
+	for (k = 0; k < 4; k++)
+		for (i = 0; i < n; i++)
+			veo_udma_send(ctx[i], local_buff, ve_buff[i], bsize);
+	t_send = (now() - t) / k;
+	printf("%d peers x %lu bytes: bcast %.3f ms %.0f MB/s, sends %.3f ms %.0f MB/s\n",
+	       n, bsize, t_bc * 1e3, n * bsize / t_bc / 1e6,
+	       t_send * 1e3, n * bsize / t_send / 1e6);
+
+	rc = err ? 1 : 0;
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Broadcast and gathered data are identical.\n");
+
+finish:
+	for (i = 0; i < n; i++)
+		veo_udma_peer_fini(peer_id[i]);
+
+	veo_finish();
+	exit(rc);
+}
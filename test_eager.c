@@ -0,0 +1,117 @@
+/*
+  Test of the eager path for tiny transfers.
+
+  Buffers of 1 byte up to beyond the eager limit (UDMA_EAGER_LEN,
+  default 1024) are sent to the VE one by one, partly asynchronously,
+  and received back, both through the eager area and the splits. The
+  round trip latency of a 64 byte message is printed.
+
+  ./test_eager [max_len]
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+int main(int argc, char **argv)
+{
+	int k, rc, peer_id, n = 0;
+	uint64_t ve_buff;
+	char *local_buff, *local_buff2;
+	size_t i, max_len = 2048, len, offs, res;
+	struct veo_udma_req *req = NULL;
+	struct timespec ts, te;
+	double t;
+
+	if (argc == 2)
+		max_len = atol(argv[1]);
+	if (max_len < 1)
+		max_len = 1;
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	/* buffers of all lengths 1 .. max_len, back to back */
+	len = max_len * (max_len + 1) / 2;
+	local_buff = (char *)malloc(len);
+	local_buff2 = (char *)malloc(len);
+	for (i = 0; i < len; i++)
+		local_buff[i] = (char)(i * 13 + 1);
+	memset(local_buff2, 0, len);
+
+	rc = veo_alloc_mem(proc, &ve_buff, len);
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	printf("sending %lu buffers of 1 .. %lu bytes\n", max_len, max_len);
+	for (len = 1, offs = 0; len <= max_len; offs += len, len++) {
+		/* every 3rd one asynchronously, waited for with the next */
+		if (len % 3 == 0) {
+			req = veo_udma_send_async(ctx, local_buff + offs, ve_buff + offs, len);
+			continue;
+		}
+		res = veo_udma_send(ctx, local_buff + offs, ve_buff + offs, len);
+		if (req && veo_udma_wait(req) != len - 1) {
+			printf("async send of %lu bytes failed\n", len - 1);
+			n++;
+		}
+		req = NULL;
+		if (res != len) {
+			printf("send of %lu bytes returned %lu\n", len, res);
+			n++;
+		}
+	}
+	if (req)
+		veo_udma_wait(req);
+
+	for (len = 1, offs = 0; len <= max_len; offs += len, len++) {
+		res = veo_udma_recv(ctx, ve_buff + offs, local_buff2 + offs, len);
+		if (res != len) {
+			printf("recv of %lu bytes returned %lu\n", len, res);
+			n++;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (k = 0; k < 1000; k++) {
+		veo_udma_send(ctx, local_buff, ve_buff, 64);
+		veo_udma_recv(ctx, ve_buff, local_buff2, 64);
+	}
+	clock_gettime(CLOCK_REALTIME, &te);
+	t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+	printf("64 byte round trip: %.1f us\n", t / k * 1e6);
+
+	rc = n ? 1 : memcmp(local_buff, local_buff2, max_len * (max_len + 1) / 2) != 0;
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
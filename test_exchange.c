@@ -0,0 +1,128 @@
+/*
+  Test of the full duplex exchange.
+
+  A buffer is received from the VE while another one is sent to it in
+  the same veo_udma_exchange() call, for several lengths up to len. Both
+  directions are verified. The time of an exchange is compared with a
+  send followed by a receive of the same lengths.
+
+  ./test_exchange [len]
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int k, rc, peer_id, n = 0;
+	uint64_t ve_a, ve_b;
+	char *buff_a, *buff_b, *buff_c;
+	size_t i, max_len = 32 * 1024 * 1024, len, res;
+	size_t lens[] = {4096, 100000, 2 * 1024 * 1024 + 17, 0};
+	double t, t_ex, t_seq;
+
+	if (argc == 2)
+		max_len = atol(argv[1]);
+	if (max_len < 1)
+		max_len = 1;
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	buff_a = (char *)malloc(max_len);
+	buff_b = (char *)malloc(max_len);
+	buff_c = (char *)malloc(max_len);
+	for (i = 0; i < max_len; i++) {
+		buff_a[i] = (char)(i * 13 + 1);
+		buff_b[i] = (char)(i * 7 + 5);
+	}
+
+	rc = veo_alloc_mem(proc, &ve_a, max_len);
+	rc |= veo_alloc_mem(proc, &ve_b, max_len);
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	/* A goes to the VE first, then comes back while B is sent */
+	lens[3] = max_len;
+	for (k = 0; k < 4; k++) {
+		len = MIN(lens[k], max_len);
+		if (veo_udma_send(ctx, buff_a, ve_a, len) != len) {
+			printf("send of %lu bytes failed\n", len);
+			n++;
+			continue;
+		}
+		memset(buff_c, 0, len);
+		res = veo_udma_exchange(ctx, buff_b, ve_b, len, ve_a, buff_c, len);
+		if (res != 2 * len) {
+			printf("exchange of %lu bytes returned %lu\n", len, res);
+			n++;
+		} else if (memcmp(buff_a, buff_c, len)) {
+			printf("exchange of %lu bytes: received data differs\n", len);
+			n++;
+		}
+		memset(buff_c, 0, len);
+		if (veo_udma_recv(ctx, ve_b, buff_c, len) != len
+		    || memcmp(buff_b, buff_c, len)) {
+			printf("exchange of %lu bytes: sent data differs\n", len);
+			n++;
+		}
+	}
+
+	/* one sided exchanges */
+	res = veo_udma_exchange(ctx, buff_b, ve_b, 0, ve_a, buff_c, 4096);
+	res += veo_udma_exchange(ctx, buff_b, ve_b, 4096, ve_a, buff_c, 0);
+	if (res != 8192) {
+		printf("one sided exchanges returned %lu\n", res);
+		n++;
+	}
+
+	t = now();
+	for (k = 0; k < 4; k++)
+		veo_udma_exchange(ctx, buff_b, ve_b, max_len, ve_a, buff_c, max_len);
+	t_ex = (now() - t) / k;
+	t = now();
+	for (k = 0; k < 4; k++) {
+		veo_udma_send(ctx, buff_b, ve_b, max_len);
+		veo_udma_recv(ctx, ve_a, buff_c, max_len);
+	}
+	t_seq = (now() - t) / k;
+	printf("2 x %lu bytes: exchange %.3f ms %.1f MB/s, send+recv %.3f ms %.1f MB/s\n",
+	       max_len, t_ex * 1e3, 2 * max_len / t_ex / 1e6,
+	       t_seq * 1e3, 2 * max_len / t_seq / 1e6);
+
+	rc = n ? 1 : 0;
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Exchanged data is identical with the sent buffers.\n");
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
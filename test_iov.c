@@ -0,0 +1,114 @@
+/*
+  Test of the vectored transfers veo_udma_sendv / veo_udma_recvv.
+
+  Many segments of different lengths are sent to VE addresses in reverse
+  order and received back into a cleared buffer. More segments than
+  UDMA_MAX_IOV are used, so they are sent in several batches.
+
+  ./test_iov [num_segments]
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+int main(int argc, char **argv)
+{
+	int k, rc, peer_id, nseg = 5000;
+	uint64_t ve_buff;
+	char *local_buff, *local_buff2;
+	size_t i, bsize = 0, offs, res, len;
+	struct veo_udma_iov *iov;
+	struct timespec ts, te;
+	double t;
+
+	if (argc == 2)
+		nseg = atoi(argv[1]);
+	if (nseg < 1)
+		nseg = 1;
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	/* segment lengths 0 .. 8kB, every 1000th one 1MB, with gaps */
+	iov = (struct veo_udma_iov *)malloc(nseg * sizeof(struct veo_udma_iov));
+	for (k = 0; k < nseg; k++) {
+		iov[k].len = k % 1000 == 999 ? 1024 * 1024 : (k * 7919) % 8192;
+		bsize += iov[k].len + 64;
+	}
+	local_buff = (char *)malloc(bsize);
+	local_buff2 = (char *)malloc(bsize);
+	for (i = 0; i < bsize; i++)
+		local_buff[i] = (char)(i * 13 + 1);
+	memset(local_buff2, 0, bsize);
+
+	rc = veo_alloc_mem(proc, &ve_buff, bsize);
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+	for (k = 0, offs = 0; k < nseg; k++) {
+		iov[k].hp = local_buff + offs;
+		offs += iov[k].len + 64;
+		/* VE side in reverse order */
+		iov[k].vp = ve_buff + bsize - offs;
+	}
+
+	printf("calling veo_udma_sendv with %d segments\n", nseg);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	res = veo_udma_sendv(ctx, iov, nseg);
+	clock_gettime(CLOCK_REALTIME, &te);
+	t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+	printf("veo_udma_sendv returned %lu, %.0f MB/s\n", res, res / t / 1e6);
+
+	for (k = 0; k < nseg; k++)
+		iov[k].hp = local_buff2 + ((char *)iov[k].hp - local_buff);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	res = veo_udma_recvv(ctx, iov, nseg);
+	clock_gettime(CLOCK_REALTIME, &te);
+	t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+	printf("veo_udma_recvv returned %lu, %.0f MB/s\n", res, res / t / 1e6);
+
+	rc = 0;
+	for (k = 0, offs = 0; k < nseg && rc == 0; k++) {
+		len = iov[k].len;
+		for (i = 0; i < len + 64; i++) {
+			if (local_buff2[offs + i] != (i < len ? local_buff[offs + i] : 0)) {
+				printf("segment %d: wrong data at %lu\n", k, i);
+				rc = 1;
+				break;
+			}
+		}
+		offs += len + 64;
+	}
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
@@ -0,0 +1,177 @@
+/*
+  Several thread contexts of one proc as UDMA peers. One host thread
+  per context creates its peer and then sends and receives its part of
+  a buffer with the blocking calls, all threads at the same time. Each
+  thread checks the data it got back. Finally the whole buffer is
+  striped over all peers.
+
+  ./test_multi [num_contexts [buffer size]]
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+#define MAX_CTX 8
+#define NREP 4
+
+struct veo_thr_ctxt *ctxs[MAX_CTX];
+int nctx = 4;
+int peer_id[MAX_CTX];
+int thr_rc[MAX_CTX];
+pthread_barrier_t barrier;
+long *local_buff, *local_buff2;
+uint64_t ve_buff;
+size_t chunk;
+
+void *peer_thread(void *arg)
+{
+	long k = (long)arg;
+	size_t i, res, off = k * chunk, len = chunk * sizeof(long);
+	int r, k2;
+
+	peer_id[k] = veo_udma_peer_init(ve_node_number, proc, ctxs[k], handle);
+	pthread_barrier_wait(&barrier);
+	for (k2 = 0; k2 < nctx; k2++)
+		if (peer_id[k2] < 0)
+			return NULL;
+	for (r = 0; r < NREP; r++) {
+		for (i = 0; i < chunk; i++)
+			local_buff[off + i] = (long)(off + i) * (r + 1);
+		memset(&local_buff2[off], 0, len);
+		res = veo_udma_send(ctxs[k], &local_buff[off], ve_buff + off * sizeof(long), len);
+		if (res != len) {
+			printf("thread %ld: veo_udma_send returned %lu\n", k, res);
+			thr_rc[k] = 1;
+			return NULL;
+		}
+		res = veo_udma_recv(ctxs[k], ve_buff + off * sizeof(long), &local_buff2[off], len);
+		if (res != len) {
+			printf("thread %ld: veo_udma_recv returned %lu\n", k, res);
+			thr_rc[k] = 1;
+			return NULL;
+		}
+		for (i = 0; i < chunk; i++) {
+			if (local_buff2[off + i] != local_buff[off + i]) {
+				printf("thread %ld: wrong data at %lu in round %d\n", k, i, r);
+				thr_rc[k] = 1;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int k, rc;
+	pthread_t thr[MAX_CTX];
+	size_t i, bsize = 16 * 1024 * 1024, res;
+	struct timespec ts, te;
+	double t;
+
+	if (argc > 1)
+		nctx = atoi(argv[1]);
+	if (nctx < 1 || nctx > MAX_CTX)
+		nctx = 4;
+	if (argc > 2)
+		bsize = atol(argv[2]);
+	bsize = bsize / sizeof(long) / nctx * nctx;
+	chunk = bsize / nctx;
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+	ctxs[0] = ctx;
+	for (k = 1; k < nctx; k++) {
+		ctxs[k] = veo_context_open(proc);
+		if (ctxs[k] == NULL) {
+			perror("ERROR: veo_context_open");
+			exit(1);
+		}
+	}
+
+	local_buff = (long *)malloc(bsize * sizeof(long));
+	local_buff2 = (long *)malloc(bsize * sizeof(long));
+	rc = veo_alloc_mem(proc, &ve_buff, bsize * sizeof(long));
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		exit(1);
+	}
+
+	/* the threads create their peers, then all transfer at once */
+	pthread_barrier_init(&barrier, NULL, nctx + 1);
+	for (k = 0; k < nctx; k++)
+		pthread_create(&thr[k], NULL, peer_thread, (void *)(long)k);
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (k = 0; k < nctx; k++)
+		pthread_join(thr[k], NULL);
+	clock_gettime(CLOCK_REALTIME, &te);
+	pthread_barrier_destroy(&barrier);
+	for (k = 0; k < nctx; k++) {
+		if (peer_id[k] < 0) {
+			printf("veo_udma_peer_init failed for context %d, rc=%d\n",
+			       k, peer_id[k]);
+			exit(1);
+		}
+		if (thr_rc[k])
+			rc = 1;
+	}
+	t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+	printf("send+recv with %d threads: rc=%d bw=%.0f MB/s\n", nctx, rc,
+	       2.0 * NREP * bsize * sizeof(long) / t / 1e6);
+	if (rc) {
+		printf("Verify error: buffer contains wrong data\n");
+		goto finish;
+	}
+
+	/* striped over all peers, stripes adapt to the measured throughput */
+	memset(local_buff2, 0, bsize * sizeof(long));
+	for (k = 0; k < 3; k++) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		res = veo_udma_send_striped(nctx, peer_id, local_buff, ve_buff,
+					    bsize * sizeof(long));
+		clock_gettime(CLOCK_REALTIME, &te);
+		t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+		printf("send_striped: %lu bytes bw=%.0f MB/s\n", res,
+		       bsize * sizeof(long) / t / 1e6);
+	}
+	for (k = 0; k < 3; k++) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		res = veo_udma_recv_striped(nctx, peer_id, ve_buff, local_buff2,
+					    bsize * sizeof(long));
+		clock_gettime(CLOCK_REALTIME, &te);
+		t = (te.tv_sec - ts.tv_sec) + (te.tv_nsec - ts.tv_nsec) / 1e9;
+		printf("recv_striped: %lu bytes bw=%.0f MB/s\n", res,
+		       bsize * sizeof(long) / t / 1e6);
+	}
+	for (i = 0; i < bsize; i++) {
+		if (local_buff[i] != local_buff2[i]) {
+			rc = 1;
+			break;
+		}
+	}
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+
+finish:
+	for (k = 0; k < nctx; k++)
+		veo_udma_peer_fini(peer_id[k]);
+	for (k = 1; k < nctx; k++)
+		veo_context_close(ctxs[k]);
+
+	veo_finish();
+	exit(rc);
+}
@@ -92,7 +92,6 @@ int main(int argc, char **argv)
 
 	/*
 	  Initialize this contaxt as VEO UDMA communication peer.
-	  NOTE: currently only one context per proc is supported!
 	*/
 	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
 	if (peer_id < 0) {
@@ -162,10 +161,34 @@ int main(int argc, char **argv)
 	else
 		printf("Received data is identical with the sent buffer.\n");
 
+	/* a pack fitting into one split leaves the context free until the commit */
+	if (rc == 0) {
+		uint64_t req, retval;
+		struct veo_args *argp = veo_args_alloc();
+
+		for (i = 0; i < 64; i++)
+			local_buff[i] = -(long)i;
+		res = veo_udma_send_pack(peer_id, local_buff, ve_buff, 64 * sizeof(long));
+		req = veo_call_async(ctx, veo_get_sym(proc, handle, "ve_udma_usrcc"), argp);
+		if (res != 0 || veo_call_wait_result(ctx, req, &retval) != VEO_COMMAND_OK
+		    || veo_udma_send_pack_commit(peer_id) != 0) {
+			printf("VE call between send pack and commit failed\n");
+			rc = 1;
+		}
+		veo_args_free(argp);
+		res = veo_udma_recv(ctx, ve_buff, local_buff2, 64 * sizeof(long));
+		for (i = 0; i < 64 && rc == 0; i++) {
+			if (local_buff[i] != local_buff2[i]) {
+				printf("Verify error: pack around a VE call has wrong data\n");
+				rc = 1;
+			}
+		}
+	}
+
 finish:
 	veo_udma_peer_fini(peer_id);
 
 	veo_finish();
-	exit(0);
+	exit(rc);
 }
 
@@ -0,0 +1,164 @@
+/*
+  Test of the strided transfers veo_udma_send_strided / veo_udma_recv_strided.
+
+  A sub-block of a 3D array is sent to a dense VE buffer and received
+  back into a cleared array, then a block with every second element in
+  x is scattered into a 3D array on the VE and gathered back.
+
+  ./test_strided [N]
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+#define IDX(x, y, z) ((x) + N * ((y) + N * (size_t)(z)))
+
+int main(int argc, char **argv)
+{
+	int rc, x, y, z, N = 128;
+	int x0 = 8, y0 = 4, z0 = 2, bx, by, bz, peer_id;
+	uint64_t ve_buff, ve_arr;
+	long *arr, *arr2, *blk;
+	size_t asize, res, counts[3], hstrides[3], vstrides[3];
+
+	if (argc == 2)
+		N = atoi(argv[1]);
+	if (N < 16)
+		N = 16;
+	bx = N - 2 * x0;
+	by = N - 2 * y0;
+	bz = N / 2;
+	asize = (size_t)N * N * N * sizeof(long);
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	arr = (long *)malloc(asize);
+	arr2 = (long *)malloc(asize);
+	blk = (long *)malloc((size_t)bx * by * bz * sizeof(long));
+	for (z = 0; z < N; z++)
+		for (y = 0; y < N; y++)
+			for (x = 0; x < N; x++)
+				arr[IDX(x, y, z)] = (long)IDX(x, y, z);
+
+	rc = veo_alloc_mem(proc, &ve_buff, (size_t)bx * by * bz * sizeof(long));
+	rc |= veo_alloc_mem(proc, &ve_arr, asize);
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	/* rows of bx elements, strided in y and z on VH, dense on VE */
+	counts[0] = by;
+	counts[1] = bz;
+	hstrides[0] = N * sizeof(long);
+	hstrides[1] = (size_t)N * N * sizeof(long);
+	printf("calling veo_udma_send_strided, block %dx%dx%d\n", bx, by, bz);
+	res = veo_udma_send_strided(ctx, &arr[IDX(x0, y0, z0)], hstrides, ve_buff, NULL,
+				    bx * sizeof(long), 2, counts);
+	printf("veo_udma_send_strided returned %lu\n", res);
+	res = veo_udma_recv(ctx, ve_buff, blk, (size_t)bx * by * bz * sizeof(long));
+	for (z = 0; z < bz && rc == 0; z++)
+		for (y = 0; y < by && rc == 0; y++)
+			for (x = 0; x < bx; x++)
+				if (blk[x + bx * (y + by * (size_t)z)] !=
+				    arr[IDX(x0 + x, y0 + y, z0 + z)]) {
+					printf("gather error at %d,%d,%d\n", x, y, z);
+					rc = 1;
+					break;
+				}
+
+	printf("calling veo_udma_recv_strided\n");
+	memset(arr2, 0, asize);
+	res = veo_udma_recv_strided(ctx, ve_buff, NULL, &arr2[IDX(x0, y0, z0)], hstrides,
+				    bx * sizeof(long), 2, counts);
+	printf("veo_udma_recv_strided returned %lu\n", res);
+	for (z = 0; z < N && rc == 0; z++)
+		for (y = 0; y < N && rc == 0; y++)
+			for (x = 0; x < N; x++) {
+				int in = x >= x0 && x < x0 + bx && y >= y0 && y < y0 + by
+					&& z >= z0 && z < z0 + bz;
+				if (arr2[IDX(x, y, z)] != (in ? arr[IDX(x, y, z)] : 0)) {
+					printf("scatter error at %d,%d,%d\n", x, y, z);
+					rc = 1;
+					break;
+				}
+			}
+
+	/* single longs, every second one in x, strided on both sides */
+	counts[0] = bx / 2;
+	counts[1] = by;
+	counts[2] = bz;
+	hstrides[0] = 2 * sizeof(long);
+	hstrides[1] = N * sizeof(long);
+	hstrides[2] = (size_t)N * N * sizeof(long);
+	memcpy(vstrides, hstrides, sizeof(vstrides));
+	printf("calling veo_udma_send_strided and veo_udma_recv_strided, 3D\n");
+	res = veo_udma_send_strided(ctx, &arr[IDX(x0, y0, z0)], hstrides,
+				    ve_arr + IDX(x0, y0, z0) * sizeof(long), vstrides,
+				    sizeof(long), 3, counts);
+	memset(arr2, 0, asize);
+	res = veo_udma_recv_strided(ctx, ve_arr + IDX(x0, y0, z0) * sizeof(long), vstrides,
+				    &arr2[IDX(x0, y0, z0)], hstrides, sizeof(long), 3, counts);
+	printf("veo_udma_recv_strided returned %lu\n", res);
+	for (z = z0; z < z0 + bz && rc == 0; z++)
+		for (y = y0; y < y0 + by && rc == 0; y++)
+			for (x = x0; x < x0 + bx; x++) {
+				if (arr2[IDX(x, y, z)] != ((x - x0) % 2 ? 0 : arr[IDX(x, y, z)])) {
+					printf("3D error at %d,%d,%d\n", x, y, z);
+					rc = 1;
+					break;
+				}
+			}
+
+	/* an empty sub-array is a no-op, overlapping rows are rejected */
+	counts[0] = 0;
+	res = veo_udma_send_strided(ctx, &arr[IDX(x0, y0, z0)], hstrides,
+				    ve_arr, NULL, sizeof(long), 3, counts);
+	if (res != 0) {
+		printf("empty veo_udma_send_strided returned %lu\n", res);
+		rc = 1;
+	}
+	counts[0] = by;
+	counts[1] = bz;
+	hstrides[0] = bx * sizeof(long) / 2;
+	printf("overlapping rows, expect an invalid layout error\n");
+	res = veo_udma_send_strided(ctx, &arr[IDX(x0, y0, z0)], hstrides,
+				    ve_arr, NULL, bx * sizeof(long), 2, counts);
+	if (res != 0) {
+		printf("overlapping veo_udma_send_strided returned %lu\n", res);
+		rc = 1;
+	}
+
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
@@ -0,0 +1,91 @@
+/*
+  VEO setup shared by the test programs and tools: a proc on
+  VE_NODE_NUMBER with libveo_udma_ve.so loaded and one context on it.
+  Also the size argument parser of the tools.
+ */
+#ifndef TEST_VEO_INCLUDE
+#define TEST_VEO_INCLUDE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ve_offload.h>
+
+static int ve_node_number = 0;
+static struct veo_proc_handle *proc = NULL;
+static struct veo_thr_ctxt *ctx = NULL;
+static uint64_t handle = 0;
+
+static int veo_init(void)
+{
+	char *env;
+
+	env = getenv("VE_NODE_NUMBER");
+	if (env)
+		ve_node_number = atoi(env);
+
+#ifdef VEO_STATIC
+	proc = veo_proc_create_static(ve_node_number, "./veorun_static");
+#else
+	proc = veo_proc_create(ve_node_number);
+#endif
+	if (proc == NULL) {
+		perror("ERROR: veo_proc_create");
+		return -1;
+	}
+
+#ifdef VEO_STATIC
+#ifdef VEO_DEBUG
+	printf("If you want to attach to the VE process, you now have 20s!\n\n"
+	       "/opt/nec/ve/bin/gdb -p %d veorun_static\n\n", getpid());
+	sleep(20);
+#endif
+	handle = 0;
+#else
+	handle = veo_load_library(proc, "./libveo_udma_ve.so");
+	if (handle == 0) {
+		perror("ERROR: veo_load_library");
+		return -1;
+	}
+#endif
+
+	ctx = veo_context_open(proc);
+	if (ctx == NULL) {
+		perror("ERROR: veo_context_open");
+		return -1;
+	}
+	return 0;
+}
+
+static int veo_finish(void)
+{
+	veo_context_close(ctx);
+	veo_proc_destroy(proc);
+	return 0;
+}
+
+/*
+  Parse a size with an optional k/M/G suffix into *v.
+
+  Returns 0 if successful, -1 if s is not a size.
+*/
+static inline int parse_size(const char *s, size_t *v)
+{
+	char *e;
+	unsigned long n;
+
+	if (*s < '0' || *s > '9')
+		return -1;
+	n = strtoul(s, &e, 10);
+	switch (*e) {
+	case 'k': case 'K': n <<= 10; e++; break;
+	case 'm': case 'M': n <<= 20; e++; break;
+	case 'g': case 'G': n <<= 30; e++; break;
+	}
+	if (*e != '\0')
+		return -1;
+	*v = n;
+	return 0;
+}
+
+#endif /* TEST_VEO_INCLUDE */
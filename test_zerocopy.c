@@ -0,0 +1,100 @@
+/*
+  Test of zero-copy transfers from and to host buffers allocated
+  with veo_udma_alloc_host().
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+int main(int argc, char **argv)
+{
+	int rc, peer_id;
+	uint64_t ve_buff;
+	long *local_buff, *local_buff2, *local_buff3;
+	size_t i, bsize = 4 * 1024 * 1024, res;
+
+	if (argc == 2)
+		bsize = atol(argv[1]);
+	bsize = bsize / sizeof(long);
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	local_buff = (long *)veo_udma_alloc_host(peer_id, bsize * sizeof(long));
+	local_buff2 = (long *)veo_udma_alloc_host(peer_id, bsize * sizeof(long));
+	local_buff3 = (long *)malloc(bsize * sizeof(long));
+	if (!local_buff || !local_buff2) {
+		printf("veo_udma_alloc_host failed\n");
+		rc = 1;
+		goto finish;
+	}
+	for (i = 0; i < bsize; i++)
+		local_buff[i] = (long)i;
+	memset(local_buff2, 0, bsize * sizeof(long));
+	memset(local_buff3, 0, bsize * sizeof(long));
+
+	rc = veo_alloc_mem(proc, &ve_buff, bsize * sizeof(long));
+	if (rc != 0) {
+		printf("veo_alloc_mem failed with rc=%d\n", rc);
+		goto finish;
+	}
+
+	printf("calling veo_udma_send from host pool buffer\n");
+	res = veo_udma_send(ctx, local_buff, ve_buff, bsize * sizeof(long));
+	printf("veo_udma_send returned: %lu\n", res);
+	printf("calling veo_udma_recv into host pool buffer\n");
+	res = veo_udma_recv(ctx, ve_buff, local_buff2, bsize * sizeof(long));
+	printf("veo_udma_recv returned: %lu\n", res);
+	printf("calling veo_udma_recv into malloced buffer\n");
+	res = veo_udma_recv(ctx, ve_buff, local_buff3, bsize * sizeof(long));
+	printf("veo_udma_recv returned: %lu\n", res);
+
+	rc = 0;
+	for (i = 0; i < bsize; i++) {
+		if (local_buff[i] != local_buff2[i] || local_buff[i] != local_buff3[i]) {
+			rc = 1;
+			break;
+		}
+	}
+	if (rc)
+		printf("Verify error: buffer contains wrong data\n");
+	else
+		printf("Received data is identical with the sent buffer.\n");
+
+	veo_udma_free_host(peer_id, local_buff2);
+	veo_udma_free_host(peer_id, local_buff);
+	/* freed blocks are merged again */
+	local_buff = (long *)veo_udma_alloc_host(peer_id, 2 * bsize * sizeof(long));
+	if (!local_buff) {
+		printf("veo_udma_alloc_host after free failed\n");
+		rc = 1;
+	} else
+		veo_udma_free_host(peer_id, local_buff);
+
+finish:
+	veo_udma_peer_fini(peer_id);
+
+	veo_finish();
+	exit(rc);
+}
@@ -0,0 +1,398 @@
+/*
+  Benchmark of VH <-> VE transfers. Sweeps transfer sizes, directions,
+  APIs, split settings and pack entry sizes inside one VE process. Each
+  point is warmed up, its data is verified once, then each repetition is
+  timed separately and min, median, p99 and mean are reported.
+
+  ./udma_bench [options]
+    -s sizes    transfer sizes, k/M/G suffixes (1,1k,64k,1M,16M,64M)
+    -d dirs     send (VH -> VE), recv (VE -> VH) (send,recv)
+    -a apis     udma: veo_udma_send/recv, veo: veo_write_mem/read_mem,
+                pack: veo_udma_{send,recv}_pack + commit (udma,veo)
+    -S splits   udma split settings, auto or <count>x<split size> (auto)
+    -p entries  pack entry sizes (64,1k,16k)
+    -w n        warm-up transfers per point (2)
+    -r n        timed repetitions per point, 0: by size (0)
+    -f format   text, csv or json (text)
+    -o file     write the results to file instead of stdout
+
+  Exits with 1 if a transfer failed or delivered wrong data.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+#define MAX_LIST 256
+
+enum { API_UDMA, API_VEO, API_PACK };
+static const char *api_name[] = {"udma", "veo", "pack"};
+static const char *dir_name[] = {"send", "recv"};
+
+static int peer_id;
+
+struct result {
+	int api, dir;
+	size_t size;
+	int split;		// 0: auto
+	size_t split_size;
+	size_t entry;		// pack entry size, 0: no pack
+	int reps;
+	double min, median, p99, mean;	// [us]
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static int parse_sizes(char *arg, size_t *v)
+{
+	int n = 0;
+	char *t;
+
+	for (t = strtok(arg, ","); t && n < MAX_LIST; t = strtok(NULL, ",")) {
+		if (parse_size(t, &v[n++]) != 0) {
+			fprintf(stderr, "invalid size: %s\n", t);
+			exit(2);
+		}
+	}
+	return n;
+}
+
+/* comma separated names out of names[0..num-1], returns a bit mask */
+static int parse_names(char *arg, const char **names, int num)
+{
+	int i, mask = 0;
+	char *t;
+
+	for (t = strtok(arg, ","); t; t = strtok(NULL, ",")) {
+		for (i = 0; i < num; i++)
+			if (strcmp(t, names[i]) == 0)
+				break;
+		if (i == num) {
+			fprintf(stderr, "unknown value: %s\n", t);
+			exit(2);
+		}
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+static int parse_splits(char *arg, int *split, size_t *size)
+{
+	int n = 0;
+	char *t, *x;
+
+	for (t = strtok(arg, ","); t && n < MAX_LIST; t = strtok(NULL, ",")) {
+		if (strcmp(t, "auto") == 0) {
+			split[n] = 0;
+			size[n++] = 0;
+			continue;
+		}
+		if ((x = strchr(t, 'x')) == NULL) {
+			fprintf(stderr, "split setting must be auto or <count>x<size>: %s\n", t);
+			exit(2);
+		}
+		split[n] = atoi(t);
+		if (parse_size(x + 1, &size[n++]) != 0) {
+			fprintf(stderr, "invalid split size: %s\n", t);
+			exit(2);
+		}
+	}
+	return n;
+}
+
+/*
+  One transfer of len bytes between hp and vp. Pack transfers move len
+  bytes in entries of entry bytes and commit them.
+
+  Returns 0 if successful.
+*/
+static int xfer(int api, int dir, char *hp, uint64_t vp, size_t len, size_t entry)
+{
+	size_t off, n;
+
+	switch (api) {
+	case API_UDMA:
+		if (dir == 0)
+			return veo_udma_send(ctx, hp, vp, len) != len;
+		return veo_udma_recv(ctx, vp, hp, len) != len;
+	case API_VEO:
+		if (dir == 0)
+			return veo_write_mem(proc, vp, hp, len);
+		return veo_read_mem(proc, hp, vp, len);
+	case API_PACK:
+		for (off = 0; off < len; off += n) {
+			n = len - off < entry ? len - off : entry;
+			if ((dir == 0 ? veo_udma_send_pack(peer_id, hp + off, vp + off, n)
+			     : veo_udma_recv_pack(peer_id, vp + off, hp + off, n)) != 0)
+				return 1;
+		}
+		return dir == 0 ? veo_udma_send_pack_commit(peer_id)
+			: veo_udma_recv_pack_commit(peer_id);
+	}
+	return 1;
+}
+
+static void fill(char *p, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (char)(i * 7 + seed);
+}
+
+/*
+  Move a pattern through the transfer under test and check it on the
+  other side with plain VEO transfers.
+*/
+static int verify(int api, int dir, char *hp, char *tmp, uint64_t vp, size_t len,
+		  size_t entry, unsigned seed)
+{
+	fill(tmp, len, seed);
+	if (dir == 0) {
+		memcpy(hp, tmp, len);
+		if (xfer(api, dir, hp, vp, len, entry))
+			return 1;
+		memset(hp, 0, len);
+		if (veo_read_mem(proc, hp, vp, len))
+			return 1;
+	} else {
+		if (veo_write_mem(proc, vp, tmp, len))
+			return 1;
+		memset(hp, 0, len);
+		if (xfer(api, dir, hp, vp, len, entry))
+			return 1;
+	}
+	return memcmp(hp, tmp, len) != 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void stats(struct result *r, double *t)
+{
+	int i, k;
+	double sum = 0.0;
+
+	qsort(t, r->reps, sizeof(double), cmp_double);
+	for (i = 0; i < r->reps; i++)
+		sum += t[i];
+	r->min = t[0];
+	r->median = r->reps & 1 ? t[r->reps / 2]
+		: (t[r->reps / 2 - 1] + t[r->reps / 2]) / 2.0;
+	k = (99 * r->reps + 99) / 100 - 1;	// nearest rank
+	r->p99 = t[k];
+	r->mean = sum / r->reps;
+}
+
+static double mbs(struct result *r)
+{
+	return r->median > 0.0 ? r->size / r->median : 0.0;
+}
+
+static void print_head(FILE *f, int format)
+{
+	char host[256] = "";
+
+	gethostname(host, sizeof(host) - 1);
+	if (format == 0)
+		fprintf(f, "# %s VE%d\n%-5s %-5s %10s %12s %6s %6s %10s %10s %10s %10s %9s\n",
+			host, ve_node_number, "api", "dir", "size", "split", "entry",
+			"reps", "min_us", "median_us", "p99_us", "mean_us", "MB/s");
+	else if (format == 1)
+		fprintf(f, "api,dir,size,split,split_size,entry,reps,"
+			"min_us,median_us,p99_us,mean_us,mb_s\n");
+	else
+		fprintf(f, "{\"host\":\"%s\",\"ve_node\":%d,\"time\":%ld,\"results\":[",
+			host, ve_node_number, (long)time(NULL));
+}
+
+static void print_result(FILE *f, int format, struct result *r, int first)
+{
+	char sp[32];
+
+	if (format == 0) {
+		if (r->split)
+			snprintf(sp, sizeof(sp), "%dx%lu", r->split, r->split_size);
+		else
+			snprintf(sp, sizeof(sp), "%s", r->api == API_UDMA ? "auto" : "-");
+		fprintf(f, "%-5s %-5s %10lu %12s %6lu %6d %10.2f %10.2f %10.2f %10.2f %9.1f\n",
+			api_name[r->api], dir_name[r->dir], r->size, sp, r->entry, r->reps,
+			r->min, r->median, r->p99, r->mean, mbs(r));
+	} else if (format == 1)
+		fprintf(f, "%s,%s,%lu,%d,%lu,%lu,%d,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+			api_name[r->api], dir_name[r->dir], r->size, r->split, r->split_size,
+			r->entry, r->reps, r->min, r->median, r->p99, r->mean, mbs(r));
+	else
+		fprintf(f, "%s\n{\"api\":\"%s\",\"dir\":\"%s\",\"size\":%lu,\"split\":%d,"
+			"\"split_size\":%lu,\"entry\":%lu,\"reps\":%d,\"min_us\":%.3f,"
+			"\"median_us\":%.3f,\"p99_us\":%.3f,\"mean_us\":%.3f,\"mb_s\":%.1f}",
+			first ? "" : ",", api_name[r->api], dir_name[r->dir], r->size,
+			r->split, r->split_size, r->entry, r->reps, r->min, r->median,
+			r->p99, r->mean, mbs(r));
+	fflush(f);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, k, d, a, s, e, rc = 0, err = 0, first = 1;
+	int apis = (1 << API_UDMA) | (1 << API_VEO), dirs = 3;
+	int nsize, nsplit = 1, nentry, warmup = 2, reps = 0, format = 0;
+	size_t sizes[MAX_LIST], entries[MAX_LIST], split_sizes[MAX_LIST] = {0};
+	size_t max_size = 0;
+	int splits[MAX_LIST] = {0};
+	char def_sizes[] = "1,1k,64k,1M,16M,64M", def_entries[] = "64,1k,16k";
+	char *hp, *tmp, *out = NULL;
+	double *t;
+	uint64_t vp, t0;
+	FILE *f = stdout;
+	struct result r;
+	static const char *formats[] = {"text", "csv", "json"};
+
+	nsize = parse_sizes(def_sizes, sizes);
+	nentry = parse_sizes(def_entries, entries);
+	while ((c = getopt(argc, argv, "s:d:a:S:p:w:r:f:o:h")) != -1) {
+		switch (c) {
+		case 's': nsize = parse_sizes(optarg, sizes); break;
+		case 'd': dirs = parse_names(optarg, dir_name, 2); break;
+		case 'a': apis = parse_names(optarg, api_name, 3); break;
+		case 'S': nsplit = parse_splits(optarg, splits, split_sizes); break;
+		case 'p': nentry = parse_sizes(optarg, entries); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'f':
+			for (format = 2; format >= 0; format--)
+				if (strcmp(optarg, formats[format]) == 0)
+					break;
+			if (format < 0) {
+				fprintf(stderr, "unknown format: %s\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'o': out = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-s sizes] [-d send,recv] [-a udma,veo,pack]"
+				" [-S auto,<n>x<size>] [-p entries] [-w warmup] [-r reps]"
+				" [-f text|csv|json] [-o file]\n", argv[0]);
+			exit(2);
+		}
+	}
+	for (i = 0; i < nsize; i++)
+		if (sizes[i] > max_size)
+			max_size = sizes[i];
+	if (nsize == 0 || max_size == 0) {
+		fprintf(stderr, "no transfer sizes\n");
+		exit(2);
+	}
+
+	if (veo_init() != 0)
+		exit(1);
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed with rc=%d\n", peer_id);
+		exit(1);
+	}
+	hp = (char *)malloc(max_size);
+	tmp = (char *)malloc(max_size);
+	t = (double *)malloc((reps > 1000 ? reps : 1000) * sizeof(double));
+	if (hp == NULL || tmp == NULL || t == NULL) {
+		printf("malloc failed\n");
+		rc = 1;
+		goto finish;
+	}
+	memset(hp, 0, max_size);
+	if (veo_alloc_mem(proc, &vp, max_size) != 0) {
+		printf("veo_alloc_mem failed\n");
+		rc = 1;
+		goto finish;
+	}
+	if (out && (f = fopen(out, "w")) == NULL) {
+		perror(out);
+		rc = 1;
+		goto finish;
+	}
+
+	print_head(f, format);
+	for (a = 0; a < 3; a++) {
+		if (!(apis & (1 << a)))
+			continue;
+		for (d = 0; d < 2; d++) {
+			if (!(dirs & (1 << d)))
+				continue;
+			for (s = 0; s < (a == API_UDMA ? nsplit : 1); s++) {
+				if (a == API_UDMA
+				    && veo_udma_peer_set_split(peer_id, d == 0 ? splits[s] : -1,
+							       split_sizes[s],
+							       d == 1 ? splits[s] : -1,
+							       split_sizes[s]) != 0) {
+					err++;
+					continue;
+				}
+				for (e = 0; e < (a == API_PACK ? nentry : 1); e++) {
+					for (i = 0; i < nsize; i++) {
+						memset(&r, 0, sizeof(r));
+						r.api = a;
+						r.dir = d;
+						r.size = sizes[i];
+						if (a == API_UDMA) {
+							r.split = splits[s];
+							r.split_size = split_sizes[s];
+						}
+						if (a == API_PACK)
+							r.entry = entries[e];
+						r.reps = (int)((256UL << 20) / r.size);
+						r.reps = r.reps < 10 ? 10 : (r.reps > 1000 ? 1000 : r.reps);
+						if (reps > 0)
+							r.reps = reps;
+						for (k = 0; k < warmup; k++)
+							xfer(a, d, hp, vp, r.size, r.entry);
+						if (verify(a, d, hp, tmp, vp, r.size, r.entry, i + 1)) {
+							fprintf(stderr, "%s %s %lu bytes: transfer failed "
+								"or wrong data\n", api_name[a],
+								dir_name[d], r.size);
+							err++;
+							continue;
+						}
+						for (k = 0; k < r.reps; k++) {
+							t0 = now_ns();
+							err += xfer(a, d, hp, vp, r.size, r.entry) != 0;
+							t[k] = (now_ns() - t0) / 1e3;
+						}
+						stats(&r, t);
+						print_result(f, format, &r, first);
+						first = 0;
+					}
+				}
+			}
+		}
+	}
+	veo_udma_peer_set_split(peer_id, 0, 0, 0, 0);
+	if (format == 2)
+		fprintf(f, "\n]}\n");
+	if (f != stdout)
+		fclose(f);
+	if (err) {
+		fprintf(stderr, "%d errors\n", err);
+		rc = 1;
+	}
+
+finish:
+	veo_udma_peer_fini(peer_id);
+	veo_finish();
+	exit(rc);
+}
@@ -0,0 +1,48 @@
+/*
+  Measure the split tables for this host and VE and store them in the
+  cache file loaded by libveo_udma.
+
+  VE_NODE_NUMBER=<n> ./udma_calibrate [max_transfer_size]
+
+  The size takes k/M/G suffixes.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <ve_offload.h>
+#include "veo_udma.h"
+#include "test_veo.h"
+
+int main(int argc, char **argv)
+{
+	int rc, peer_id;
+	size_t max_len = UDMA_CALIB_MAX_LEN;
+
+	if (argc > 1 && (parse_size(argv[1], &max_len) != 0 || max_len == 0)) {
+		fprintf(stderr, "invalid max transfer size: %s\n", argv[1]);
+		exit(2);
+	}
+
+	rc = veo_init();
+	if (rc != 0)
+		exit(1);
+
+	peer_id = veo_udma_peer_init(ve_node_number, proc, ctx, handle);
+	if (peer_id < 0) {
+		printf("veo_udma_peer_init failed, rc=%d\n", peer_id);
+		exit(1);
+	}
+
+	printf("calibrating split tables for VE%d up to %lu bytes\n",
+	       ve_node_number, max_len);
+	rc = veo_udma_calibrate(peer_id, max_len, 1);
+	if (rc)
+		printf("veo_udma_calibrate failed, rc=%d\n", rc);
+
+	veo_udma_peer_fini(peer_id);
+	veo_finish();
+	exit(rc ? 1 : 0);
+}
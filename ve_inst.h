@@ -42,6 +42,45 @@ static inline void ve_inst_shm32(void *vehva, uint32_t value)
     asm ("shm.w %0,0(%1)"::"r"(value),"r"(vehva));
 }
 
+#else /* host emulation, VEHVAs are host addresses */
+#include <sched.h>
+
+static inline void ve_inst_fenceSF(void)
+{
+    __sync_synchronize();
+}
+
+static inline void ve_inst_fenceLF(void)
+{
+    __sync_synchronize();
+    sched_yield();	// let the emulated VH side run on small hosts
+}
+
+static inline void ve_inst_fenceLSF(void)
+{
+    __sync_synchronize();
+}
+
+static inline uint64_t ve_inst_lhm(void *vehva)
+{
+    return *(volatile uint64_t *)vehva;
+}
+
+static inline uint32_t ve_inst_lhm32(void *vehva)
+{
+    return *(volatile uint32_t *)vehva;
+}
+
+static inline void ve_inst_shm(void *vehva, uint64_t value)
+{
+    *(volatile uint64_t *)vehva = value;
+}
+
+static inline void ve_inst_shm32(void *vehva, uint32_t value)
+{
+    *(volatile uint32_t *)vehva = value;
+}
+
 #endif
 #ifdef __cplusplus
 }
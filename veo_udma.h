@@ -4,20 +4,59 @@
 #include <errno.h>
 #include <pthread.h>
 
-#define UDMA_MAX_PROCS 8
-#define UDMA_MAX_PEERS 64
+#define UDMA_MAX_PEERS 64	// initial registry size, shm keys per process
 #define UDMA_MAX_SPLIT 64
-#define UDMA_BUFF_LEN (64 * 1024 * 1024)
+#define UDMA_BUFF_LEN (64 * 1024 * 1024)	// default per-peer half length, UDMA_BUFF_LEN
+#define UDMA_BUFF_MIN (4 * 1024 * 1024)	// smallest per-peer half length
 #define UDMA_PACK_MAX_SEND (UDMA_BUFF_LEN / 2)
 #define UDMA_PACK_MAX_RECV (UDMA_BUFF_LEN / 16)
-#define UDMA_MAX_RECV_PACK 4096
+#define UDMA_MAX_COPY_THREADS 32
+#define UDMA_MAX_NUMA_NODES 1024
+#define UDMA_MAX_DIMS 3		// max dimensions of a strided layout
+#define UDMA_MAX_IOV 4096	// default max segments per VE call, UDMA_MAX_SEGS
+#define UDMA_DESC_SPACE (1024 * 1024)	// shm space for segment descriptors
+#define UDMA_CMD_SPACE 4096	// shm space for the agent command ring
+#define UDMA_CMD_RING 16	// entries of the agent command ring
+#define UDMA_EAGER_SPACE 4096	// shm space per direction for eager transfers
+#define UDMA_EAGER_MAX 1024	// default max eager transfer length, UDMA_EAGER_LEN
+#define UDMA_TRACE_SPACE (64 * 1024)	// shm space for the VE trace events of a call
+#define UDMA_TRACE_MAX (1024 * 1024)	// default max VH trace records, UDMA_TRACE_MAX
+#define UDMA_MBOX_SPACE (UDMA_MAX_SPLIT * sizeof(size_t) + 2 * sizeof(uint64_t))
+#define UDMA_MBOX_DATA UDMA_MAX_SPLIT	// mailbox word with the split offset in a pool
+/* control areas at the end of each half: the send half has descriptors,
+   agent commands, eager area and mailbox, the recv half the VE trace
+   events and the last two */
+#define UDMA_CTL_SEND (UDMA_DESC_SPACE + UDMA_CMD_SPACE + UDMA_EAGER_SPACE + UDMA_MBOX_SPACE)
+#define UDMA_CTL_RECV (UDMA_TRACE_SPACE + UDMA_EAGER_SPACE + UDMA_MBOX_SPACE)
+#define UDMA_POOL_LEN (128 * 1024 * 1024)	// default shared pool size, UDMA_SHARED_LEN
+#define UDMA_POOL_PEERS 16	// default control slots of a pool, UDMA_SHARED_PEERS
+#define UDMA_POOL_MAX_PEERS 64
+#define UDMA_POOL_CHUNK (1024 * 1024)	// split space allocation unit of a pool
+#define UDMA_BCAST_LEN (64 * 1024 * 1024)	// default broadcast segment size, UDMA_BCAST_LEN
+#define UDMA_USRCC_MHZ 1400	// VE usrcc frequency assumed if measuring it fails
+#define UDMA_BW_MIN_LEN (1024 * 1024)	// min transfer size for throughput estimates
+#define UDMA_MAX_TUNE 16	// max entries of a split tuning table
+#define UDMA_CALIB_MIN_LEN (512 * 1024)	// smallest calibrated size class
+#define UDMA_CALIB_MAX_LEN (64 * 1024 * 1024)	// default largest size class
+#define UDMA_CALIB_MIN_SPLIT (64 * 1024)	// smallest calibrated split size
+#define UDMA_ADAPT_MIN_LEN (512 * 1024)	// smallest adapted transfer size
+#define UDMA_ADAPT_BUCKETS 12		// power of 2 size buckets
+#define UDMA_ADAPT_EXPLORE 8		// transfers between trials
+#define UDMA_ADAPT_WEIGHT 0.25		// EWMA weight of a new measurement
+#define UDMA_ADAPT_MARGIN 1.03		// min gain of a trial to switch
 
 #define UDMA_DELAY_PEEK 1
+#define UDMA_WAIT_SPIN_LOOPS 1000	// default idle loops before backing off
+#define UDMA_WAIT_YIELDS 100		// sched_yield loops before sleeping
+#define UDMA_WAIT_SLEEP_US 100		// default max sleep of a backoff
+#define UDMA_WAIT_MIN_SLEEP_NS 1000	// first sleep of a backoff
 #define UDMA_TIMEOUT_US (10 * 1000000)
+#define UDMA_LEN_LAST (1UL << 63)	// mailbox flag: last split of a send pack stream
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define ALIGN8B(x) (((uint64_t)(x) + 7UL) & ~7UL)
+#define ALIGN64B(x) (((uint64_t)(x) + 63UL) & ~63UL)
 
 //#define DEBUG 1
 #ifdef DEBUG
@@ -30,6 +69,65 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+struct tune_split {
+	size_t transfer;	// entry is used for transfers shorter than this
+	size_t size;		// split buffer size
+	int split;		// number of split buffers
+};
+
+enum udma_tune_source {
+	UDMA_TUNE_DEFAULT = 0,	// built-in tables
+	UDMA_TUNE_CACHED,	// loaded from the cache file
+	UDMA_TUNE_CALIBRATED,	// measured in this process
+};
+
+struct udma_tune {
+	int source;		// enum udma_tune_source
+	int num_send, num_recv;
+	struct tune_split send[UDMA_MAX_TUNE];
+	struct tune_split recv[UDMA_MAX_TUNE];
+	struct udma_tune *prev;	// replaced tables, freed with the proc
+};
+
+/*
+  Split pool shared by the peers of a proc. Each peer has a control
+  slot at the start of the segment, the space behind the slots is
+  handed out in chunks to the transfers in flight.
+*/
+struct udma_pool {
+	int key, segid;
+	void *addr;		// local address of the segment
+	size_t size;
+	uint64_t ve_pool;	// struct ve_udma_seg of the pool on VE
+	int nctl;		// control slots
+	uint64_t ctl_used;	// bitmap of used control slots
+	size_t ctl_len;		// length of a control slot
+	size_t data_offs;	// start of the chunks in the segment
+	int nchunks;
+	unsigned char *chunk;	// 1: chunk in use
+	int count;		// peers using the pool
+};
+
+/*
+  Broadcast staging segment, attached by the VE procs of all peers which
+  took part in a broadcast. The data is copied into its splits once and
+  pulled by the DMA engines of all VEs, each VE hands the splits back
+  through its peer's own mailbox.
+*/
+struct udma_bcast {
+	int key, segid;
+	void *addr;		// local address of the segment
+	size_t size;
+	int nattach;		// procs which attached the segment
+	struct veo_udma_req *reqs;	// running broadcast: one request per peer
+	int n;
+	char *hp;		// VH source, advanced while staging
+	size_t len, lenp;
+	int split, slot;
+	size_t split_size;
+	pthread_mutex_t lock;	// staging, taken by the steps of all members
+};
+
 struct vh_udma_proc {
 	int ve_node_id;
 	int count;		// how often used/ referenced
@@ -39,32 +137,291 @@ struct vh_udma_proc {
 	uint64_t ve_udma_fini;	// address of function on VE
 	uint64_t ve_udma_send;	// address of function on VE
 	uint64_t ve_udma_recv;	// address of function on VE
-	uint64_t ve_udma_send_packed;	// address of function on VE
+	uint64_t ve_udma_send_strided;	// address of function on VE
+	uint64_t ve_udma_recv_strided;	// address of function on VE
+	uint64_t ve_udma_sendv;	// address of function on VE
+	uint64_t ve_udma_recvv;	// address of function on VE
+	uint64_t ve_udma_recv_pack;	// address of function on VE
+	uint64_t ve_udma_exchange;	// address of function on VE
+	uint64_t ve_udma_recv_bcast;	// address of function on VE
+	uint64_t ve_udma_agent;	// address of function on VE
+	uint64_t ve_udma_send_eager;	// address of function on VE
+	uint64_t ve_udma_recv_eager;	// address of function on VE
+	uint64_t ve_udma_shm_attach;	// address of function on VE
+	uint64_t ve_udma_shm_detach;	// address of function on VE
+	uint64_t ve_udma_pool_init;	// address of function on VE
+	uint64_t ve_udma_pool_fini;	// address of function on VE
+	uint64_t ve_udma_usrcc;	// address of function on VE
+	struct udma_pool *pool;	// shared split pool, or NULL
+	uint64_t bcast_vehva;	// broadcast segment on VE, 0: not attached
+	uint64_t bcast_ve_addr;
+	struct udma_tune *tune;	// split tables for this VE
+	double usrcc_mhz;	// measured VE usrcc frequency, 0: not yet
+	struct vh_udma_proc *next;
 };
 	
 struct vh_udma_comm {
 	volatile size_t *len;	// address of length mailbox
 	size_t buff_len;	// total buffer space length
 	void *shm;		// buffer inside the shared memory segment
+	void *eager;		// eager area in front of the length mailbox
 };
 
-struct udma_send_pack {
-	void *buff;		// pack buffer
-	size_t len;		// filled buffer space length
-	size_t buff_len;	// max buffer space length
-};
-
-struct udma_recv_entry {
-	uint64_t src;		// src address on VE
-	void *dst;		// dst address on VH
-	size_t len;		// block length
+/* one side of a vectored transfer, segments follow each other in the stream */
+struct udma_seg {
+	uint64_t addr;
+	size_t len;
 };
 
+/* recv pack entries, received like a vectored transfer */
 struct udma_recv_pack {
-	struct udma_recv_entry entries[UDMA_MAX_RECV_PACK];	// recv pack entries buffer
+	struct udma_seg *vseg;	// src buffers on VE
+	struct udma_seg *hseg;	// dst buffers on VH
 	int num_entries;	// number of entries
-	size_t data_len;	// length of packed buffer for the entries
-	size_t buff_len;	// max buffer space length
+	int max_entries;
+	size_t data_len;	// total length of the entries
+};
+
+/*
+  Strided layout of up to UDMA_MAX_DIMS dimensions: count[0] elements
+  of elem contiguous bytes, stride[0] bytes apart, form a row, count[1]
+  rows stride[1] bytes apart form a plane, and so on.
+*/
+struct udma_strided {
+	uint64_t base;		// address of the first element
+	size_t elem;		// contiguous bytes per element
+	int ndims;
+	size_t count[UDMA_MAX_DIMS];	// elements per dimension, [0] is innermost
+	size_t stride[UDMA_MAX_DIMS];	// bytes between elements per dimension
+};
+
+struct udma_seg_cursor {
+	struct udma_seg *seg;
+	int num;
+	int i;			// current segment
+	size_t offs;		// offset inside the current segment
+};
+
+/* user side description of a vectored transfer */
+struct veo_udma_iov {
+	void *hp;		// VH buffer
+	uint64_t vp;		// VE buffer
+	size_t len;
+};
+
+struct udma_host_blk {
+	size_t size;		// block size including header
+	struct udma_host_blk *next;	// next free block
+};
+
+struct udma_host_seg {
+	int key, segid;
+	void *addr;		// local address of the segment
+	size_t size;
+	uint64_t vehva;		// VEHVA of the segment on VE
+	uint64_t ve_addr;	// VE side attach address
+	struct udma_host_blk *free;	// address ordered free list
+	struct udma_host_seg *next;
+};
+
+struct udma_copy_pool {
+	int nthreads;
+	pthread_t *thr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	volatile unsigned long gen;	// job generation, bumped for each copy
+	volatile int exit;
+	char *dst;		// current job
+	const char *src;
+	size_t len, piece;
+	int npieces;
+	volatile int next;	// next piece to be taken
+	volatile int pending;	// pieces not copied, yet
+	volatile int policy;	// wait policy and idle polls of the peer
+	volatile int spin;
+};
+
+/* transfer request types, handled by the progress engine */
+enum udma_op {
+	UDMA_OP_SEND = 0,
+	UDMA_OP_RECV,
+	UDMA_OP_SEND_PACKED,
+	UDMA_OP_CALL,		// plain VE function call, vp is its address
+	UDMA_OP_STOP,		// agent command: leave the agent loop
+	UDMA_OP_EXCHANGE,	// send and receive at once, pair holds the receive
+	UDMA_OP_BCAST,		// send staged in the broadcast segment, zc is its VEHVA
+};
+
+/* one command of the VE agent, DMAed by the VE as a whole */
+struct udma_cmd {
+	uint64_t seq;		// command number
+	uint32_t op;		// enum udma_op
+	int32_t split;
+	uint64_t vp;		// VE side address
+	uint64_t len;
+	uint64_t split_size;
+	uint64_t zc;		// VEHVA of the host pool buffer, or 0
+	int32_t nseg;		// segments in the descriptor space, or 0
+	int32_t strided;	// strided VE layout in the descriptor space
+	int32_t eager;		// payload in the eager area
+	uint64_t result;	// written by the VE before done
+	volatile uint64_t done;	// seq of the completed command, written by the VE
+	uint64_t vp2;		// exchange: the VH receive part
+	uint64_t len2;
+	uint64_t split_size2;
+	uint64_t zc2;
+	int32_t split2;
+	int32_t pad32;
+	uint64_t pad[2];
+};
+
+/* command ring in shm, behind the descriptor space of the send half */
+struct udma_cmd_ring {
+	volatile uint64_t head;	// doorbell: seq of the last posted command
+	uint64_t pad[7];
+	struct udma_cmd cmd[UDMA_CMD_RING];
+};
+
+enum udma_req_state {
+	UDMA_REQ_QUEUED = 0,	// waiting in the peer's queue
+	UDMA_REQ_ACTIVE,	// VE side started, splits in flight
+	UDMA_REQ_DONE,		// completed, result is valid
+};
+
+/* how host threads wait for the VE */
+enum udma_wait_policy {
+	UDMA_WAIT_SPIN = 0,	// busy poll
+	UDMA_WAIT_YIELD,	// poll, sched_yield when idle for a while
+	UDMA_WAIT_SLEEP,	// poll, then yield, then sleep with growing backoff
+};
+
+struct udma_wait_conf {
+	int policy;		// enum udma_wait_policy
+	int spin;		// idle loops before backing off
+	long sleep_max_ns;	// max sleep of a backoff
+	int peek_every;		// check VE call results every n-th poll
+};
+
+/* time spent by host threads waiting for a peer */
+struct veo_udma_wait_stats {
+	uint64_t spin_ns;	// polling without progress
+	uint64_t yield_ns;	// in sched_yield
+	uint64_t sleep_ns;	// in nanosleep
+	uint64_t peeks;		// VE call results checked
+	uint64_t peeks_skipped;	// checks skipped by rate limiting
+};
+
+/* VE side counters of a peer, kept in its struct ve_udma_peer */
+struct udma_ve_stats {
+	uint64_t dma_posts;
+	uint64_t memcpy_cc;	// usrcc ticks copying between user buffers and mirror
+	uint64_t dma_poll_cc;	// usrcc ticks in ve_dma_poll()
+};
+
+/* counters of a peer, see veo_udma_get_stats() */
+struct veo_udma_stats {
+	uint64_t send_bytes;	// VH -> VE, by completed requests
+	uint64_t send_calls;
+	uint64_t recv_bytes;	// VE -> VH
+	uint64_t recv_calls;
+	uint64_t pack_commits;	// closed send packs and committed recv packs
+	uint64_t pack_fill;	// bytes in the send pack splits handed to the VE
+	uint64_t pack_space;	// their split space, fill ratio = pack_fill / pack_space
+	uint64_t adapt_trials;	// transfers trying a neighbouring split configuration
+	uint64_t adapt_switches;	// trials that replaced the configuration in use
+	uint64_t memcpy_ns;	// VH staging copies
+	uint64_t slot_wait_ns;	// VH waiting for free or filled split slots
+	uint64_t peek_ns;	// in veo_call_peek_result()
+	uint64_t ve_dma_posts;
+	uint64_t ve_memcpy_ns;	// VE copies between user buffers and the mirror
+	uint64_t ve_dma_poll_ns;	// VE in ve_dma_poll()
+	struct veo_udma_wait_stats wait;
+};
+
+/* trace events, UDMA_TRACE=<file> */
+enum {
+	UDMA_TR_REQ,		// VH: request from start to completion
+	UDMA_TR_WAIT,		// VH: waiting for a free or filled split slot
+	UDMA_TR_COPY,		// split copied between user buffer and staging
+	UDMA_TR_DMA,		// VE: DMA of a split from post to completion
+	UDMA_TR_ACK		// split handed over through the length mailbox
+};
+
+/* VE trace event, time and duration in usrcc ticks */
+struct udma_trace_ev {
+	uint64_t t;
+	uint32_t dur;
+	uint8_t ev;
+	uint8_t dir;		// 0: VH -> VE, 1: VE -> VH
+	uint16_t split;
+	uint64_t len;
+};
+
+/* VE trace events of the last VE call of a peer, in its recv control area */
+struct udma_trace_buf {
+	uint64_t n;
+	uint64_t dropped;	// events which didn't fit
+	struct udma_trace_ev ev[];
+};
+#define UDMA_TRACE_EVENTS ((UDMA_TRACE_SPACE - sizeof(struct udma_trace_buf)) \
+			   / sizeof(struct udma_trace_ev))
+
+/* online split adaptation state of one size bucket */
+struct udma_adapt {
+	int split;		// configuration in use, 0: not initialized
+	size_t size;
+	double bw;		// EWMA of its throughput [bytes/ns]
+	int count;		// transfers since the last trial
+	int trial;		// a trial request is in flight
+	unsigned next;		// next neighbour to try
+};
+
+struct vh_udma_peer;
+
+struct veo_udma_req {
+	int op;			// enum udma_op
+	volatile int state;	// enum udma_req_state
+	int async;		// request freed by test/wait
+	struct vh_udma_peer *up;
+	char *hp;		// VH side buffer, advanced while staging
+	uint64_t vp;		// VE side address
+	uint64_t zc;		// VEHVA of hp if in the host pool, 0 if staged
+	size_t len;		// total transfer length
+	size_t lenp;		// length not staged, yet
+	int split;		// number of split buffers
+	int slot;		// current split buffer
+	size_t split_size;
+	struct udma_strided *hs;	// strided VH side layout, NULL: contiguous hp
+	struct udma_strided *vs;	// strided VE side layout, NULL: contiguous vp
+	struct udma_seg_cursor *hc;	// VH side segments, NULL: contiguous hp
+	struct udma_seg *vseg;	// VE side segments, passed to the VE
+	int nvseg;
+	struct udma_adapt *adapt;	// size bucket if adapted, else NULL
+	int adapt_trial;	// request tries a neighbouring configuration
+	struct veo_args *argp;
+	uint64_t req;		// VEO request ID of the VE side call
+	uint64_t cmd;		// agent command seq, 0 if started by a VE call
+	int npeek;		// polls of the VE call, for rate limiting
+	int eager;		// payload passed through the eager area
+	char *sbuf;		// VH side split buffers of the transfer
+	int chunk, nchunk;	// pool chunks holding the splits, nchunk = 0: none
+	uint64_t t_start;	// start time [ns]
+	size_t result;		// transfered bytes
+	int err;		// 0 or negative error number
+	struct veo_udma_req *pair;	// exchange: the receive part
+	struct udma_bcast *bc;	// broadcast this request is part of
+	uint64_t t_slot;	// waiting for a split slot since, 0: not waiting
+	struct veo_udma_req *next;	// peer queue
+};
+
+/* send pack stream, entries are packed directly into the shm send splits */
+struct udma_send_pack {
+	struct veo_udma_req req;	// VE side unpacking, lenp > 0 while open
+	int open;
+	volatile int hold;	// VE side not called until the first split is full
+	size_t fill;		// filled space of the current split
+	size_t len;		// bytes handed to the VE
+	pthread_mutex_t lock;
 };
 
 struct vh_udma_peer {
@@ -73,72 +430,205 @@ struct vh_udma_peer {
 	struct udma_send_pack send_pack;
 	struct udma_recv_pack recv_pack;
 	struct veo_thr_ctxt *ctx;
-	int proc_id;
-	int shm_key, shm_segid;
+	struct vh_udma_proc *pp;
+	uint64_t ve_peer;	// address of this peer's struct ve_udma_peer on VE
+	int shm_key, shm_segid;	// shm_segid < 0: control slot in the pool
 	size_t shm_size;
-	void *shm_addr;
+	void *shm_addr;		// segment holding the peer's control areas
+	struct udma_pool *pool;	// shared split pool, or NULL
+	int ctl_slot;		// control slot in the pool
+	uint64_t ve_pool;	// passed to the VE, pool->ve_pool or 0
+	size_t buff_len;	// length of each half of a private segment
+	size_t split_space;	// max split * split_size of a transfer
+	int numa_node;		// host NUMA node the VE is attached to, -1: unknown
 	size_t max_pack_send;
 	size_t max_pack_recv;
-	pthread_mutex_t lock;
+	int max_segs;		// max segments per vectored VE call
+	size_t eager_len;	// max length of eager transfers
+	struct udma_wait_conf wait;	// wait policy
+	struct veo_udma_stats stats;	// wait time accounting included
+	struct udma_seg *desc;	// VE side segments in shm, behind the send splits
+	struct udma_cmd_ring *cmd;	// agent command ring in shm, behind desc
+	int agent;		// transfers go through the VE agent
+	uint64_t agent_req;	// VEO request ID of the running agent, or 0
+	struct veo_args *agent_argp;
+	uint64_t cmd_seq;	// last posted agent command
+	pthread_mutex_t lock;	// recv pack
+	pthread_mutex_t q_lock;	// request queue, transfer and agent state, see udma_progress()
+	struct veo_udma_req *q_head, *q_tail;	// request queue
+	struct udma_host_seg *host_segs;	// zero-copy host pool
+	struct udma_copy_pool *copy_pool;	// staging memcpy workers, or NULL
+	double bw_send, bw_recv;	// measured throughput [bytes/ns]
+	struct udma_adapt adapt[2][UDMA_ADAPT_BUCKETS];	// send, recv
+	int set_split[2];	// send, recv splits of veo_udma_peer_set_split(), 0: tables
+	size_t set_split_size[2];
+	struct vh_udma_peer *pnext;	// list of peers seen by the progress engine
+	int id;			// peer ID
+	struct udma_trace_buf *trace;	// VE trace events in shm, NULL: no tracing
+	uint64_t trace_t0, trace_cc0;	// VH time and VE usrcc of the same moment
+	double trace_mhz;	// VE usrcc frequency fitted by _udma_trace_sync()
 };
 
 struct ve_udma_comm {
 	uint64_t len_vehva;	// start address of length mailbox (UDMA_MAX_SPLIT words)
 	size_t buff_len;	// total buffer space length
-	uint64_t shm_vehva;	// start of buffer space in shm segment vehva
-	uint64_t buff_vehva;	// address of mirror buffer in 
+	uint64_t shm_vehva;	// start of the splits in shm segment vehva
+	uint64_t buff_vehva;	// address of the splits in the mirror buffer
 	void *buff;
+	size_t eager_offs;	// offset of the eager area in the segment
+};
+
+/* VH shm segment attached on VE, with a mirror buffer of the same layout */
+struct ve_udma_seg {
+	int shm_key, shm_segid;
+	size_t shm_size;	// remote shared memory segment size
+	uint64_t shm_vehva;	// VEHVA of remote shared memory segment
+	void *shm_remote_addr;	// remote address
+	void *buff;		// mirror buffer
+	uint64_t buff_vehva;
 };
 
 struct ve_udma_peer {
 	struct ve_udma_comm send;
 	struct ve_udma_comm recv;
-	pthread_mutex_t lock;
+	struct ve_udma_seg own;	// private segment, unused with a pool
+	struct ve_udma_seg *seg;	// &own or the shared pool
+	int shared;		// splits are placed per transfer
+	size_t desc_offs;	// offset of the descriptor space in the segment
+	size_t cmd_offs;	// offset of the command ring in the segment
+	struct udma_ve_stats stats;
+	struct udma_trace_buf *trace;	// trace events in the mirror, or NULL
+	size_t trace_offs;	// offset of the trace events in the segment
 };
 
 /*
-  Put len bytes from src onto the sending pack buffer,
+  Put len bytes from src into the pack buffer buff at offset *fill,
   preceeded by destination address and length. Round up length to 8 byte boundary.
 
   Returns 0 if successful, negative number -ENOMEM if buffer didn't fit.
 */
-static inline int _buffer_send_pack(struct udma_send_pack *pb, void *src, uint64_t dst, size_t len)
+static inline int _buffer_send_pack(void *buff, size_t buff_len, size_t *fill,
+				    void *src, uint64_t dst, size_t len)
 {
-	uint64_t *b = (uint64_t *)((uint64_t)pb->buff + pb->len);
+	uint64_t *b = (uint64_t *)((uint64_t)buff + *fill);
 
-	if (pb->len + 2 * sizeof(uint64_t) + ALIGN8B(len) > pb->buff_len)
+	if (*fill + 2 * sizeof(uint64_t) + ALIGN8B(len) > buff_len)
 		return -ENOMEM;
 	*b = dst;
 	b++;
 	*b = len;
 	b++;
 	memcpy((void *)b, src, len);
-	pb->len += 2 * sizeof(uint64_t) + ALIGN8B(len);
+	*fill += 2 * sizeof(uint64_t) + ALIGN8B(len);
 	return 0;
 }
 
 /*
-  Check if len bytes would still fit into the recv pack buffer, or num_entries is too large.
-  Round up length to 8 byte boundary. If yes, put a recv_entry into the recv_pack buffer.
+  Add an entry to the recv pack list, unless it is full.
 
-  Returns 0 if successful, negative number -ENOMEM if buffer didn't fit.
+  Returns 0 if successful, negative number -ENOMEM if the list is full.
 */
 static inline int _buffer_recv_pack(struct udma_recv_pack *pb, uint64_t src, void *dst, size_t len)
 {
 	int i = pb->num_entries;
 
-	if (pb->data_len + ALIGN8B(len) > pb->buff_len || i == UDMA_MAX_RECV_PACK)
+	if (i == pb->max_entries)
 		return -ENOMEM;
 
 	/* add entry */
-	pb->entries[i].src = src;
-	pb->entries[i].dst = dst;
-	pb->entries[i].len = len;
-	pb->data_len += ALIGN8B(len);
+	pb->vseg[i].addr = src;
+	pb->vseg[i].len = len;
+	pb->hseg[i].addr = (uint64_t)dst;
+	pb->hseg[i].len = len;
+	pb->data_len += len;
 	pb->num_entries++;
 	return 0;
 }
 
+/*
+  Copy len bytes between the linear buffer lin and the strided layout s,
+  starting at byte offset offs of the linear stream. Scatter into the
+  layout if to_strided is set, gather from it otherwise. Used for the
+  staging copies on VH and the mirror buffer copies on VE.
+*/
+static inline void _strided_copy(const struct udma_strided *s, size_t offs, void *lin,
+				 size_t len, int to_strided)
+{
+	size_t idx[UDMA_MAX_DIMS], e = offs / s->elem, in = offs % s->elem, n, k, i;
+	uint64_t *l, *q;
+	char *p;
+	int d;
+
+	for (d = 0; d < s->ndims; d++) {
+		idx[d] = e % s->count[d];
+		e /= s->count[d];
+	}
+	while (len > 0) {
+		p = (char *)s->base + in;
+		for (d = 0; d < s->ndims; d++)
+			p += idx[d] * s->stride[d];
+		/* 8 byte elements: one vectorizable loop for the rest of the row */
+		if (in == 0 && s->elem == sizeof(uint64_t) && s->stride[0] % 8 == 0
+		    && ((uint64_t)p | (uint64_t)lin) % 8 == 0) {
+			k = MIN(s->count[0] - idx[0], len / 8);
+			if (k > 0) {
+				l = (uint64_t *)lin;
+				q = (uint64_t *)p;
+				if (to_strided)
+					for (i = 0; i < k; i++)
+						q[i * (s->stride[0] / 8)] = l[i];
+				else
+					for (i = 0; i < k; i++)
+						l[i] = q[i * (s->stride[0] / 8)];
+				idx[0] += k - 1;
+				n = k * 8;
+				goto next;
+			}
+		}
+		n = MIN(s->elem - in, len);
+		if (to_strided)
+			memcpy(p, lin, n);
+		else
+			memcpy(lin, p, n);
+	next:
+		lin = (char *)lin + n;
+		len -= n;
+		in = 0;
+		for (d = 0; d < s->ndims; d++) {
+			if (++idx[d] < s->count[d])
+				break;
+			idx[d] = 0;
+		}
+	}
+}
+
+/*
+  Copy len bytes between the linear buffer lin and the next bytes of the
+  segment list of cursor c, advancing the cursor. Scatter into the
+  segments if to_segs is set, gather from them otherwise.
+*/
+static inline void _seg_copy(struct udma_seg_cursor *c, void *lin, size_t len, int to_segs)
+{
+	size_t n;
+	char *p;
+
+	while (len > 0 && c->i < c->num) {
+		n = MIN(c->seg[c->i].len - c->offs, len);
+		p = (char *)c->seg[c->i].addr + c->offs;
+		if (to_segs)
+			memcpy(p, lin, n);
+		else
+			memcpy(lin, p, n);
+		lin = (char *)lin + n;
+		len -= n;
+		c->offs += n;
+		if (c->offs == c->seg[c->i].len) {
+			c->i++;
+			c->offs = 0;
+		}
+	}
+}
+
 static inline int _buffer_send_unpack(void *buff, size_t buff_len)
 {
 	void *dst;
@@ -164,9 +654,44 @@ static inline int _buffer_send_unpack(void *buff, size_t buff_len)
 
 int veo_udma_peer_init(int ve_node_id, struct veo_proc_handle *proc,
 		       struct veo_thr_ctxt *ctx, uint64_t lib_handle);
+int veo_udma_peer_init_buff(int ve_node_id, struct veo_proc_handle *proc,
+			    struct veo_thr_ctxt *ctx, uint64_t lib_handle,
+			    size_t buff_len, int shared);
 int veo_udma_peer_fini(int peer_id);
 size_t veo_udma_send(struct veo_thr_ctxt *ctx, void *src, uint64_t dst, size_t len);
 size_t veo_udma_recv(struct veo_thr_ctxt *ctx, uint64_t src, void *dst, size_t len);
+size_t veo_udma_exchange(struct veo_thr_ctxt *ctx, void *send_src, uint64_t send_dst,
+			 size_t send_len, uint64_t recv_src, void *recv_dst, size_t recv_len);
+struct veo_udma_req *veo_udma_send_async(struct veo_thr_ctxt *ctx, void *src,
+					 uint64_t dst, size_t len);
+struct veo_udma_req *veo_udma_recv_async(struct veo_thr_ctxt *ctx, uint64_t src,
+					 void *dst, size_t len);
+size_t veo_udma_send_strided(struct veo_thr_ctxt *ctx, void *src, const size_t *src_strides,
+			     uint64_t dst, const size_t *dst_strides,
+			     size_t elem, int ndims, const size_t *counts);
+size_t veo_udma_recv_strided(struct veo_thr_ctxt *ctx, uint64_t src, const size_t *src_strides,
+			     void *dst, const size_t *dst_strides,
+			     size_t elem, int ndims, const size_t *counts);
+size_t veo_udma_sendv(struct veo_thr_ctxt *ctx, const struct veo_udma_iov *iov, int iovcnt);
+size_t veo_udma_recvv(struct veo_thr_ctxt *ctx, const struct veo_udma_iov *iov, int iovcnt);
+size_t veo_udma_send_striped(int npeers, const int *peers, void *src, uint64_t dst, size_t len);
+size_t veo_udma_recv_striped(int npeers, const int *peers, uint64_t src, void *dst, size_t len);
+size_t veo_udma_bcast(int npeers, const int *peers, void *src, const uint64_t *dsts, size_t len);
+size_t veo_udma_gather(int npeers, const int *peers, const uint64_t *srcs,
+		       const size_t *lens, void *dst);
+int veo_udma_test(struct veo_udma_req *req, size_t *len);
+size_t veo_udma_wait(struct veo_udma_req *req);
+int veo_udma_waitall(int n, struct veo_udma_req **reqs, size_t *lens);
+int veo_udma_calibrate(int peer, size_t max_len, int save);
+int veo_udma_peer_set_copy_threads(int peer, int nthreads, const int *cpus, int ncpus);
+int veo_udma_peer_set_agent(int peer, int on);
+int veo_udma_peer_set_wait(int peer, int policy, int spin, long sleep_us, int peek_every);
+int veo_udma_peer_set_split(int peer, int split_send, size_t size_send, int split_recv,
+			    size_t size_recv);
+int veo_udma_peer_get_wait_stats(int peer, struct veo_udma_wait_stats *st);
+int veo_udma_get_stats(int peer, struct veo_udma_stats *st);
+void *veo_udma_alloc_host(int peer, size_t size);
+int veo_udma_free_host(int peer, void *ptr);
 int veo_udma_send_pack(int peer, void *src, uint64_t dst, size_t len);
 int veo_udma_send_pack_commit(int peer);
 int veo_udma_recv_pack(int peer, uint64_t src, void *dst, size_t len);